@@ -29,17 +29,124 @@
 #include <linux/time.h>
 #include <linux/fs.h>
 #include <linux/uaccess.h>
+#include <linux/slab.h>
+#include <linux/atomic.h>
+#include <linux/filter.h>
+#include <linux/mutex.h>
+#include <linux/spinlock.h>
+#include <linux/list.h>
+#include <linux/rcupdate.h>
+#include <linux/capability.h>
+#include <linux/version.h>
+#include <linux/uio.h>
+#include <linux/splice.h>
+#include <linux/pipe_fs_i.h>
+#include <linux/mm.h>
+#include <linux/iio/iio.h>
+#include <linux/iio/buffer.h>
+#include <linux/iio/trigger.h>
+#include <linux/iio/triggered_buffer.h>
+#include <linux/iio/trigger_consumer.h>
+#include <linux/seqlock.h>
+
+#include "rfrpi.h"
+#include "evlog.h"
+
+#define CREATE_TRACE_POINTS
+#include "rfrpi_trace.h"
 
 #define GPIO_FOR_RX_SIGNAL	18
 #define DEV_NAME 			"rfrpi" 
 #define BUFFER_SZ			512 
+#define RECORD_MAX			24	// longest text line or binary record
+
+/* Pulse width clustering, widths are compared as Q8 log2 values */
+#define CLUSTER_RATE		16	// centroids move 1/16 of the error
+static const u32 clusterSeed[RFRPI_NB_CLASSES] = { 300, 1000, 5000 };
 
 /* Last Interrupt timestamp */
 static struct timespec lastIrq_time;
-static unsigned long lastDelta[BUFFER_SZ];
-static int  pRead;
-static int  pWrite;
-static int  wasOverflow;
+static unsigned long lastWidth;
+static u32  edgeSeq;
+static struct rfrpi_edge edges[BUFFER_SZ];
+static s64 edgeStamp[BUFFER_SZ];	// edge time in ns, for the IIO buffer
+
+/*
+ * Number of records ever written, the next slot is wSeq & (BUFFER_SZ-1).
+ * The ISR is the only writer; readers never modify the ring, each open
+ * file keeps its own position in a struct rx433_reader.
+ */
+static u32  wSeq;
+static atomic_t nbReaders = ATOMIC_INIT(0);
+static atomic_t nbLost = ATOMIC_INIT(0);	// ring overwrites, see rx_count_lost()
+
+/* Live reader cursors, walked by the ISR to count overwritten records */
+static LIST_HEAD(rxReaders);
+static DEFINE_SPINLOCK(readersLock);
+
+/* Capture filter, run by the ISR before a record is queued */
+static struct bpf_prog __rcu *rxFilter;
+static DEFINE_MUTEX(filter_lock);
+static u32  nbFiltered;
+
+/* IIO device, fed from its own reader cursor */
+static struct iio_dev *rxIio;
+static struct iio_trigger *rxTrig;
+static int  iioOn;
+
+/* Online k-means over log widths, only run when clusterOn is set */
+static int  clusterOn;
+static u32  centroid[RFRPI_NB_CLASSES];
+static u32  clusterHits[RFRPI_NB_CLASSES];
+
+/* Event log, cat /sys/kernel/debug/rfrpi/events */
+enum {
+	EV_OVERFLOW,		// records lost, reader overflow episodes
+};
+
+static const char * const evNames[] = {
+	"overflow",
+};
+
+static struct evlog rxLog;
+
+/*
+ * Input capture of a periodic signal, only run when captureOn is set.
+ * The ISR keeps sums over the last captureAvg periods (or over each gate
+ * of captureGateMs) and publishes them in capResult, the sysfs readers
+ * turn them into period, frequency and duty.
+ */
+#define CAPTURE_AVG_MAX		64
+static int  captureOn;
+static u32  captureAvg = 8;
+static u32  captureGateMs;		// 0 : moving average of captureAvg periods
+static DEFINE_MUTEX(capture_lock);
+static u32  capHigh[CAPTURE_AVG_MAX];
+static u32  capLow[CAPTURE_AVG_MAX];
+static u32  capPos;
+static u32  capCount;			// periods in the sums
+static u64  capSumHigh;
+static u64  capSumLow;
+static u32  capPending;			// high time waiting for its low time
+static int  capLevel;
+static seqcount_t capSeq;
+static struct {
+	u64 sumHigh;			// us
+	u64 sumLow;			// us
+	u32 periods;
+	s64 stamp;			// ns, when published
+} capResult;
+
+/* Per open file state */
+struct rx433_reader {
+	u32 rSeq;		// next record to read
+	u32 lost;		// records overwritten before being read
+	u32 overflows;		// overflow episodes
+	int wasOverflow;
+	u32 format;		// RFRPI_FMT_xxx
+	struct mutex lock;	// serializes readers sharing this file
+	struct list_head node;	// on rxReaders
+};
 
 
 /* Define GPIOs for RX signal */
@@ -50,6 +157,191 @@ static struct gpio signals[] = {
 /* Later on, the assigned IRQ numbers for the buttons are stored here */
 static int rx_irqs[] = { -1 };
 
+/* RX line, can be moved to a loopback or simulated line for testing */
+static int rx_gpio = GPIO_FOR_RX_SIGNAL;
+module_param(rx_gpio, int, 0444);
+MODULE_PARM_DESC(rx_gpio, "GPIO carrying the RX signal (default 18)");
+
+/*
+ * Capture counters for companion modules such as rfrpi_gen:
+ * edges seen by the ISR, edges dropped by the filter and records the
+ * ring overwrote before its oldest reader got them, or at all when no
+ * reader is open.
+ */
+void rfrpi_get_counters(u32 *edges, u32 *filtered, u32 *lost)
+{
+	*edges = READ_ONCE(edgeSeq);
+	*filtered = READ_ONCE(nbFiltered);
+	*lost = atomic_read(&nbLost);
+}
+EXPORT_SYMBOL_GPL(rfrpi_get_counters);
+
+/* log2(x) in Q8, the fraction is the linear mantissa, x > 0 */
+static u32 rx_log2(u32 x)
+{
+	int msb = fls(x) - 1;
+	u32 frac;
+
+	if (msb >= 8)
+		frac = x >> (msb - 8);
+	else
+		frac = x << (8 - msb);
+	return (msb << 8) | (frac & 0xff);
+}
+
+static void rx_cluster_reset(void)
+{
+	int k;
+
+	for (k = 0; k < RFRPI_NB_CLASSES; k++) {
+		centroid[k] = rx_log2(clusterSeed[k]);
+		clusterHits[k] = 0;
+	}
+}
+
+/*
+ * One incremental k-means step: move the nearest centroid towards the
+ * width and return its class, classes are numbered by centroid rank so
+ * the shortest one is always RFRPI_SYM_SHORT.
+ */
+static u16 rx_cluster(u32 width)
+{
+	u32 x, d, best_d = ~0U;
+	int k, best = 0;
+	u16 sym = RFRPI_SYM_SHORT;
+
+	if (!width)
+		return RFRPI_SYM_NONE;
+	x = rx_log2(width);
+	for (k = 0; k < RFRPI_NB_CLASSES; k++) {
+		d = abs((s32)(x - centroid[k]));
+		if (d < best_d) {
+			best_d = d;
+			best = k;
+		}
+	}
+	centroid[best] += (s32)(x - centroid[best]) / CLUSTER_RATE;
+	clusterHits[best]++;
+
+	for (k = 0; k < RFRPI_NB_CLASSES; k++)
+		if (centroid[k] < centroid[best])
+			sym++;
+	return sym;
+}
+
+static void rx_capture_reset(void)
+{
+	capPos = 0;
+	capCount = 0;
+	capSumHigh = 0;
+	capSumLow = 0;
+	capPending = 0;
+	capLevel = -1;
+	write_seqcount_begin(&capSeq);
+	memset(&capResult, 0, sizeof(capResult));
+	write_seqcount_end(&capSeq);
+}
+
+static void rx_capture_publish(s64 now)
+{
+	write_seqcount_begin(&capSeq);
+	capResult.sumHigh = capSumHigh;
+	capResult.sumLow = capSumLow;
+	capResult.periods = capCount;
+	capResult.stamp = now;
+	write_seqcount_end(&capSeq);
+}
+
+/*
+ * Input capture step. A period is a high time followed by a low time,
+ * it is complete on the next rising edge: level is the line after the
+ * edge and width how long the previous level lasted.
+ */
+static void rx_capture(u32 width, int level, s64 now)
+{
+	u32 high;
+
+	// two edges to the same level, one was missed: drop the half period
+	if (level == capLevel) {
+		capPending = 0;
+		return;
+	}
+	capLevel = level;
+	if (!level) {
+		capPending = max_t(u32, width, 1);
+		return;
+	}
+	if (!capPending)
+		return;
+	high = capPending;
+	capPending = 0;
+
+	if (captureGateMs) {
+		capSumHigh += high;
+		capSumLow += width;
+		capCount++;
+		if (capSumHigh + capSumLow >= (u64)captureGateMs * 1000) {
+			rx_capture_publish(now);
+			capSumHigh = 0;
+			capSumLow = 0;
+			capCount = 0;
+		}
+		return;
+	}
+
+	if (capCount == captureAvg) {
+		capSumHigh -= capHigh[capPos];
+		capSumLow -= capLow[capPos];
+	} else
+		capCount++;
+	capHigh[capPos] = high;
+	capLow[capPos] = width;
+	capSumHigh += high;
+	capSumLow += width;
+	if (++capPos == captureAvg)
+		capPos = 0;
+	rx_capture_publish(now);
+}
+
+/*
+ * Called by the ISR once record w-1 is published: the ring keeps
+ * BUFFER_SZ-1 records, one more is lost if the reader furthest behind
+ * (or anybody, with no reader) now falls out of it.
+ */
+static void rx_count_lost(u32 w)
+{
+	struct rx433_reader *rd;
+	u32 behind = w;
+
+	spin_lock(&readersLock);
+	if (!list_empty(&rxReaders)) {
+		behind = 0;
+		list_for_each_entry(rd, &rxReaders, node)
+			behind = max(behind, w - READ_ONCE(rd->rSeq));
+	}
+	spin_unlock(&readersLock);
+	if (behind >= BUFFER_SZ)
+		atomic_inc(&nbLost);
+}
+
+static void rx_reader_add(struct rx433_reader *rd)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&readersLock, flags);
+	list_add(&rd->node, &rxReaders);
+	spin_unlock_irqrestore(&readersLock, flags);
+}
+
+static void rx_reader_del(struct rx433_reader *rd)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&readersLock, flags);
+	list_del(&rd->node);
+	spin_unlock_irqrestore(&readersLock, flags);
+}
+
 /*
  * The interrupt service routine called on every pin status change
  */
@@ -58,35 +350,140 @@ static irqreturn_t rx_isr(int irq, void *data)
    	struct timespec current_time;
     struct timespec delta;
    	unsigned long ns;
+	struct rfrpi_filter_data fd;
+	struct rfrpi_edge *e;
+	struct bpf_prog *prog;
+	u32 verdict = RFRPI_FILTER_KEEP;
 
+	trace_rfrpi_irq_entry(irq);
    	getnstimeofday(&current_time);
 	delta = timespec_sub(current_time, lastIrq_time);
 	ns = ((long long)delta.tv_sec * 1000000)+(delta.tv_nsec/1000); 
-	lastDelta[pWrite] = ns;
    	getnstimeofday(&lastIrq_time);
 
-	pWrite = ( pWrite + 1 )  & (BUFFER_SZ-1);
-	if (pWrite == pRead) {
-		// overflow
-		pRead = ( pRead + 1 ) & (BUFFER_SZ-1);
-		if ( wasOverflow == 0 ) {
-	       printk(KERN_ERR "RFRPI - Buffer Overflow - IRQ will be missed");
-	       wasOverflow = 1;
-	    }
-	} else {
-		wasOverflow = 0;
+	fd.width = ns;
+	fd.level = gpio_get_value(signals[0].gpio);
+	fd.seq = edgeSeq++;
+	fd.prev_width = lastWidth;
+	lastWidth = ns;
+
+	// the capture sees every edge, the filter only applies to the ring
+	if (READ_ONCE(captureOn))
+		rx_capture(fd.width, fd.level, timespec_to_ns(&current_time));
+
+	rcu_read_lock();
+	prog = rcu_dereference(rxFilter);
+	if (prog)
+		verdict = BPF_PROG_RUN(prog, &fd);
+	rcu_read_unlock();
+	if (verdict == RFRPI_FILTER_DROP) {
+		nbFiltered++;
+		trace_rfrpi_irq_exit(fd.width, fd.level, verdict);
+		return IRQ_HANDLED;
 	}
+
+	e = &edges[wSeq & (BUFFER_SZ-1)];
+	e->width = fd.width;
+	e->level = fd.level;
+	e->symbol = clusterOn ? rx_cluster(fd.width) : RFRPI_SYM_NONE;
+	e->seq = fd.seq;
+	e->tag = (verdict == RFRPI_FILTER_KEEP) ? 0 : verdict;
+	edgeStamp[wSeq & (BUFFER_SZ-1)] = timespec_to_ns(&current_time);
+	trace_rfrpi_enqueue(wSeq, e);
+
+	// publish the record before moving the write sequence
+	smp_wmb();
+	WRITE_ONCE(wSeq, wSeq + 1);
+	rx_count_lost(wSeq);
+
+	if (READ_ONCE(iioOn))
+		iio_trigger_poll(rxTrig);
+	trace_rfrpi_irq_exit(fd.width, fd.level, verdict);
 	return IRQ_HANDLED;
 }
 
+static struct rx433_reader iioReader;
+
+/*
+ * Get the next record for a reader without locking against the ISR.
+ * A slot is only trusted when the writer is less than a full ring ahead
+ * after it has been copied, so the usable depth is BUFFER_SZ-1 records
+ * as with the former single reader queue.
+ * The record is not consumed, the caller moves rd->rSeq once it has
+ * been handed to user space.
+ * stamp may be NULL when the caller does not need the edge time.
+ * return 0 : ring empty for this reader
+ * return 1 : *edge is valid
+ */
+static int rx433_peek(struct rx433_reader *rd, struct rfrpi_edge *edge,
+		s64 *stamp)
+{
+	u32 w, behind;
+
+	for (;;) {
+		w = READ_ONCE(wSeq);
+		smp_rmb();
+		if (w == rd->rSeq) {
+			rd->wasOverflow = 0;
+			return 0;
+		}
+		behind = w - rd->rSeq;
+		if (behind >= BUFFER_SZ) {
+			// overflow, jump to the oldest record still in the ring
+			rd->lost += behind - (BUFFER_SZ-1);
+			WRITE_ONCE(rd->rSeq, w - (BUFFER_SZ-1));
+			if ( rd->wasOverflow == 0 ) {
+				rd->overflows++;
+				evlog_write(&rxLog, EV_OVERFLOW,
+					behind - (BUFFER_SZ-1), rd->overflows);
+				rd->wasOverflow = 1;
+			}
+			trace_rfrpi_overflow(rd, behind - (BUFFER_SZ-1), rd->overflows);
+			continue;
+		}
+		*edge = edges[rd->rSeq & (BUFFER_SZ-1)];
+		if (stamp)
+			*stamp = edgeStamp[rd->rSeq & (BUFFER_SZ-1)];
+		smp_rmb();
+		// the ISR may have reused the slot while we copied it
+		if (READ_ONCE(wSeq) - rd->rSeq >= BUFFER_SZ)
+			continue;
+		return 1;
+	}
+}
+
+
+/* Hand the record returned by rx433_peek() over, move to the next one */
+static inline void rx433_consume(struct rx433_reader *rd,
+		const struct rfrpi_edge *edge)
+{
+	trace_rfrpi_dequeue(rd, rd->rSeq, READ_ONCE(wSeq) - rd->rSeq - 1,
+		edge->width);
+	WRITE_ONCE(rd->rSeq, rd->rSeq + 1);
+}
 
 static int rx433_open(struct inode *inode, struct file *file)
 {
+	struct rx433_reader *rd;
+
+	rd = kzalloc(sizeof(*rd), GFP_KERNEL);
+	if (!rd)
+		return -ENOMEM;
+	// start at the live position, older records belong to other readers
+	rd->rSeq = READ_ONCE(wSeq);
+	rd->format = RFRPI_FMT_TEXT;
+	mutex_init(&rd->lock);
+	file->private_data = rd;
+	rx_reader_add(rd);
+	atomic_inc(&nbReaders);
     return nonseekable_open(inode, file);
 }
 
 static int rx433_release(struct inode *inode, struct file *file)
 {
+	atomic_dec(&nbReaders);
+	rx_reader_del(file->private_data);
+	kfree(file->private_data);
     return 0;
 }
 
@@ -96,45 +493,764 @@ static ssize_t rx433_write(struct file *file, const char __user *buf,
 	return -EINVAL;
 }
 
-static ssize_t rx433_read(struct file *file, char __user *buf,
-                size_t count, loff_t *pos)
+/*
+ * Write one record in the reader format, dst holds RECORD_MAX bytes.
+ * Returns the record length.
+ */
+static int rx433_format(struct rx433_reader *rd, const struct rfrpi_edge *edge,
+		char *dst)
 {
-	// returns one of the line with the time between two IRQs
+	if (rd->format == RFRPI_FMT_BINARY) {
+		memcpy(dst, edge, sizeof(*edge));
+		return sizeof(*edge);
+	}
+	if (rd->format == RFRPI_FMT_SYMBOL) {
+		dst[0] = "?SLY"[edge->symbol & 3];
+		if (edge->symbol != RFRPI_SYM_SYNC)
+			return 1;
+		dst[1] = '\n';
+		return 2;
+	}
+	if (edge->tag)
+		return snprintf(dst, RECORD_MAX, "%u %u\n", edge->width, edge->tag);
+	return snprintf(dst, RECORD_MAX, "%u\n", edge->width);
+}
+
+static ssize_t rx433_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+	// returns as many whole records as fit in the (scattered) buffer
 	// return 0 : end of reading
 	// return >0 : size
 	// return -EFAULT : error
-	char tmp[256];
-	int _count;
-	int _error_count;
+	// return -EINVAL : buffer smaller than the next record
+	struct rx433_reader *rd = iocb->ki_filp->private_data;
+	char tmp[RECORD_MAX];
+	struct rfrpi_edge edge;
+	ssize_t total = 0;
+	int len;
+
+	mutex_lock(&rd->lock);
+	while ( rx433_peek(rd, &edge, NULL) ) {
+		len = rx433_format(rd, &edge, tmp);
+		if (len > iov_iter_count(to)) {
+			// 0 would read as end of file
+			if (!total)
+				total = -EINVAL;
+			break;
+		}
+		if (copy_to_iter(tmp, len, to) != len) {
+			printk(KERN_ERR "RFRPI - Error writing to char device");
+			if (!total)
+				total = -EFAULT;
+			break;
+		}
+		rx433_consume(rd, &edge);
+		total += len;
+	}
+	mutex_unlock(&rd->lock);
+	return total;
+}
+
+/*
+ * splice support: records are formatted straight into pages that are
+ * handed over to the pipe, so a capture can go pipe -> file without
+ * ever being copied to user space.
+ */
+static void rx433_pipe_buf_release(struct pipe_inode_info *pipe,
+		struct pipe_buffer *buf)
+{
+	put_page(buf->page);
+}
+
+static const struct pipe_buf_operations rx433_pipe_buf_ops = {
+	.can_merge = 0,
+	.confirm = generic_pipe_buf_confirm,
+	.release = rx433_pipe_buf_release,
+	.steal = generic_pipe_buf_steal,
+	.get = generic_pipe_buf_get,
+};
+
+static void rx433_spd_release(struct splice_pipe_desc *spd, unsigned int i)
+{
+	put_page(spd->pages[i]);
+}
+
+/*
+ * Fill up to room bytes of dst with whole records, returns bytes used.
+ * first is the sequence of the first record put in dst.
+ */
+static size_t rx433_fill(struct rx433_reader *rd, char *dst, size_t room,
+		u32 *first)
+{
+	char tmp[RECORD_MAX];
+	struct rfrpi_edge edge;
+	size_t used = 0;
+	int len;
+
+	while ( rx433_peek(rd, &edge, NULL) ) {
+		len = rx433_format(rd, &edge, tmp);
+		if (len > room - used)
+			break;
+		if (!used)
+			*first = rd->rSeq;
+		memcpy(dst + used, tmp, len);
+		rx433_consume(rd, &edge);
+		used += len;
+	}
+	return used;
+}
+
+static ssize_t rx433_splice_read(struct file *file, loff_t *ppos,
+		struct pipe_inode_info *pipe, size_t len, unsigned int flags)
+{
+	struct rx433_reader *rd = file->private_data;
+	struct page *pages[PIPE_DEF_BUFFERS];
+	struct partial_page partial[PIPE_DEF_BUFFERS];
+	struct splice_pipe_desc spd = {
+		.pages = pages,
+		.partial = partial,
+		.nr_pages_max = PIPE_DEF_BUFFERS,
+		.flags = flags,
+		.ops = &rx433_pipe_buf_ops,
+		.spd_release = rx433_spd_release,
+	};
+	u32 first[PIPE_DEF_BUFFERS];
+	unsigned int room, nr, i;
+	struct page *page;
+	size_t used, taken;
+	ssize_t ret;
+
+	// only fill what the pipe can hold
+	room = min_t(unsigned int, PIPE_DEF_BUFFERS,
+			pipe->buffers - READ_ONCE(pipe->nrbufs));
+
+	mutex_lock(&rd->lock);
+	while (len && spd.nr_pages < room) {
+		page = alloc_page(GFP_KERNEL);
+		if (!page)
+			break;
+		used = rx433_fill(rd, page_address(page),
+				min_t(size_t, len, PAGE_SIZE), &first[spd.nr_pages]);
+		if (!used) {
+			__free_page(page);
+			break;
+		}
+		pages[spd.nr_pages] = page;
+		partial[spd.nr_pages].offset = 0;
+		partial[spd.nr_pages].len = used;
+		spd.nr_pages++;
+		len -= used;
+		// stop once the ring is drained
+		if (READ_ONCE(wSeq) == rd->rSeq)
+			break;
+	}
+
+	if (!spd.nr_pages) {
+		mutex_unlock(&rd->lock);
+		return 0;
+	}
+	/*
+	 * The pipe may take fewer pages than were filled (full, or
+	 * nonblocking): the cursor goes back to the first record of the
+	 * first page it refused, those records are read again. The lock is
+	 * held so no other reader of this file moves the cursor meanwhile.
+	 * splice_to_pipe() counts spd.nr_pages down.
+	 */
+	nr = spd.nr_pages;
+	ret = splice_to_pipe(pipe, &spd);
+	for (i = 0, taken = 0; i < nr; i++) {
+		taken += partial[i].len;
+		if (ret <= 0 || taken > (size_t)ret) {
+			rd->rSeq = first[i];
+			break;
+		}
+	}
+	mutex_unlock(&rd->lock);
+	return ret;
+}
+
+/*
+ * Check a classic BPF capture filter, like seccomp does for its own
+ * programs: only 32 bit absolute loads inside struct rfrpi_filter_data
+ * are allowed and they are turned into loads from the context.
+ */
+static int rx433_check_filter(struct sock_filter *filter, unsigned int flen)
+{
+	int pc;
+
+	for (pc = 0; pc < flen; pc++) {
+		struct sock_filter *ftest = &filter[pc];
+		u32 k = ftest->k;
+
+		switch (ftest->code) {
+		case BPF_LD | BPF_W | BPF_ABS:
+			ftest->code = BPF_LDX | BPF_W | BPF_ABS;
+			if (k >= sizeof(struct rfrpi_filter_data) || k & 3)
+				return -EINVAL;
+			continue;
+		case BPF_LD | BPF_W | BPF_LEN:
+			ftest->code = BPF_LD | BPF_IMM;
+			ftest->k = sizeof(struct rfrpi_filter_data);
+			continue;
+		case BPF_LDX | BPF_W | BPF_LEN:
+			ftest->code = BPF_LDX | BPF_IMM;
+			ftest->k = sizeof(struct rfrpi_filter_data);
+			continue;
+		/* Explicitly include allowed calls. */
+		case BPF_RET | BPF_K:
+		case BPF_RET | BPF_A:
+		case BPF_ALU | BPF_ADD | BPF_K:
+		case BPF_ALU | BPF_ADD | BPF_X:
+		case BPF_ALU | BPF_SUB | BPF_K:
+		case BPF_ALU | BPF_SUB | BPF_X:
+		case BPF_ALU | BPF_MUL | BPF_K:
+		case BPF_ALU | BPF_MUL | BPF_X:
+		case BPF_ALU | BPF_DIV | BPF_K:
+		case BPF_ALU | BPF_DIV | BPF_X:
+		case BPF_ALU | BPF_MOD | BPF_K:
+		case BPF_ALU | BPF_MOD | BPF_X:
+		case BPF_ALU | BPF_AND | BPF_K:
+		case BPF_ALU | BPF_AND | BPF_X:
+		case BPF_ALU | BPF_OR | BPF_K:
+		case BPF_ALU | BPF_OR | BPF_X:
+		case BPF_ALU | BPF_XOR | BPF_K:
+		case BPF_ALU | BPF_XOR | BPF_X:
+		case BPF_ALU | BPF_LSH | BPF_K:
+		case BPF_ALU | BPF_LSH | BPF_X:
+		case BPF_ALU | BPF_RSH | BPF_K:
+		case BPF_ALU | BPF_RSH | BPF_X:
+		case BPF_ALU | BPF_NEG:
+		case BPF_LD | BPF_IMM:
+		case BPF_LDX | BPF_IMM:
+		case BPF_MISC | BPF_TAX:
+		case BPF_MISC | BPF_TXA:
+		case BPF_LD | BPF_MEM:
+		case BPF_LDX | BPF_MEM:
+		case BPF_ST:
+		case BPF_STX:
+		case BPF_JMP | BPF_JA:
+		case BPF_JMP | BPF_JEQ | BPF_K:
+		case BPF_JMP | BPF_JEQ | BPF_X:
+		case BPF_JMP | BPF_JGE | BPF_K:
+		case BPF_JMP | BPF_JGE | BPF_X:
+		case BPF_JMP | BPF_JGT | BPF_K:
+		case BPF_JMP | BPF_JGT | BPF_X:
+		case BPF_JMP | BPF_JSET | BPF_K:
+		case BPF_JMP | BPF_JSET | BPF_X:
+			continue;
+		default:
+			return -EINVAL;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Replace the capture filter, prog == NULL removes it.
+ * The old program is freed once no ISR can be running it anymore.
+ */
+static void rx433_swap_filter(struct bpf_prog *prog)
+{
+	struct bpf_prog *old;
+
+	mutex_lock(&filter_lock);
+	old = rcu_dereference_protected(rxFilter, lockdep_is_held(&filter_lock));
+	rcu_assign_pointer(rxFilter, prog);
+	mutex_unlock(&filter_lock);
+
+	if (old) {
+		synchronize_rcu();
+		bpf_prog_destroy(old);
+	}
+}
+
+static int rx433_set_filter(void __user *arg)
+{
+	struct sock_fprog fprog;
+	struct bpf_prog *prog;
+	int ret;
+
+	if (!capable(CAP_SYS_ADMIN))
+		return -EPERM;
+	if (copy_from_user(&fprog, arg, sizeof(fprog)))
+		return -EFAULT;
 
-	_count = 0;
-	if ( pRead != pWrite ) {
-		sprintf(tmp,"%ld\n",lastDelta[pRead]);
-  	    _count = strlen(tmp);
-        _error_count = copy_to_user(buf,tmp,_count+1);
-        if ( _error_count != 0 ) {
-        	printk(KERN_ERR "RFRPI - Error writing to char device");
-            return -EFAULT;
-        }
-		pRead = (pRead + 1) & (BUFFER_SZ-1);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,5,0)
+	ret = bpf_prog_create_from_user(&prog, &fprog, rx433_check_filter, false);
+#else
+	ret = bpf_prog_create_from_user(&prog, &fprog, rx433_check_filter);
+#endif
+	if (ret)
+		return ret;
+	rx433_swap_filter(prog);
+	return 0;
+}
+
+static long rx433_ioctl(struct file *file, unsigned int cmd,
+                unsigned long arg)
+{
+	struct rx433_reader *rd = file->private_data;
+	struct rfrpi_stats st;
+	u32 w;
+
+	switch (cmd) {
+	case RFRPI_IOC_GET_STATS:
+		w = READ_ONCE(wSeq);
+		st.lag = min_t(u32, w - rd->rSeq, BUFFER_SZ-1);
+		st.lost = rd->lost + (w - rd->rSeq) - st.lag;
+		st.overflows = rd->overflows;
+		st.readers = atomic_read(&nbReaders);
+		st.filtered = READ_ONCE(nbFiltered);
+		if (copy_to_user((void __user *)arg, &st, sizeof(st)))
+			return -EFAULT;
+		return 0;
+	case RFRPI_IOC_SET_FORMAT:
+		if (arg != RFRPI_FMT_TEXT && arg != RFRPI_FMT_BINARY &&
+		    arg != RFRPI_FMT_SYMBOL)
+			return -EINVAL;
+		mutex_lock(&rd->lock);
+		rd->format = arg;
+		mutex_unlock(&rd->lock);
+		return 0;
+	case RFRPI_IOC_SET_FILTER:
+		return rx433_set_filter((void __user *)arg);
+	case RFRPI_IOC_CLEAR_FILTER:
+		if (!capable(CAP_SYS_ADMIN))
+			return -EPERM;
+		rx433_swap_filter(NULL);
+		return 0;
+	default:
+		return -ENOTTY;
 	}
-	return _count;
 }
 
 static struct file_operations rx433_fops = {
     .owner = THIS_MODULE,
     .open = rx433_open,
-    .read = rx433_read,
+    .read_iter = rx433_read_iter,
+    .splice_read = rx433_splice_read,
     .write = rx433_write,
+    .unlocked_ioctl = rx433_ioctl,
     .release = rx433_release,
 };
 
+/*
+ * sysfs attributes of the misc device (/sys/class/misc/rfrpi)
+ * cluster : 1 enables pulse width clustering (and restarts learning)
+ * classes : one line per timing class, "name centroid_us hits"
+ * capture : 1 enables input capture (and clears the measure)
+ * capture_avg : periods in the moving average, 1 to 64
+ * capture_gate_ms : gate time, 0 for the moving average
+ * period_ns, frequency_millihz, duty_permille : last measure, 0 when
+ *           the signal stopped or nothing was measured yet, the
+ *           frequency is in millihertz
+ */
+static ssize_t cluster_show(struct device *d,
+		struct device_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%d\n", clusterOn);
+}
+
+static ssize_t cluster_store(struct device *d,
+		struct device_attribute *attr, const char *buf, size_t count)
+{
+	long on;
+	int ret;
+
+	ret = kstrtol(buf, 0, &on);
+	if (ret)
+		return ret;
+	if (on) {
+		// stop the stage while the centroids are seeded again
+		WRITE_ONCE(clusterOn, 0);
+		synchronize_irq(rx_irqs[0]);
+		rx_cluster_reset();
+	}
+	WRITE_ONCE(clusterOn, !!on);
+	return count;
+}
+static DEVICE_ATTR(cluster, 0664, cluster_show, cluster_store);
+
+static ssize_t classes_show(struct device *d,
+		struct device_attribute *attr, char *buf)
+{
+	static const char * const names[] = { "short", "long", "sync" };
+	u32 c[RFRPI_NB_CLASSES], hits[RFRPI_NB_CLASSES];
+	ssize_t ret = 0;
+	int k, j, rank;
+
+	for (k = 0; k < RFRPI_NB_CLASSES; k++) {
+		c[k] = READ_ONCE(centroid[k]);
+		hits[k] = READ_ONCE(clusterHits[k]);
+	}
+	for (rank = 0; rank < RFRPI_NB_CLASSES; rank++) {
+		for (k = 0; k < RFRPI_NB_CLASSES; k++) {
+			int r = 0;
+			for (j = 0; j < RFRPI_NB_CLASSES; j++)
+				if (c[j] < c[k])
+					r++;
+			if (r == rank)
+				break;
+		}
+		if (k == RFRPI_NB_CLASSES)
+			continue;
+		// back from Q8 log2 to microseconds
+		ret += sprintf(buf + ret, "%s %u %u\n", names[rank],
+			(u32)((1ULL << (c[k] >> 8)) * (256 + (c[k] & 0xff)) >> 8),
+			hits[k]);
+	}
+	return ret;
+}
+static DEVICE_ATTR(classes, 0444, classes_show, NULL);
+
+/*
+ * Stop the capture stage, change its settings and start it again,
+ * a negative value keeps the current one
+ */
+static void rx_capture_config(int on, int avg, int gate_ms)
+{
+	mutex_lock(&capture_lock);
+	if (on < 0)
+		on = captureOn;
+	WRITE_ONCE(captureOn, 0);
+	synchronize_irq(rx_irqs[0]);
+	if (avg >= 0)
+		captureAvg = avg;
+	if (gate_ms >= 0)
+		captureGateMs = gate_ms;
+	rx_capture_reset();
+	WRITE_ONCE(captureOn, on);
+	mutex_unlock(&capture_lock);
+}
+
+/*
+ * Consistent copy of the last published sums, returns the periods they
+ * hold, 0 when there is no measure or it is too old: the signal has
+ * stopped when nothing was published for twice the measured window
+ * (and at least a second).
+ */
+static u32 rx_capture_read(u64 *high, u64 *low)
+{
+	unsigned int seq;
+	u32 periods;
+	s64 stamp, age;
+
+	do {
+		seq = read_seqcount_begin(&capSeq);
+		*high = capResult.sumHigh;
+		*low = capResult.sumLow;
+		periods = capResult.periods;
+		stamp = capResult.stamp;
+	} while (read_seqcount_retry(&capSeq, seq));
+
+	if (!periods || !(*high + *low))
+		return 0;
+	age = ktime_to_ns(ktime_get_real()) - stamp;
+	if (age > max_t(s64, NSEC_PER_SEC, 2000 * (*high + *low)))
+		return 0;
+	return periods;
+}
+
+static ssize_t capture_show(struct device *d,
+		struct device_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%d\n", captureOn);
+}
+
+static ssize_t capture_store(struct device *d,
+		struct device_attribute *attr, const char *buf, size_t count)
+{
+	long on;
+	int ret;
+
+	ret = kstrtol(buf, 0, &on);
+	if (ret)
+		return ret;
+	rx_capture_config(!!on, -1, -1);
+	return count;
+}
+static DEVICE_ATTR(capture, 0664, capture_show, capture_store);
+
+static ssize_t capture_avg_show(struct device *d,
+		struct device_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%u\n", captureAvg);
+}
+
+static ssize_t capture_avg_store(struct device *d,
+		struct device_attribute *attr, const char *buf, size_t count)
+{
+	u32 avg;
+	int ret;
+
+	ret = kstrtou32(buf, 0, &avg);
+	if (ret)
+		return ret;
+	if (avg < 1 || avg > CAPTURE_AVG_MAX)
+		return -ERANGE;
+	rx_capture_config(-1, avg, -1);
+	return count;
+}
+static DEVICE_ATTR(capture_avg, 0664, capture_avg_show, capture_avg_store);
+
+static ssize_t capture_gate_ms_show(struct device *d,
+		struct device_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%u\n", captureGateMs);
+}
+
+static ssize_t capture_gate_ms_store(struct device *d,
+		struct device_attribute *attr, const char *buf, size_t count)
+{
+	u32 gate_ms;
+	int ret;
+
+	ret = kstrtou32(buf, 0, &gate_ms);
+	if (ret)
+		return ret;
+	if (gate_ms > 60000)
+		return -ERANGE;
+	rx_capture_config(-1, -1, gate_ms);
+	return count;
+}
+static DEVICE_ATTR(capture_gate_ms, 0664, capture_gate_ms_show,
+		capture_gate_ms_store);
+
+static ssize_t period_ns_show(struct device *d,
+		struct device_attribute *attr, char *buf)
+{
+	u64 high, low;
+	u32 periods = rx_capture_read(&high, &low);
+
+	return sprintf(buf, "%llu\n",
+		periods ? div_u64((high + low) * 1000, periods) : 0);
+}
+static DEVICE_ATTR(period_ns, 0444, period_ns_show, NULL);
+
+static ssize_t frequency_millihz_show(struct device *d,
+		struct device_attribute *attr, char *buf)
+{
+	u64 high, low;
+	u32 periods = rx_capture_read(&high, &low);
+
+	return sprintf(buf, "%llu\n",
+		periods ? div64_u64((u64)periods * 1000000000, high + low) : 0);
+}
+static DEVICE_ATTR(frequency_millihz, 0444, frequency_millihz_show, NULL);
+
+static ssize_t duty_permille_show(struct device *d,
+		struct device_attribute *attr, char *buf)
+{
+	u64 high, low;
+	u32 periods = rx_capture_read(&high, &low);
+
+	return sprintf(buf, "%llu\n",
+		periods ? div64_u64(high * 1000, high + low) : 0);
+}
+static DEVICE_ATTR(duty_permille, 0444, duty_permille_show, NULL);
+
+static struct attribute *rx433_sysfs_entries[] = {
+	&dev_attr_cluster.attr,
+	&dev_attr_classes.attr,
+	&dev_attr_capture.attr,
+	&dev_attr_capture_avg.attr,
+	&dev_attr_capture_gate_ms.attr,
+	&dev_attr_period_ns.attr,
+	&dev_attr_frequency_millihz.attr,
+	&dev_attr_duty_permille.attr,
+	NULL
+};
+
+static const struct attribute_group rx433_attribute_group = {
+	.attrs = rx433_sysfs_entries,
+};
+
+static const struct attribute_group *rx433_attribute_groups[] = {
+	&rx433_attribute_group,
+	NULL
+};
+
 static struct miscdevice rx433_misc_device = {
     .minor = MISC_DYNAMIC_MINOR,
     .name = DEV_NAME,
     .fops = &rx433_fops,
+    .groups = rx433_attribute_groups,
+};
+
+
+
+/*
+ * IIO interface: every queued edge fires the "rfrpi-edge" trigger, the
+ * poll function drains all pending edges from its own cursor into the
+ * kfifo, so a busy line is pushed in batches. Readers use the standard
+ * buffer/watermark and scan_elements attributes.
+ */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,10,0)
+#define RX_IIO_WIDTH_TYPE	IIO_COUNT
+#else
+#define RX_IIO_WIDTH_TYPE	IIO_STEPS	// no generic count type yet
+#endif
+
+static const struct iio_chan_spec rx_iio_channels[] = {
+	{
+		.type = RX_IIO_WIDTH_TYPE,
+		.extend_name = "width",
+		.info_mask_separate = BIT(IIO_CHAN_INFO_SCALE),
+		.scan_index = 0,
+		.scan_type = {
+			.sign = 'u',
+			.realbits = 32,
+			.storagebits = 32,
+			.endianness = IIO_CPU,
+		},
+	},
+	IIO_CHAN_SOFT_TIMESTAMP(1),
+};
+
+static int rx_iio_read_raw(struct iio_dev *indio_dev,
+		struct iio_chan_spec const *chan, int *val, int *val2, long mask)
+{
+	switch (mask) {
+	case IIO_CHAN_INFO_SCALE:
+		// widths are in microseconds
+		*val = 0;
+		*val2 = 1;
+		return IIO_VAL_INT_PLUS_MICRO;
+	default:
+		return -EINVAL;
+	}
+}
+
+/*
+ * The trigger handler drains the edge ring through iioReader, so the
+ * device only runs from its own trigger and the trigger only feeds it
+ */
+static int rx_iio_validate_trigger(struct iio_dev *indio_dev,
+		struct iio_trigger *trig)
+{
+	return trig == rxTrig ? 0 : -EINVAL;
+}
+
+static const struct iio_info rx_iio_info = {
+	.driver_module = THIS_MODULE,
+	.read_raw = rx_iio_read_raw,
+	.validate_trigger = rx_iio_validate_trigger,
+};
+
+/*
+ * An edge that came in while the handler was still running found the
+ * trigger busy and did not poll it, poll again rather than leave it in
+ * the ring until the next edge
+ */
+static int rx_trig_try_reenable(struct iio_trigger *trig)
+{
+	return READ_ONCE(iioOn) && READ_ONCE(wSeq) != iioReader.rSeq;
+}
+
+static const struct iio_trigger_ops rx_trig_ops = {
+	.owner = THIS_MODULE,
+	.try_reenable = rx_trig_try_reenable,
+	.validate_device = iio_trigger_validate_own_device,
+};
+
+static irqreturn_t rx_iio_trigger_handler(int irq, void *p)
+{
+	struct iio_poll_func *pf = p;
+	struct iio_dev *indio_dev = pf->indio_dev;
+	struct rfrpi_edge edge;
+	u64 scan[2];	// width, then the timestamp 8 byte aligned
+	s64 stamp;
+
+	while ( rx433_peek(&iioReader, &edge, &stamp) ) {
+		*(u32 *)scan = edge.width;
+		iio_push_to_buffers_with_timestamp(indio_dev, scan, stamp);
+		rx433_consume(&iioReader, &edge);
+	}
+	iio_trigger_notify_done(indio_dev->trig);
+	return IRQ_HANDLED;
+}
+
+static int rx_iio_postenable(struct iio_dev *indio_dev)
+{
+	iioReader.rSeq = READ_ONCE(wSeq);
+	iioReader.wasOverflow = 0;
+	rx_reader_add(&iioReader);
+	WRITE_ONCE(iioOn, 1);
+	return iio_triggered_buffer_postenable(indio_dev);
+}
+
+static int rx_iio_predisable(struct iio_dev *indio_dev)
+{
+	WRITE_ONCE(iioOn, 0);
+	rx_reader_del(&iioReader);
+	return iio_triggered_buffer_predisable(indio_dev);
+}
+
+static const struct iio_buffer_setup_ops rx_iio_buffer_ops = {
+	.postenable = rx_iio_postenable,
+	.predisable = rx_iio_predisable,
 };
 
+static int rx_iio_init(void)
+{
+	int ret;
+
+	rxIio = iio_device_alloc(0);
+	if (!rxIio)
+		return -ENOMEM;
+	rxIio->name = DEV_NAME;
+	rxIio->info = &rx_iio_info;
+	rxIio->channels = rx_iio_channels;
+	rxIio->num_channels = ARRAY_SIZE(rx_iio_channels);
+	rxIio->modes = INDIO_DIRECT_MODE;
+	rxIio->dev.parent = rx433_misc_device.this_device;
+
+	rxTrig = iio_trigger_alloc("%s-edge", DEV_NAME);
+	if (!rxTrig) {
+		ret = -ENOMEM;
+		goto fail1;
+	}
+	rxTrig->ops = &rx_trig_ops;
+	rxTrig->dev.parent = rx433_misc_device.this_device;
+	ret = iio_trigger_register(rxTrig);
+	if (ret)
+		goto fail2;
+	rxIio->trig = iio_trigger_get(rxTrig);
+
+	ret = iio_triggered_buffer_setup(rxIio, NULL, rx_iio_trigger_handler,
+			&rx_iio_buffer_ops);
+	if (ret)
+		goto fail3;
+
+	ret = iio_device_register(rxIio);
+	if (ret)
+		goto fail4;
+	return 0;
+
+fail4:
+	iio_triggered_buffer_cleanup(rxIio);
+fail3:
+	iio_trigger_put(rxIio->trig);
+	iio_trigger_unregister(rxTrig);
+fail2:
+	iio_trigger_free(rxTrig);
+fail1:
+	iio_device_free(rxIio);
+	return ret;
+}
+
+static void rx_iio_exit(void)
+{
+	iio_device_unregister(rxIio);
+	// an ISR past its iioOn check still polls the trigger, let it finish
+	WRITE_ONCE(iioOn, 0);
+	synchronize_irq(rx_irqs[0]);
+	iio_triggered_buffer_cleanup(rxIio);
+	iio_trigger_put(rxIio->trig);
+	iio_trigger_unregister(rxTrig);
+	iio_trigger_free(rxTrig);
+	iio_device_free(rxIio);
+}
 
 
 /*
@@ -147,9 +1263,21 @@ static int __init rfrpi_init(void)
 
 	// INITIALIZE IRQ TIME AND Queue Management
 	getnstimeofday(&lastIrq_time);
-	pRead = 0;
-	pWrite = 0;
-	wasOverflow = 0;
+	wSeq = 0;
+	edgeSeq = 0;
+	lastWidth = 0;
+	nbFiltered = 0;
+	clusterOn = 0;
+	rx_cluster_reset();
+	captureOn = 0;
+	seqcount_init(&capSeq);
+	rx_capture_reset();
+	atomic_set(&nbLost, 0);
+	signals[0].gpio = rx_gpio;
+
+	ret = evlog_init(&rxLog, DEV_NAME, evNames, ARRAY_SIZE(evNames));
+	if (ret)
+		return ret;
 
 	// register GPIO PIN in use
 	ret = gpio_request_array(signals, ARRAY_SIZE(signals));
@@ -176,14 +1304,24 @@ static int __init rfrpi_init(void)
 	// Register a character device for communication with user space
     misc_register(&rx433_misc_device);
 
+	// and the same edges as an IIO buffered device
+	ret = rx_iio_init();
+	if (ret) {
+		printk(KERN_ERR "RFRPI - Unable to register IIO device: %d\n", ret);
+		goto fail4;
+	}
+
 	return 0;
 
 	// cleanup what has been setup so far
+fail4:
+	misc_deregister(&rx433_misc_device);
 fail3:
 	free_irq(rx_irqs[0], NULL);
 
 fail2: 
 	gpio_free_array(signals, ARRAY_SIZE(signals));
+	evlog_exit(&rxLog);
 	return ret;	
 }
 
@@ -194,13 +1332,18 @@ static void __exit rfrpi_exit(void)
 {
 	printk(KERN_INFO "%s\n", __func__);
 
+	rx_iio_exit();
     misc_deregister(&rx433_misc_device);
 
 	// free irqs
 	free_irq(rx_irqs[0], NULL);	
+
+	// drop the capture filter, the ISR is gone
+	rx433_swap_filter(NULL);
 	
 	// unregister
 	gpio_free_array(signals, ARRAY_SIZE(signals));
+	evlog_exit(&rxLog);
 }
 
 MODULE_LICENSE("GPL");
@@ -0,0 +1,91 @@
+/*
+ * User space interface of the rfrpi capture device (/dev/rfrpi).
+ *
+ * This header is shared by the kernel module and by user space
+ * programs, keep it free of kernel only types.
+ *
+ * This software is licensed under the terms of the GNU General Public
+ * License version 2, as published by the Free Software Foundation, and
+ * may be copied, distributed, and modified under those terms.
+ */
+#ifndef _RFRPI_H
+#define _RFRPI_H
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+#include <linux/filter.h>
+
+/*
+ * One captured edge as it is queued for the readers.
+ */
+struct rfrpi_edge {
+	__u32 width;		/* microseconds since the previous edge */
+	__u16 level;		/* line level after the edge */
+	__u16 symbol;		/* RFRPI_SYM_xxx timing class of width */
+	__u32 seq;		/* edge number, counts filtered edges too */
+	__u32 tag;		/* value set by the capture filter, 0 if none */
+};
+
+/*
+ * Timing classes found by the pulse width clustering stage
+ * (/sys/class/misc/rfrpi/cluster). Classes are ordered by width, they
+ * are only set while clustering is enabled.
+ */
+#define RFRPI_SYM_NONE		0
+#define RFRPI_SYM_SHORT		1
+#define RFRPI_SYM_LONG		2
+#define RFRPI_SYM_SYNC		3
+#define RFRPI_NB_CLASSES	3
+
+/*
+ * Data seen by the capture filter, a classic BPF program attached with
+ * RFRPI_IOC_SET_FILTER. The program reads the fields with 32 bit
+ * absolute loads (ld [0] is width, ld [4] level...) and returns:
+ *   RFRPI_FILTER_DROP  the edge is never queued
+ *   RFRPI_FILTER_KEEP  the edge is queued untagged
+ *   anything else      the edge is queued with tag set to that value
+ * Decimation can be done with seq, simple patterns with prev_width.
+ */
+struct rfrpi_filter_data {
+	__u32 width;
+	__u32 level;
+	__u32 seq;
+	__u32 prev_width;
+};
+
+#define RFRPI_FILTER_DROP	0x00000000
+#define RFRPI_FILTER_KEEP	0xffffffff
+
+/*
+ * Per reader statistics. Every open file has its own cursor over the
+ * capture ring, so these numbers only describe the calling file.
+ */
+struct rfrpi_stats {
+	__u32 lag;		/* records queued and not yet read */
+	__u32 lost;		/* records overwritten before being read */
+	__u32 overflows;	/* times this reader fell a whole ring behind */
+	__u32 readers;		/* files currently open on the device */
+	__u32 filtered;		/* edges dropped by the capture filter */
+};
+
+#define RFRPI_IOC_MAGIC		'r'
+#define RFRPI_IOC_GET_STATS	_IOR(RFRPI_IOC_MAGIC, 1, struct rfrpi_stats)
+/* attach a filter for every reader, needs CAP_SYS_ADMIN */
+#define RFRPI_IOC_SET_FILTER	_IOW(RFRPI_IOC_MAGIC, 2, struct sock_fprog)
+#define RFRPI_IOC_CLEAR_FILTER	_IO(RFRPI_IOC_MAGIC, 3)
+
+/*
+ * Record format of the calling file, passed by value. Binary records
+ * are fixed size and cheap to splice straight into a capture file.
+ */
+#define RFRPI_FMT_TEXT		0	/* one decimal line per edge (default) */
+#define RFRPI_FMT_BINARY	1	/* struct rfrpi_edge per edge */
+#define RFRPI_FMT_SYMBOL	2	/* one of "SLY?" per edge, newline after Y */
+#define RFRPI_IOC_SET_FORMAT	_IO(RFRPI_IOC_MAGIC, 4)
+
+#ifdef __KERNEL__
+/* exported by the capture module for companion modules */
+void rfrpi_get_counters(u32 *edges, u32 *filtered, u32 *lost);
+#endif
+
+#endif /* _RFRPI_H */
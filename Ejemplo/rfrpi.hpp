@@ -0,0 +1,273 @@
+/*
+ * Header only C++ helpers to consume rfrpi captures.
+ *
+ *  - rfrpi::Capture reads binary records from /dev/rfrpi (or from a
+ *    recorded capture file) in batches, into buffers owned by the caller
+ *  - rfrpi::classify sorts pulse widths in short / long / sync classes,
+ *    four records at a time with SSE2 or NEON when available
+ *  - rfrpi::Decoder turns classified edges into frames, the protocol is
+ *    a template parameter so the inner loop is specialized at compile time
+ *
+ * Typical use :
+ *
+ *	rfrpi::Capture cap;
+ *	rfrpi::Decoder<rfrpi::PwmProtocol<24>> dec;
+ *	std::array<rfrpi_edge, 256> edges;
+ *	std::array<uint8_t, 256> sym;
+ *	while (!cap.eof()) {
+ *		size_t n = cap.read(edges.data(), edges.size());
+ *		if (n == 0) {		// idle receiver, the ring is empty
+ *			usleep(10000);
+ *			continue;
+ *		}
+ *		rfrpi::classify(edges.data(), n, sym.data(), th);
+ *		dec.feed(sym.data(), n, [](uint64_t frame) { ... });
+ *	}
+ *
+ * This software is licensed under the terms of the GNU General Public
+ * License version 2, as published by the Free Software Foundation, and
+ * may be copied, distributed, and modified under those terms.
+ */
+#ifndef _RFRPI_HPP
+#define _RFRPI_HPP
+
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <system_error>
+
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#endif
+
+#include "rfrpi.h"
+
+namespace rfrpi {
+
+static_assert(sizeof(rfrpi_edge) == 16, "rfrpi_edge layout changed");
+
+/*
+ * Source of binary records. Opening the device switches the file to
+ * RFRPI_FMT_BINARY, any other path is taken as a recorded capture.
+ */
+class Capture {
+public:
+	explicit Capture(const char *path = "/dev/rfrpi")
+	{
+		fd_ = ::open(path, O_RDONLY | O_CLOEXEC);
+		if (fd_ < 0)
+			throw std::system_error(errno, std::generic_category(), path);
+		isDevice_ = ::ioctl(fd_, RFRPI_IOC_SET_FORMAT, RFRPI_FMT_BINARY) == 0;
+	}
+
+	~Capture()
+	{
+		if (fd_ >= 0)
+			::close(fd_);
+	}
+
+	Capture(const Capture &) = delete;
+	Capture &operator=(const Capture &) = delete;
+
+	/*
+	 * Read up to max records into out, returns the number read.
+	 * 0 means the ring is empty (device, try again later) or end of
+	 * file (recording, eof() is then true).
+	 */
+	size_t read(rfrpi_edge *out, size_t max)
+	{
+		char *dst = reinterpret_cast<char *>(out);
+		size_t want = max * sizeof(rfrpi_edge);
+		size_t got = 0;
+
+		// a file can end a read in the middle of a record, finish it
+		while (got < want) {
+			ssize_t r = ::read(fd_, dst + got, want - got);
+			if (r < 0) {
+				if (errno == EINTR)
+					continue;
+				throw std::system_error(errno, std::generic_category(), "read");
+			}
+			if (r == 0) {
+				eof_ = !isDevice_;
+				break;
+			}
+			got += r;
+			if (isDevice_ || got % sizeof(rfrpi_edge) == 0)
+				break;
+		}
+		return got / sizeof(rfrpi_edge);
+	}
+
+	rfrpi_stats stats() const
+	{
+		rfrpi_stats st;
+
+		if (::ioctl(fd_, RFRPI_IOC_GET_STATS, &st) < 0)
+			throw std::system_error(errno, std::generic_category(), "stats");
+		return st;
+	}
+
+	int fd() const { return fd_; }
+	bool isDevice() const { return isDevice_; }
+	/* a recording is over, the device never ends */
+	bool eof() const { return eof_; }
+
+private:
+	int fd_;
+	bool isDevice_;
+	bool eof_ = false;
+};
+
+/* Class limits in microseconds, widths above longMax are sync */
+struct Thresholds {
+	uint32_t shortMax;
+	uint32_t longMax;
+};
+
+namespace detail {
+
+inline uint8_t classifyOne(uint32_t w, const Thresholds &th)
+{
+	return RFRPI_SYM_SHORT + (w > th.shortMax) + (w > th.longMax);
+}
+
+} // namespace detail
+
+/*
+ * Write the RFRPI_SYM_xxx class of every width of in[] to out[].
+ * Same result as the kernel clustering stage symbols, but with fixed
+ * thresholds chosen by the caller.
+ */
+inline void classify(const rfrpi_edge *in, size_t n, uint8_t *out,
+		const Thresholds &th)
+{
+	size_t i = 0;
+
+#if defined(__SSE2__)
+	// SSE2 only compares signed values, move everything by 2^31
+	const __m128i bias = _mm_set1_epi32(INT32_MIN);
+	const __m128i s = _mm_xor_si128(_mm_set1_epi32(th.shortMax), bias);
+	const __m128i l = _mm_xor_si128(_mm_set1_epi32(th.longMax), bias);
+	const __m128i one = _mm_set1_epi32(RFRPI_SYM_SHORT);
+
+	for (; i + 4 <= n; i += 4) {
+		const __m128i *p = reinterpret_cast<const __m128i *>(in + i);
+		// width is the first word of each 16 byte record
+		__m128i r01 = _mm_unpacklo_epi32(_mm_loadu_si128(p), _mm_loadu_si128(p + 1));
+		__m128i r23 = _mm_unpacklo_epi32(_mm_loadu_si128(p + 2), _mm_loadu_si128(p + 3));
+		__m128i w = _mm_xor_si128(_mm_unpacklo_epi64(r01, r23), bias);
+		// compares give -1 where true
+		__m128i c = _mm_sub_epi32(one, _mm_cmpgt_epi32(w, s));
+		c = _mm_sub_epi32(c, _mm_cmpgt_epi32(w, l));
+		c = _mm_packs_epi32(c, c);
+		c = _mm_packus_epi16(c, c);
+		uint32_t packed = _mm_cvtsi128_si32(c);
+		std::memcpy(out + i, &packed, 4);
+	}
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+	const uint32x4_t s = vdupq_n_u32(th.shortMax);
+	const uint32x4_t l = vdupq_n_u32(th.longMax);
+	const uint32x4_t one = vdupq_n_u32(RFRPI_SYM_SHORT);
+
+	for (; i + 4 <= n; i += 4) {
+		// de-interleave the four words of four records, val[0] is width
+		uint32x4x4_t r = vld4q_u32(reinterpret_cast<const uint32_t *>(in + i));
+		uint32x4_t c = vsubq_u32(one, vcgtq_u32(r.val[0], s));
+		c = vsubq_u32(c, vcgtq_u32(r.val[0], l));
+		uint16x4_t c16 = vmovn_u32(c);
+		uint8x8_t c8 = vmovn_u16(vcombine_u16(c16, c16));
+		vst1_lane_u32(reinterpret_cast<uint32_t *>(out + i),
+				vreinterpret_u32_u8(c8), 0);
+	}
+#endif
+	for (; i < n; i++)
+		out[i] = detail::classifyOne(in[i].width, th);
+}
+
+/*
+ * Pulse width modulated protocol: every bit is a pair of pulses,
+ * short+long is a 0 and long+short is a 1 (PT2262, EV1527 style).
+ * A sync pulse ends the frame.
+ */
+template <unsigned Bits>
+struct PwmProtocol {
+	static_assert(Bits > 0 && Bits <= 64, "frames are held in 64 bits");
+	static constexpr unsigned bits = Bits;
+
+	// returns the bit value of a symbol pair, -1 if the pair is invalid
+	static int pair(uint8_t first, uint8_t second)
+	{
+		if (first == RFRPI_SYM_SHORT && second == RFRPI_SYM_LONG)
+			return 0;
+		if (first == RFRPI_SYM_LONG && second == RFRPI_SYM_SHORT)
+			return 1;
+		return -1;
+	}
+};
+
+/*
+ * Frame decoder over classified symbols. Protocol gives the frame
+ * length (bits) and how a pair of symbols maps to a bit (pair(), see
+ * PwmProtocol). Frames are handed to the callback given to feed(),
+ * nothing is allocated while decoding.
+ */
+template <class Protocol>
+class Decoder {
+public:
+	template <class OnFrame>
+	void feed(const uint8_t *sym, size_t n, OnFrame &&onFrame)
+	{
+		for (size_t i = 0; i < n; i++) {
+			uint8_t s = sym[i];
+
+			if (s == RFRPI_SYM_SYNC) {
+				if (nbits_ == Protocol::bits)
+					onFrame(frame_);
+				reset();
+				continue;
+			}
+			if (!havePending_) {
+				pending_ = s;
+				havePending_ = true;
+				continue;
+			}
+			havePending_ = false;
+			int b = Protocol::pair(pending_, s);
+			if (b < 0 || nbits_ == Protocol::bits) {
+				errors_++;
+				reset();
+				continue;
+			}
+			frame_ = (frame_ << 1) | static_cast<uint64_t>(b);
+			nbits_++;
+		}
+	}
+
+	void reset()
+	{
+		frame_ = 0;
+		nbits_ = 0;
+		havePending_ = false;
+	}
+
+	uint64_t errors() const { return errors_; }
+
+private:
+	uint64_t frame_ = 0;
+	unsigned nbits_ = 0;
+	uint8_t pending_ = 0;
+	bool havePending_ = false;
+	uint64_t errors_ = 0;
+};
+
+} // namespace rfrpi
+
+#endif /* _RFRPI_HPP */
@@ -0,0 +1,605 @@
+/*
+ * rfrpi_export - convert rfrpi captures to waveform viewer formats.
+ *
+ * Reads binary records (RFRPI_FMT_BINARY, as recorded with splice or
+ * rfrpi::Capture) or the legacy text stream (one width per line) and
+ * writes a VCD file or a sigrok session (.sr). Input and output are
+ * streamed through fixed buffers, memory use does not depend on the
+ * capture size.
+ *
+ *	rfrpi_export [-t] [-f vcd|sr] [-r rate] [-o out] [in]
+ *	rfrpi_export -b records
+ *
+ *	-t	input is the text stream (default: binary records)
+ *	-f	output format, vcd (default) or sr
+ *	-r	sigrok sample rate in Hz (default 1000000)
+ *	-b	benchmark both formats on synthetic records, no file io
+ *
+ * Text input has no level, the line is taken low after the first edge
+ * and toggled on every following one.
+ *
+ * Build: make tools
+ *
+ * This software is licensed under the terms of the GNU General Public
+ * License version 2, as published by the Free Software Foundation, and
+ * may be copied, distributed, and modified under those terms.
+ */
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <getopt.h>
+#include <unistd.h>
+
+#include "rfrpi.hpp"
+
+namespace {
+
+const size_t IO_BUF_SZ = 1 << 16;
+const size_t BATCH = 4096;		// records converted per step
+const uint64_t SR_CHUNK = 4 << 20;	// bytes per sigrok logic-1-N member
+
+/*
+ * Buffered sink. fd < 0 only counts bytes, for the benchmark.
+ */
+class Output {
+public:
+	explicit Output(int fd) : fd_(fd), buf_(new char[IO_BUF_SZ]) {}
+	~Output() { flush(); }
+
+	void put(const char *p, size_t n)
+	{
+		while (n) {
+			size_t room = IO_BUF_SZ - len_;
+			size_t c = n < room ? n : room;
+			memcpy(buf_.get() + len_, p, c);
+			len_ += c;
+			p += c;
+			n -= c;
+			if (len_ == IO_BUF_SZ)
+				flush();
+		}
+	}
+
+	void put(const std::string &s) { put(s.data(), s.size()); }
+
+	void putc(char c)
+	{
+		if (len_ == IO_BUF_SZ)
+			flush();
+		buf_[len_++] = c;
+	}
+
+	// n times the same byte, used for sigrok samples
+	void fill(char c, uint64_t n)
+	{
+		while (n) {
+			if (len_ == IO_BUF_SZ)
+				flush();
+			size_t room = IO_BUF_SZ - len_;
+			size_t k = n < room ? n : room;
+			memset(buf_.get() + len_, c, k);
+			len_ += k;
+			n -= k;
+		}
+	}
+
+	void putDec(uint64_t v)
+	{
+		char tmp[24];
+		char *p = tmp + sizeof(tmp);
+
+		do {
+			*--p = '0' + v % 10;
+			v /= 10;
+		} while (v);
+		put(p, tmp + sizeof(tmp) - p);
+	}
+
+	void putLe(uint64_t v, int bytes)
+	{
+		for (int i = 0; i < bytes; i++)
+			putc(static_cast<char>(v >> (8 * i)));
+	}
+
+	void flush()
+	{
+		size_t done = 0;
+
+		while (fd_ >= 0 && done < len_) {
+			ssize_t w = ::write(fd_, buf_.get() + done, len_ - done);
+			if (w < 0) {
+				if (errno == EINTR)
+					continue;
+				perror("write");
+				exit(1);
+			}
+			done += w;
+		}
+		total_ += len_;
+		len_ = 0;
+	}
+
+	uint64_t offset() const { return total_ + len_; }
+
+private:
+	int fd_;
+	std::unique_ptr<char[]> buf_;
+	size_t len_ = 0;
+	uint64_t total_ = 0;
+};
+
+/*
+ * Record sources
+ */
+class Input {
+public:
+	virtual ~Input() {}
+	virtual size_t read(rfrpi_edge *out, size_t max) = 0;
+};
+
+class BinaryInput : public Input {
+public:
+	explicit BinaryInput(const char *path) : cap_(path) {}
+	size_t read(rfrpi_edge *out, size_t max) override { return cap_.read(out, max); }
+
+private:
+	rfrpi::Capture cap_;
+};
+
+class TextInput : public Input {
+public:
+	explicit TextInput(int fd) : fd_(fd), buf_(new char[IO_BUF_SZ]) {}
+
+	size_t read(rfrpi_edge *out, size_t max) override
+	{
+		size_t n = 0;
+
+		while (n < max) {
+			if (pos_ == len_ && !refill())
+				break;
+			char c = buf_[pos_++];
+			if (c >= '0' && c <= '9') {
+				if (!skip_)
+					value_ = value_ * 10 + (c - '0');
+				digits_ = true;
+			} else if (c == '\n') {
+				if (digits_) {
+					out[n].width = static_cast<uint32_t>(value_);
+					out[n].level = level_;
+					out[n].symbol = RFRPI_SYM_NONE;
+					out[n].seq = seq_++;
+					out[n].tag = 0;
+					level_ = !level_;
+					n++;
+				}
+				value_ = 0;
+				digits_ = false;
+				skip_ = false;
+			} else if (digits_) {
+				// the rest of the line is the filter tag
+				skip_ = true;
+			}
+		}
+		return n;
+	}
+
+private:
+	bool refill()
+	{
+		ssize_t r;
+
+		do {
+			r = ::read(fd_, buf_.get(), IO_BUF_SZ);
+		} while (r < 0 && errno == EINTR);
+		if (r < 0) {
+			perror("read");
+			exit(1);
+		}
+		pos_ = 0;
+		len_ = r;
+		return r > 0;
+	}
+
+	int fd_;
+	std::unique_ptr<char[]> buf_;
+	size_t pos_ = 0, len_ = 0;
+	uint64_t value_ = 0;
+	bool digits_ = false, skip_ = false;
+	uint16_t level_ = 0;
+	uint32_t seq_ = 0;
+};
+
+/*
+ * Writers. The capture starts at time 0 with the line level before the
+ * first edge, each record moves time by its width then sets its level.
+ */
+class Writer {
+public:
+	virtual ~Writer() {}
+	virtual void edges(const rfrpi_edge *e, size_t n) = 0;
+	virtual void finish() = 0;
+};
+
+class VcdWriter : public Writer {
+public:
+	explicit VcdWriter(Output &out) : out_(out)
+	{
+		out_.put("$timescale 1us $end\n"
+			 "$scope module rfrpi $end\n"
+			 "$var wire 1 ! rx $end\n"
+			 "$upscope $end\n"
+			 "$enddefinitions $end\n");
+	}
+
+	void edges(const rfrpi_edge *e, size_t n) override
+	{
+		for (size_t i = 0; i < n; i++) {
+			if (!started_) {
+				// level before the first edge
+				out_.put("#0\n");
+				out_.putc(e[i].level ? '0' : '1');
+				out_.put("!\n", 2);
+				started_ = true;
+			}
+			time_ += e[i].width;
+			out_.putc('#');
+			out_.putDec(time_);
+			out_.putc('\n');
+			out_.putc(e[i].level ? '1' : '0');
+			out_.put("!\n", 2);
+		}
+	}
+
+	void finish() override { out_.flush(); }
+
+private:
+	Output &out_;
+	uint64_t time_ = 0;
+	bool started_ = false;
+};
+
+/*
+ * sigrok session v2: a zip archive with "version", "metadata" and the
+ * samples split in logic-1-N members, one byte per sample. Members are
+ * stored (no compression) and written with data descriptors so the
+ * archive is produced in one pass; zip64 records are added when the
+ * archive grows past 4 GiB.
+ */
+class SrWriter : public Writer {
+public:
+	SrWriter(Output &out, uint64_t rate) : out_(out), rate_(rate)
+	{
+		// slicing by 8 tables, samples are long runs of the same byte
+		for (uint32_t i = 0; i < 256; i++) {
+			uint32_t c = i;
+			for (int k = 0; k < 8; k++)
+				c = c & 1 ? 0xedb88320 ^ (c >> 1) : c >> 1;
+			crcTable_[0][i] = c;
+		}
+		for (uint32_t i = 0; i < 256; i++)
+			for (int t = 1; t < 8; t++)
+				crcTable_[t][i] = (crcTable_[t - 1][i] >> 8)
+					^ crcTable_[0][crcTable_[t - 1][i] & 0xff];
+		memset(runs_[0], 0, sizeof(runs_[0]));
+		memset(runs_[1], 1, sizeof(runs_[1]));
+		member("version", "2");
+		member("metadata", "[global]\nsigrok version=0.5.0\n\n"
+			"[device 1]\ncapturefile=logic-1\ntotal probes=1\n"
+			"samplerate=" + std::to_string(rate_) + " Hz\n"
+			"total analog=0\nprobe1=RX\nunitsize=1\n");
+	}
+
+	void edges(const rfrpi_edge *e, size_t n) override
+	{
+		for (size_t i = 0; i < n; i++) {
+			if (!started_) {
+				level_ = e[i].level ? 0 : 1;
+				started_ = true;
+			}
+			// samples up to this edge keep the previous level
+			timeUs_ += e[i].width;
+			uint64_t upto = timeUs_ * rate_ / 1000000;
+			samples(level_, upto - sampleNb_);
+			sampleNb_ = upto;
+			level_ = e[i].level ? 1 : 0;
+		}
+	}
+
+	void finish() override
+	{
+		samples(level_, 1);
+		if (chunkOpen_)
+			endMember();
+		centralDirectory();
+		out_.flush();
+	}
+
+private:
+	struct Entry {
+		std::string name;
+		uint32_t crc;
+		uint64_t size;
+		uint64_t offset;
+	};
+
+	void samples(char v, uint64_t n)
+	{
+		while (n) {
+			if (!chunkOpen_) {
+				beginMember("logic-1-" + std::to_string(++chunkNb_));
+				chunkOpen_ = true;
+			}
+			uint64_t room = SR_CHUNK - cur_.size;
+			uint64_t k = n < room ? n : room;
+			crcFill(v, k);
+			out_.fill(v, k);
+			cur_.size += k;
+			n -= k;
+			if (cur_.size == SR_CHUNK) {
+				endMember();
+				chunkOpen_ = false;
+			}
+		}
+	}
+
+	uint32_t crcUpdate(uint32_t crc, const uint8_t *p, size_t n) const
+	{
+		uint32_t c = ~crc;
+
+		for (; n >= 8; n -= 8, p += 8) {
+			uint32_t lo, hi;
+			memcpy(&lo, p, 4);
+			memcpy(&hi, p + 4, 4);
+			lo ^= c;	// little endian hosts (x86, arm)
+			c = crcTable_[7][lo & 0xff] ^ crcTable_[6][(lo >> 8) & 0xff]
+			  ^ crcTable_[5][(lo >> 16) & 0xff] ^ crcTable_[4][lo >> 24]
+			  ^ crcTable_[3][hi & 0xff] ^ crcTable_[2][(hi >> 8) & 0xff]
+			  ^ crcTable_[1][(hi >> 16) & 0xff] ^ crcTable_[0][hi >> 24];
+		}
+		while (n--)
+			c = crcTable_[0][(c ^ *p++) & 0xff] ^ (c >> 8);
+		return ~c;
+	}
+
+	void crcFill(char v, uint64_t n)
+	{
+		const uint8_t *run = runs_[v ? 1 : 0];
+
+		while (n) {
+			size_t k = n < sizeof(runs_[0]) ? n : sizeof(runs_[0]);
+			cur_.crc = crcUpdate(cur_.crc, run, k);
+			n -= k;
+		}
+	}
+
+	void beginMember(const std::string &name)
+	{
+		cur_ = Entry{name, 0, 0, out_.offset()};
+		out_.putLe(0x04034b50, 4);	// local file header
+		out_.putLe(45, 2);		// version needed (zip64)
+		out_.putLe(1 << 3, 2);		// sizes in the data descriptor
+		out_.putLe(0, 2);		// stored
+		out_.putLe(0, 4);		// dos time, date
+		out_.putLe(0, 4);		// crc
+		out_.putLe(0, 4);		// compressed size
+		out_.putLe(0, 4);		// size
+		out_.putLe(name.size(), 2);
+		out_.putLe(0, 2);
+		out_.put(name);
+	}
+
+	void endMember()
+	{
+		out_.putLe(0x08074b50, 4);	// data descriptor
+		out_.putLe(cur_.crc, 4);
+		out_.putLe(cur_.size, 4);
+		out_.putLe(cur_.size, 4);
+		entries_.push_back(cur_);
+	}
+
+	void member(const std::string &name, const std::string &data)
+	{
+		beginMember(name);
+		cur_.crc = crcUpdate(0, reinterpret_cast<const uint8_t *>(data.data()),
+				data.size());
+		cur_.size = data.size();
+		out_.put(data);
+		endMember();
+	}
+
+	void centralDirectory()
+	{
+		const uint64_t big = 0xffffffff;
+		uint64_t cdStart = out_.offset();
+
+		for (const Entry &e : entries_) {
+			bool z64 = e.offset >= big;
+			out_.putLe(0x02014b50, 4);
+			out_.putLe(45, 2);		// made by
+			out_.putLe(45, 2);		// needed
+			out_.putLe(1 << 3, 2);
+			out_.putLe(0, 2);
+			out_.putLe(0, 4);
+			out_.putLe(e.crc, 4);
+			out_.putLe(e.size, 4);
+			out_.putLe(e.size, 4);
+			out_.putLe(e.name.size(), 2);
+			out_.putLe(z64 ? 12 : 0, 2);	// extra
+			out_.putLe(0, 2);		// comment
+			out_.putLe(0, 2);		// disk
+			out_.putLe(0, 2);		// internal attributes
+			out_.putLe(0, 4);		// external attributes
+			out_.putLe(z64 ? big : e.offset, 4);
+			out_.put(e.name);
+			if (z64) {
+				out_.putLe(0x0001, 2);
+				out_.putLe(8, 2);
+				out_.putLe(e.offset, 8);
+			}
+		}
+		uint64_t cdEnd = out_.offset();
+		uint64_t cdSize = cdEnd - cdStart;
+		uint64_t n = entries_.size();
+
+		if (cdStart >= big || n >= 0xffff) {
+			out_.putLe(0x06064b50, 4);	// zip64 end of central directory
+			out_.putLe(44, 8);
+			out_.putLe(45, 2);
+			out_.putLe(45, 2);
+			out_.putLe(0, 4);
+			out_.putLe(0, 4);
+			out_.putLe(n, 8);
+			out_.putLe(n, 8);
+			out_.putLe(cdSize, 8);
+			out_.putLe(cdStart, 8);
+			out_.putLe(0x07064b50, 4);	// locator
+			out_.putLe(0, 4);
+			out_.putLe(cdEnd, 8);
+			out_.putLe(1, 4);
+		}
+		out_.putLe(0x06054b50, 4);		// end of central directory
+		out_.putLe(0, 4);
+		out_.putLe(n >= 0xffff ? 0xffff : n, 2);
+		out_.putLe(n >= 0xffff ? 0xffff : n, 2);
+		out_.putLe(cdSize >= big ? big : cdSize, 4);
+		out_.putLe(cdStart >= big ? big : cdStart, 4);
+		out_.putLe(0, 2);
+	}
+
+	Output &out_;
+	uint64_t rate_;
+	uint32_t crcTable_[8][256];
+	uint8_t runs_[2][4096];
+	std::vector<Entry> entries_;	// one per SR_CHUNK of samples
+	Entry cur_;
+	bool chunkOpen_ = false;
+	unsigned chunkNb_ = 0;
+	bool started_ = false;
+	char level_ = 0;
+	uint64_t timeUs_ = 0;
+	uint64_t sampleNb_ = 0;
+};
+
+std::unique_ptr<Writer> makeWriter(const std::string &fmt, Output &out, uint64_t rate)
+{
+	if (fmt == "vcd")
+		return std::unique_ptr<Writer>(new VcdWriter(out));
+	if (fmt == "sr")
+		return std::unique_ptr<Writer>(new SrWriter(out, rate));
+	fprintf(stderr, "unknown format %s\n", fmt.c_str());
+	exit(2);
+}
+
+/*
+ * Benchmark: synthetic OOK-like widths, converted to a counting sink
+ */
+void bench(uint64_t records, uint64_t rate)
+{
+	std::vector<rfrpi_edge> batch(BATCH);
+
+	for (const char *fmt : { "vcd", "sr" }) {
+		Output sink(-1);
+		std::unique_ptr<Writer> w = makeWriter(fmt, sink, rate);
+		uint32_t x = 12345;
+		auto t0 = std::chrono::steady_clock::now();
+
+		for (uint64_t done = 0; done < records; ) {
+			size_t n = records - done < BATCH ? records - done : BATCH;
+			for (size_t i = 0; i < n; i++) {
+				x = x * 1103515245 + 12345;
+				batch[i].width = (x >> 16) & 1 ? 350 : 1050;
+				batch[i].level = (done + i) & 1;
+				batch[i].seq = done + i;
+			}
+			w->edges(batch.data(), n);
+			done += n;
+		}
+		w->finish();
+		std::chrono::duration<double> dt = std::chrono::steady_clock::now() - t0;
+		printf("%-4s %llu records in %.3f s : %.1f Mrecords/s, %.1f MB/s out\n",
+			fmt, (unsigned long long)records, dt.count(),
+			records / dt.count() / 1e6, sink.offset() / dt.count() / 1e6);
+	}
+}
+
+void usage()
+{
+	fprintf(stderr, "usage: rfrpi_export [-t] [-f vcd|sr] [-r rate] [-o out] [in]\n"
+			"       rfrpi_export -b records\n");
+	exit(2);
+}
+
+} // namespace
+
+int main(int argc, char **argv)
+{
+	std::string fmt = "vcd";
+	const char *outPath = nullptr;
+	uint64_t rate = 1000000;
+	bool text = false;
+	int c;
+
+	while ((c = getopt(argc, argv, "tf:r:o:b:")) != -1) {
+		switch (c) {
+		case 't':
+			text = true;
+			break;
+		case 'f':
+			fmt = optarg;
+			break;
+		case 'r':
+			rate = strtoull(optarg, nullptr, 0);
+			if (!rate)
+				usage();
+			break;
+		case 'o':
+			outPath = optarg;
+			break;
+		case 'b':
+			bench(strtoull(optarg, nullptr, 0), rate);
+			return 0;
+		default:
+			usage();
+		}
+	}
+	const char *inPath = optind < argc ? argv[optind] : "/dev/stdin";
+
+	int outFd = 1;
+	if (outPath) {
+		outFd = ::open(outPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (outFd < 0) {
+			perror(outPath);
+			return 1;
+		}
+	}
+
+	try {
+		std::unique_ptr<Input> in;
+		if (text) {
+			int fd = ::open(inPath, O_RDONLY);
+			if (fd < 0) {
+				perror(inPath);
+				return 1;
+			}
+			in.reset(new TextInput(fd));
+		} else
+			in.reset(new BinaryInput(inPath));
+
+		Output out(outFd);
+		std::unique_ptr<Writer> w = makeWriter(fmt, out, rate);
+		std::vector<rfrpi_edge> batch(BATCH);
+		while (size_t n = in->read(batch.data(), batch.size()))
+			w->edges(batch.data(), n);
+		w->finish();
+	} catch (const std::exception &e) {
+		fprintf(stderr, "%s\n", e.what());
+		return 1;
+	}
+	return 0;
+}
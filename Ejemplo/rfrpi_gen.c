@@ -0,0 +1,473 @@
+/*
+ * Synthetic edge generator for the rfrpi capture module.
+ *
+ * Drives an output GPIO from an hrtimer so the capture path can be
+ * benchmarked without a transmitter. tx_gpio is wired to the capture
+ * line (GPIO 18 by default, see rfrpi rx_gpio) with a jumper, or both
+ * modules are pointed at a simulated line.
+ *
+ * Two modes :
+ *  - rate   : edges at "rate" per second, widths fixed, uniform or
+ *             exponential around the mean, optionally grouped in bursts
+ *             of "burst" edges separated by "gap_us"
+ *  - replay : widths written to /dev/rfrpi-gen in the rfrpi text format
+ *             (one width in us per line) are replayed with their timing
+ *
+ * Start and stop with /sys/module/rfrpi_gen/parameters/run, then read
+ * /dev/rfrpi-gen for the achieved rate against the capture counters.
+ *
+ * This software is licensed under the terms of the GNU General Public
+ * License version 2, as published by the Free Software Foundation, and
+ * may be copied, distributed, and modified under those terms.
+ */
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/gpio.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
+#include <linux/random.h>
+#include <linux/miscdevice.h>
+#include <linux/fs.h>
+#include <linux/uaccess.h>
+#include <linux/vmalloc.h>
+#include <linux/slab.h>
+#include <linux/list.h>
+#include <linux/mutex.h>
+
+#include "rfrpi.h"
+
+#define CREATE_TRACE_POINTS
+#include "rfrpi_gen_trace.h"
+
+#define DEV_NAME		"rfrpi-gen"
+#define GPIO_FOR_TX_SIGNAL	23
+#define TRACE_MAX		(1 << 20)	// replayed widths
+#define MIN_WIDTH_US		2
+#define LINE_LEN		64	// longest trace line
+
+enum gen_dist {
+	DIST_FIXED,
+	DIST_UNIFORM,
+	DIST_EXP,
+};
+
+static char *dist_str[] = {
+	"fixed",
+	"uniform",
+	"exp",
+};
+
+static int tx_gpio = GPIO_FOR_TX_SIGNAL;
+module_param(tx_gpio, int, 0444);
+MODULE_PARM_DESC(tx_gpio, "GPIO driven by the generator (default 23)");
+
+static char *mode = "rate";
+module_param(mode, charp, 0644);
+MODULE_PARM_DESC(mode, "rate or replay");
+
+static uint rate = 1000;
+module_param(rate, uint, 0644);
+MODULE_PARM_DESC(rate, "mean edges per second in rate mode");
+
+static char *dist = "fixed";
+module_param(dist, charp, 0644);
+MODULE_PARM_DESC(dist, "width distribution: fixed, uniform or exp");
+
+static uint burst;
+module_param(burst, uint, 0644);
+MODULE_PARM_DESC(burst, "edges per burst, 0 for a continuous stream");
+
+static uint gap_us = 10000;
+module_param(gap_us, uint, 0644);
+MODULE_PARM_DESC(gap_us, "idle time between bursts");
+
+static uint count;
+module_param(count, uint, 0644);
+MODULE_PARM_DESC(count, "stop after this many edges, 0 for no limit");
+
+/* Generator state, owned by the timer while running */
+static struct hrtimer genTimer;
+static DEFINE_MUTEX(gen_lock);
+static int  initialised;	// run can't start before init or after exit
+static int  running;
+static int  level;
+static int  useReplay;
+static enum gen_dist genDist;
+static u32  meanUs;
+static u32  inBurst;
+static u32  nbSent;
+static u32  nbLate;		// periods the timer expired too late for
+static ktime_t startTime;
+static ktime_t stopTime;
+static u32  capStart[3];	// rfrpi counters when the run started
+
+/* Replay trace */
+static u32 *trace;
+static u32  traceLen;
+static u32  tracePos;
+
+/*
+ * Per file line assembly: a line cut between two writes is kept in tail
+ * until its newline arrives, the close or the start of a run.
+ */
+struct gen_file {
+	struct list_head node;		// in genWriters, under gen_lock
+	char   tail[LINE_LEN];
+	size_t tailLen;
+};
+static LIST_HEAD(genWriters);
+
+
+/* -ln(u) * mean with u uniform in (0,1], in Q8 log2 arithmetic */
+static u32 gen_exp(u32 mean)
+{
+	u32 u = (prandom_u32() & 0xffff) + 1;
+	int msb = fls(u) - 1;
+	u32 frac = msb >= 8 ? u >> (msb - 8) : u << (8 - msb);
+	u32 l2 = (16 << 8) - ((msb << 8) | (frac & 0xff));
+
+	// ln(2) ~ 177/256
+	return (u32)(((u64)mean * l2 * 177) >> 16);
+}
+
+/* Microseconds until the next edge */
+static u32 gen_next_width(void)
+{
+	u32 w;
+
+	if (useReplay) {
+		if (tracePos >= traceLen)
+			return 0;
+		w = trace[tracePos++];
+	} else {
+		if (burst && ++inBurst >= burst) {
+			inBurst = 0;
+			return gap_us;
+		}
+		switch (genDist) {
+		case DIST_UNIFORM:
+			w = prandom_u32() % (2 * meanUs + 1);
+			break;
+		case DIST_EXP:
+			w = gen_exp(meanUs);
+			break;
+		default:
+			w = meanUs;
+			break;
+		}
+	}
+	return max_t(u32, w, MIN_WIDTH_US);
+}
+
+static enum hrtimer_restart gen_timer_cb(struct hrtimer *t)
+{
+	ktime_t next;
+	u32 w;
+
+	level = !level;
+	gpio_set_value(tx_gpio, level);
+	nbSent++;
+
+	w = gen_next_width();
+	trace_rfrpi_gen_edge(tx_gpio, level, w, nbSent, nbLate);
+	if (!w || (count && nbSent >= count)) {
+		stopTime = ktime_get();
+		running = 0;
+		return HRTIMER_NORESTART;
+	}
+	// keep the schedule, count the edges we could not place in time
+	next = ktime_add_us(hrtimer_get_expires(t), w);
+	if (ktime_before(next, ktime_get()))
+		nbLate++;
+	hrtimer_set_expires(t, next);
+	return HRTIMER_RESTART;
+}
+
+static int gen_add_line(const char *line);
+static void gen_flush(struct gen_file *gf);
+
+static int gen_start(void)
+{
+	struct gen_file *gf;
+	int d;
+
+	// unterminated last lines are part of the trace
+	list_for_each_entry(gf, &genWriters, node)
+		gen_flush(gf);
+
+	if (!strncmp(mode, "replay", 6)) {
+		if (!traceLen)
+			return -ENODATA;
+		useReplay = 1;
+	} else if (!strncmp(mode, "rate", 4)) {
+		if (!rate || rate > 1000000 / MIN_WIDTH_US)
+			return -ERANGE;
+		useReplay = 0;
+	} else
+		return -EINVAL;
+
+	genDist = DIST_FIXED;
+	for (d = 0; d < ARRAY_SIZE(dist_str); d++)
+		if (!strncmp(dist, dist_str[d], strlen(dist_str[d])))
+			genDist = d;
+
+	meanUs = useReplay ? 0 : 1000000 / rate;
+	inBurst = 0;
+	tracePos = 0;
+	nbSent = 0;
+	nbLate = 0;
+	rfrpi_get_counters(&capStart[0], &capStart[1], &capStart[2]);
+	startTime = ktime_get();
+	running = 1;
+	hrtimer_start(&genTimer, ktime_add_us(startTime, MIN_WIDTH_US),
+			HRTIMER_MODE_ABS);
+	return 0;
+}
+
+static void gen_stop(void)
+{
+	hrtimer_cancel(&genTimer);
+	if (running) {
+		stopTime = ktime_get();
+		running = 0;
+	}
+}
+
+/* /sys/module/rfrpi_gen/parameters/run */
+static int run_set(const char *val, const struct kernel_param *kp)
+{
+	long on;
+	int ret;
+
+	ret = kstrtol(val, 0, &on);
+	if (ret)
+		return ret;
+	mutex_lock(&gen_lock);
+	if (!initialised) {
+		// also set by insmod, before the timer and the GPIO exist
+		mutex_unlock(&gen_lock);
+		return -EBUSY;
+	}
+	gen_stop();
+	if (on)
+		ret = gen_start();
+	mutex_unlock(&gen_lock);
+	return ret;
+}
+
+static int run_get(char *buf, const struct kernel_param *kp)
+{
+	return sprintf(buf, "%d\n", running);
+}
+
+static const struct kernel_param_ops run_ops = {
+	.set = run_set,
+	.get = run_get,
+};
+module_param_cb(run, &run_ops, NULL, 0644);
+MODULE_PARM_DESC(run, "1 starts a run, 0 stops it");
+
+
+/*
+ * Read: report of the last (or current) run
+ */
+static ssize_t gen_read(struct file *file, char __user *buf,
+		size_t len, loff_t *pos)
+{
+	char tmp[256];
+	u32 cap[3];
+	u64 us;
+	int n;
+
+	mutex_lock(&gen_lock);
+	us = ktime_us_delta(running ? ktime_get() : stopTime, startTime);
+	rfrpi_get_counters(&cap[0], &cap[1], &cap[2]);
+	n = snprintf(tmp, sizeof(tmp),
+		"sent %u\nelapsed_us %llu\nrate %llu\nlate %u\n"
+		"captured %u\nfiltered %u\nlost %u\nmissed %d\n",
+		nbSent, us, us ? div64_u64((u64)nbSent * 1000000, us) : 0,
+		nbLate, cap[0] - capStart[0], cap[1] - capStart[1],
+		cap[2] - capStart[2], (int)(nbSent - (cap[0] - capStart[0])));
+	mutex_unlock(&gen_lock);
+	return simple_read_from_buffer(buf, len, pos, tmp, n);
+}
+
+/*
+ * One trace line, the width and an optional filter tag (rfrpi text
+ * format) that is ignored. Called with gen_lock.
+ */
+static int gen_add_line(const char *line)
+{
+	u32 w;
+
+	if (sscanf(line, "%u", &w) != 1)
+		return 0;
+	if (traceLen >= TRACE_MAX)
+		return -ENOSPC;
+	trace[traceLen++] = w;
+	return 0;
+}
+
+/* Last line without a newline, called with gen_lock */
+static void gen_flush(struct gen_file *gf)
+{
+	if (!gf->tailLen)
+		return;
+	gf->tail[gf->tailLen] = 0;
+	gen_add_line(gf->tail);
+	gf->tailLen = 0;
+}
+
+/*
+ * Write: replay trace, one width in microseconds per line. Lines may be
+ * split across writes. Opening for writing with O_TRUNC starts a new
+ * trace.
+ */
+static ssize_t gen_write(struct file *file, const char __user *buf,
+		size_t len, loff_t *pos)
+{
+	struct gen_file *gf = file->private_data;
+	char tmp[LINE_LEN];
+	size_t done = 0, n;
+	char *eol;
+	int ret;
+
+	mutex_lock(&gen_lock);
+	if (running) {
+		mutex_unlock(&gen_lock);
+		return -EBUSY;
+	}
+	while (done < len) {
+		// the start of the line from the previous write comes first
+		memcpy(tmp, gf->tail, gf->tailLen);
+		n = min(len - done, sizeof(tmp) - 1 - gf->tailLen);
+		if (copy_from_user(tmp + gf->tailLen, buf + done, n)) {
+			mutex_unlock(&gen_lock);
+			return done ? done : -EFAULT;
+		}
+		tmp[gf->tailLen + n] = 0;
+		eol = strchr(tmp + gf->tailLen, '\n');
+		if (!eol) {
+			if (gf->tailLen + n == sizeof(tmp) - 1) {
+				// line too long
+				mutex_unlock(&gen_lock);
+				return done ? done : -EINVAL;
+			}
+			// wait for the rest of the line
+			memcpy(gf->tail + gf->tailLen, tmp + gf->tailLen, n);
+			gf->tailLen += n;
+			done += n;
+			continue;
+		}
+		*eol = 0;
+		ret = gen_add_line(tmp);
+		if (ret) {
+			mutex_unlock(&gen_lock);
+			return done ? done : ret;
+		}
+		done += eol - (tmp + gf->tailLen) + 1;
+		gf->tailLen = 0;
+	}
+	mutex_unlock(&gen_lock);
+	return done;
+}
+
+static int gen_open(struct inode *inode, struct file *file)
+{
+	struct gen_file *gf;
+
+	gf = kzalloc(sizeof(*gf), GFP_KERNEL);
+	if (!gf)
+		return -ENOMEM;
+	INIT_LIST_HEAD(&gf->node);
+	file->private_data = gf;
+
+	if (file->f_mode & FMODE_WRITE) {
+		mutex_lock(&gen_lock);
+		if ((file->f_flags & O_TRUNC) && !running)
+			traceLen = 0;
+		list_add(&gf->node, &genWriters);
+		mutex_unlock(&gen_lock);
+	}
+	return nonseekable_open(inode, file);
+}
+
+static int gen_release(struct inode *inode, struct file *file)
+{
+	struct gen_file *gf = file->private_data;
+
+	mutex_lock(&gen_lock);
+	// a run flushed the tail when it started
+	if (!running)
+		gen_flush(gf);
+	list_del(&gf->node);
+	mutex_unlock(&gen_lock);
+	kfree(gf);
+	return 0;
+}
+
+static struct file_operations gen_fops = {
+	.owner = THIS_MODULE,
+	.open = gen_open,
+	.release = gen_release,
+	.read = gen_read,
+	.write = gen_write,
+};
+
+static struct miscdevice gen_misc_device = {
+	.minor = MISC_DYNAMIC_MINOR,
+	.name = DEV_NAME,
+	.fops = &gen_fops,
+};
+
+
+static int __init rfrpi_gen_init(void)
+{
+	int ret;
+
+	trace = vmalloc(TRACE_MAX * sizeof(*trace));
+	if (!trace)
+		return -ENOMEM;
+
+	ret = gpio_request_one(tx_gpio, GPIOF_OUT_INIT_LOW, "RFRPI generator");
+	if (ret) {
+		printk(KERN_ERR "RFRPI GEN - Unable to request GPIO %d: %d\n", tx_gpio, ret);
+		goto fail1;
+	}
+
+	hrtimer_init(&genTimer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+	genTimer.function = gen_timer_cb;
+
+	ret = misc_register(&gen_misc_device);
+	if (ret)
+		goto fail2;
+
+	mutex_lock(&gen_lock);
+	initialised = 1;
+	mutex_unlock(&gen_lock);
+	return 0;
+
+fail2:
+	gpio_free(tx_gpio);
+fail1:
+	vfree(trace);
+	return ret;
+}
+
+static void __exit rfrpi_gen_exit(void)
+{
+	misc_deregister(&gen_misc_device);
+	mutex_lock(&gen_lock);
+	initialised = 0;
+	gen_stop();
+	mutex_unlock(&gen_lock);
+	gpio_free(tx_gpio);
+	vfree(trace);
+}
+
+MODULE_LICENSE("GPL");
+MODULE_AUTHOR("Disk91");
+MODULE_DESCRIPTION("Synthetic edge generator for the rfrpi capture module");
+
+module_init(rfrpi_gen_init);
+module_exit(rfrpi_gen_exit);
@@ -0,0 +1,47 @@
+/*
+ * Tracepoints of the rfrpi edge generator, to line up the edges it
+ * drives with the rfrpi:* events of the capture side.
+ *
+ * This software is licensed under the terms of the GNU General Public
+ * License version 2, as published by the Free Software Foundation, and
+ * may be copied, distributed, and modified under those terms.
+ */
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM rfrpi_gen
+
+#if !defined(_RFRPI_GEN_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _RFRPI_GEN_TRACE_H
+
+#include <linux/tracepoint.h>
+
+/* width is the time until the next edge, 0 on the last one */
+TRACE_EVENT(rfrpi_gen_edge,
+	TP_PROTO(int gpio, int level, u32 width, u32 sent, u32 late),
+	TP_ARGS(gpio, level, width, sent, late),
+	TP_STRUCT__entry(
+		__field(int, gpio)
+		__field(int, level)
+		__field(u32, width)
+		__field(u32, sent)
+		__field(u32, late)
+	),
+	TP_fast_assign(
+		__entry->gpio = gpio;
+		__entry->level = level;
+		__entry->width = width;
+		__entry->sent = sent;
+		__entry->late = late;
+	),
+	TP_printk("gpio=%d level=%d width=%u sent=%u late=%u",
+		__entry->gpio, __entry->level, __entry->width,
+		__entry->sent, __entry->late)
+);
+
+#endif /* _RFRPI_GEN_TRACE_H */
+
+/* found through CFLAGS_rfrpi_gen.o := -I$(src) */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE rfrpi_gen_trace
+#include <trace/define_trace.h>
@@ -0,0 +1,118 @@
+/*
+ * Tracepoints of the rfrpi capture module.
+ *
+ *	echo 1 > /sys/kernel/debug/tracing/events/rfrpi/enable
+ *	perf record -e 'rfrpi:*' -a
+ *
+ * Disabled tracepoints cost a patched out branch, their arguments are
+ * only evaluated while the event is enabled.
+ *
+ * This software is licensed under the terms of the GNU General Public
+ * License version 2, as published by the Free Software Foundation, and
+ * may be copied, distributed, and modified under those terms.
+ */
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM rfrpi
+
+#if !defined(_RFRPI_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _RFRPI_TRACE_H
+
+#include <linux/tracepoint.h>
+
+TRACE_EVENT(rfrpi_irq_entry,
+	TP_PROTO(int irq),
+	TP_ARGS(irq),
+	TP_STRUCT__entry(
+		__field(int, irq)
+	),
+	TP_fast_assign(
+		__entry->irq = irq;
+	),
+	TP_printk("irq=%d", __entry->irq)
+);
+
+/* verdict is the capture filter result, RFRPI_FILTER_DROP when dropped */
+TRACE_EVENT(rfrpi_irq_exit,
+	TP_PROTO(u32 width, u32 level, u32 verdict),
+	TP_ARGS(width, level, verdict),
+	TP_STRUCT__entry(
+		__field(u32, width)
+		__field(u32, level)
+		__field(u32, verdict)
+	),
+	TP_fast_assign(
+		__entry->width = width;
+		__entry->level = level;
+		__entry->verdict = verdict;
+	),
+	TP_printk("width=%u level=%u verdict=0x%x",
+		__entry->width, __entry->level, __entry->verdict)
+);
+
+TRACE_EVENT(rfrpi_enqueue,
+	TP_PROTO(u32 wseq, const struct rfrpi_edge *e),
+	TP_ARGS(wseq, e),
+	TP_STRUCT__entry(
+		__field(u32, wseq)
+		__field(u32, width)
+		__field(u16, level)
+		__field(u16, symbol)
+		__field(u32, tag)
+	),
+	TP_fast_assign(
+		__entry->wseq = wseq;
+		__entry->width = e->width;
+		__entry->level = e->level;
+		__entry->symbol = e->symbol;
+		__entry->tag = e->tag;
+	),
+	TP_printk("wseq=%u width=%u level=%u symbol=%u tag=0x%x",
+		__entry->wseq, __entry->width, __entry->level,
+		__entry->symbol, __entry->tag)
+);
+
+/* lag is the number of records still queued for this reader */
+TRACE_EVENT(rfrpi_dequeue,
+	TP_PROTO(const void *reader, u32 rseq, u32 lag, u32 width),
+	TP_ARGS(reader, rseq, lag, width),
+	TP_STRUCT__entry(
+		__field(const void *, reader)
+		__field(u32, rseq)
+		__field(u32, lag)
+		__field(u32, width)
+	),
+	TP_fast_assign(
+		__entry->reader = reader;
+		__entry->rseq = rseq;
+		__entry->lag = lag;
+		__entry->width = width;
+	),
+	TP_printk("reader=%p rseq=%u lag=%u width=%u",
+		__entry->reader, __entry->rseq, __entry->lag, __entry->width)
+);
+
+TRACE_EVENT(rfrpi_overflow,
+	TP_PROTO(const void *reader, u32 lost, u32 overflows),
+	TP_ARGS(reader, lost, overflows),
+	TP_STRUCT__entry(
+		__field(const void *, reader)
+		__field(u32, lost)
+		__field(u32, overflows)
+	),
+	TP_fast_assign(
+		__entry->reader = reader;
+		__entry->lost = lost;
+		__entry->overflows = overflows;
+	),
+	TP_printk("reader=%p lost=%u overflows=%u",
+		__entry->reader, __entry->lost, __entry->overflows)
+);
+
+#endif /* _RFRPI_TRACE_H */
+
+/* found through CFLAGS_gpiomod_inpirq.o := -I$(src) */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE rfrpi_trace
+#include <trace/define_trace.h>
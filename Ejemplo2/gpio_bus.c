@@ -0,0 +1,238 @@
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/init.h>
+
+#include <linux/gpio.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/mutex.h>
+#include <linux/miscdevice.h>
+#include <linux/fs.h>
+#include <linux/uaccess.h>
+#include <asm/io.h>
+
+#include "gpio_bus.h"
+
+#define CREATE_TRACE_POINTS
+#include "gpio_bus_trace.h"
+
+
+#define DRIVER_AUTHOR "Igor <hardware.coder@gmail.com>"
+#define DRIVER_DESC   "Atomic multi pin GPIO output"
+
+// /dev/gpio-bus
+#define BUS_DEV_NAME     "gpio-bus"
+
+// GPIO block, bank 0 set / clear / level registers
+#define BCM2708_PERI_BASE 0x3F000000
+#define GPIO_BASE         (BCM2708_PERI_BASE + 0x200000)
+#define GPIO_SET0         (gpio_reg+0x1C)
+#define GPIO_CLR0         (gpio_reg+0x28)
+#define GPIO_LEV0         (gpio_reg+0x34)
+
+#define BUS_BATCH        64      // words copied from user space at once
+
+
+/****************************************************************************/
+/* Bus variables block                                                      */
+/****************************************************************************/
+
+// pins claimed by any file, so two files never drive the same line
+static u32 bus_claimed;
+static DEFINE_MUTEX(bus_mutex);
+
+// keeps the set / clear pair of a word together against other writers
+static DEFINE_SPINLOCK(bus_lock);
+
+static void __iomem *gpio_reg;
+
+// per open file
+struct bus_file {
+   u32 mask;                      // pins claimed by this file
+};
+
+
+/****************************************************************************/
+/* Output - the two writes of a word                                        */
+/****************************************************************************/
+static void bus_apply(u32 mask, u32 value) {
+   unsigned long flags;
+
+   trace_gpio_bus_write(mask & value, mask & ~value);
+   spin_lock_irqsave(&bus_lock, flags);
+   if (mask & value)
+      __raw_writel(mask & value, GPIO_SET0);
+   if (mask & ~value)
+      __raw_writel(mask & ~value, GPIO_CLR0);
+   spin_unlock_irqrestore(&bus_lock, flags);
+}
+
+
+/****************************************************************************/
+/* Claim / release - called with bus_mutex held                             */
+/****************************************************************************/
+static void bus_release(struct bus_file *bf, u32 mask) {
+   int i;
+
+   mask &= bf->mask;
+   for (i = 0; i < 32; i++)
+      if (mask & BIT(i))
+         gpio_free(i);
+   bf->mask &= ~mask;
+   bus_claimed &= ~mask;
+}
+
+static int bus_claim(struct bus_file *bf, u32 mask) {
+   u32 done = 0;
+   int i, ret;
+
+   if (mask & bus_claimed & ~bf->mask)
+      return -EBUSY;
+   mask &= ~bf->mask;
+   for (i = 0; i < 32; i++) {
+      if (!(mask & BIT(i)))
+         continue;
+      ret = gpio_request_one(i, GPIOF_OUT_INIT_LOW, BUS_DEV_NAME);
+      if (ret) {
+         bf->mask |= done;
+         bus_claimed |= done;
+         bus_release(bf, done);
+         return ret;
+      }
+      done |= BIT(i);
+   }
+   bf->mask |= mask;
+   bus_claimed |= mask;
+   return 0;
+}
+
+
+/****************************************************************************/
+/* Character device                                                         */
+/****************************************************************************/
+static int bus_open(struct inode *inode, struct file *file) {
+   struct bus_file *bf;
+
+   bf = kzalloc(sizeof(*bf), GFP_KERNEL);
+   if (!bf)
+      return -ENOMEM;
+   file->private_data = bf;
+   return nonseekable_open(inode, file);
+}
+
+static int bus_close(struct inode *inode, struct file *file) {
+   struct bus_file *bf = file->private_data;
+
+   mutex_lock(&bus_mutex);
+   bus_release(bf, bf->mask);
+   mutex_unlock(&bus_mutex);
+   kfree(bf);
+   return 0;
+}
+
+static ssize_t bus_write(struct file *file, const char __user *buf,
+                         size_t len, loff_t *pos) {
+   struct bus_file *bf = file->private_data;
+   struct gpio_bus_word words[BUS_BATCH];
+   size_t done = 0, n, i;
+
+   if (len % sizeof(words[0]))
+      return -EINVAL;
+   while (done < len) {
+      n = min(len - done, sizeof(words));
+      if (copy_from_user(words, buf + done, n))
+         return done ? done : -EFAULT;
+      n /= sizeof(words[0]);
+      for (i = 0; i < n; i++)
+         if (words[i].mask & ~READ_ONCE(bf->mask))
+            return done ? done : -EPERM;
+      for (i = 0; i < n; i++)
+         bus_apply(words[i].mask, words[i].value);
+      done += n * sizeof(words[0]);
+   }
+   return done;
+}
+
+static long bus_ioctl(struct file *file, unsigned int cmd, unsigned long arg) {
+   struct bus_file *bf = file->private_data;
+   struct gpio_bus_word w;
+   long ret = 0;
+
+   switch (cmd) {
+   case GPIO_BUS_IOC_CLAIM:
+      mutex_lock(&bus_mutex);
+      ret = bus_claim(bf, arg);
+      mutex_unlock(&bus_mutex);
+      break;
+   case GPIO_BUS_IOC_RELEASE:
+      mutex_lock(&bus_mutex);
+      bus_release(bf, arg);
+      mutex_unlock(&bus_mutex);
+      break;
+   case GPIO_BUS_IOC_SET:
+      if (copy_from_user(&w, (void __user *)arg, sizeof(w)))
+         return -EFAULT;
+      if (w.mask & ~READ_ONCE(bf->mask))
+         return -EPERM;
+      bus_apply(w.mask, w.value);
+      break;
+   case GPIO_BUS_IOC_GET:
+      ret = put_user(__raw_readl(GPIO_LEV0), (__u32 __user *)arg);
+      break;
+   default:
+      ret = -ENOTTY;
+   }
+   return ret;
+}
+
+static struct file_operations bus_fops = {
+   .owner          = THIS_MODULE,
+   .open           = bus_open,
+   .release        = bus_close,
+   .write          = bus_write,
+   .unlocked_ioctl = bus_ioctl,
+};
+
+static struct miscdevice bus_misc_device = {
+   .minor = MISC_DYNAMIC_MINOR,
+   .name  = BUS_DEV_NAME,
+   .fops  = &bus_fops,
+};
+
+
+/****************************************************************************/
+/* Module init / cleanup block.                                             */
+/****************************************************************************/
+int bus_init(void) {
+   int ret;
+
+   gpio_reg = ioremap(GPIO_BASE, 1024);
+   if (!gpio_reg)
+      return -ENOMEM;
+
+   ret = misc_register(&bus_misc_device);
+   if (ret) {
+      printk(KERN_ERR "Unable to register %s: %d\n", BUS_DEV_NAME, ret);
+      iounmap(gpio_reg);
+   }
+   return ret;
+}
+
+void bus_cleanup(void) {
+
+   // files hold a module reference, none is open here
+   misc_deregister(&bus_misc_device);
+   iounmap(gpio_reg);
+}
+
+
+module_init(bus_init);
+module_exit(bus_cleanup);
+
+
+/****************************************************************************/
+/* Module licensing/description block.                                      */
+/****************************************************************************/
+MODULE_LICENSE("GPL");
+MODULE_AUTHOR(DRIVER_AUTHOR);
+MODULE_DESCRIPTION(DRIVER_DESC);
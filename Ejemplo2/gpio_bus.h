@@ -0,0 +1,37 @@
+/****************************************************************************/
+/* User space interface of the GPIO bus output device (/dev/gpio-bus)       */
+/*                                                                          */
+/* Drives several outputs of GPIO bank 0 (GPIO 0..31) at once through the  */
+/* SoC set / clear registers: one write raises the pins, a second one       */
+/* lowers the others, no pin glitches through an intermediate value        */
+/* of its own. Shared by the kernel module and user space programs.         */
+/****************************************************************************/
+#ifndef _GPIO_BUS_H
+#define _GPIO_BUS_H
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+/* one update of the bus: pins of mask take their bit of value */
+struct gpio_bus_word {
+   __u32 mask;
+   __u32 value;
+};
+
+#define GPIO_BUS_IOC_MAGIC     'b'
+/* request the pins of the mask (passed by value) as outputs, low */
+#define GPIO_BUS_IOC_CLAIM     _IO(GPIO_BUS_IOC_MAGIC, 1)
+/* give back the pins of the mask (passed by value) */
+#define GPIO_BUS_IOC_RELEASE   _IO(GPIO_BUS_IOC_MAGIC, 2)
+/* apply one word */
+#define GPIO_BUS_IOC_SET       _IOW(GPIO_BUS_IOC_MAGIC, 3, struct gpio_bus_word)
+/* read the level of all bank 0 pins */
+#define GPIO_BUS_IOC_GET       _IOR(GPIO_BUS_IOC_MAGIC, 4, __u32)
+
+/*
+ * write() takes an array of struct gpio_bus_word, applied back to back
+ * in one call (parallel bus strobes, LED segment multiplexing...).
+ * Only pins claimed on the same open file may be driven.
+ */
+
+#endif /* _GPIO_BUS_H */
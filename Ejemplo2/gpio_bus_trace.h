@@ -0,0 +1,36 @@
+/****************************************************************************/
+/* Tracepoints of the GPIO bus output device                                */
+/*                                                                          */
+/* echo 1 > /sys/kernel/debug/tracing/events/gpio_bus/enable                */
+/****************************************************************************/
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM gpio_bus
+
+#if !defined(_GPIO_BUS_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _GPIO_BUS_TRACE_H
+
+#include <linux/tracepoint.h>
+
+// the values written to GPSET0 and GPCLR0 for one word, 0 is not written
+TRACE_EVENT(gpio_bus_write,
+   TP_PROTO(u32 set, u32 clr),
+   TP_ARGS(set, clr),
+   TP_STRUCT__entry(
+      __field(u32, set)
+      __field(u32, clr)
+   ),
+   TP_fast_assign(
+      __entry->set = set;
+      __entry->clr = clr;
+   ),
+   TP_printk("set=0x%08x clr=0x%08x", __entry->set, __entry->clr)
+);
+
+#endif /* _GPIO_BUS_TRACE_H */
+
+// found through CFLAGS_gpio_bus.o := -I$(src)
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE gpio_bus_trace
+#include <trace/define_trace.h>
@@ -0,0 +1,455 @@
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/init.h>
+
+#include <linux/interrupt.h>
+#include <linux/gpio.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
+#include <linux/spinlock.h>
+#include <linux/mutex.h>
+#include <linux/miscdevice.h>
+#include <linux/fs.h>
+#include <linux/uaccess.h>
+
+#include "gpio_rules.h"
+// PWM duty setter of the Ejemplo4 driver, see CFLAGS_gpio_rules.o
+#include "pwm_embedded.h"
+
+#define CREATE_TRACE_POINTS
+#include "gpio_rules_trace.h"
+
+
+#define DRIVER_AUTHOR "Igor <hardware.coder@gmail.com>"
+#define DRIVER_DESC   "GPIO event to action rules"
+
+// /dev/gpio-rules
+#define RULES_DEV_NAME   "gpio-rules"
+
+#define MAX_RULES        16
+#define MAX_PINS         16
+
+
+/****************************************************************************/
+/* Rules variables block                                                    */
+/****************************************************************************/
+
+// a line used by at least one rule, inputs get an interrupt
+struct rule_pin {
+   int gpio;
+   int irq;
+   int users;
+   int is_input;
+   ktime_t last_edge;
+   // debounce: the first edge arms db_timer, the level is sampled when
+   // it fires and only a change of the settled level is an event
+   u32 debounce_us;
+   int db_armed;
+   int level;                     // last settled level
+   struct hrtimer db_timer;
+};
+
+struct rule {
+   int used;
+   struct gpio_rule r;
+   struct rule_pin *in;
+   struct rule_pin *out;          // NULL for PWM actions
+   struct hrtimer held_timer;     // EV_HELD
+   struct hrtimer pulse_timer;    // ACT_PULSE
+   u32 pulses;                    // EV_PATTERN: matching pulses so far
+   // ACT_PWM_DUTY: taken from pwm_embedded while the rule exists, the
+   // PWM registers stay owned by that driver
+   int (*set_duty)(unsigned int channel, u32 duty);
+};
+
+static struct rule rules[MAX_RULES];
+static struct rule_pin pins[MAX_PINS];
+
+// rules_lock protects rules[] against the interrupts, rules_mutex the
+// ioctl side which also requests lines and irqs
+static DEFINE_SPINLOCK(rules_lock);
+static DEFINE_MUTEX(rules_mutex);
+
+
+/****************************************************************************/
+/* Actions - called with rules_lock held, from interrupt or timer           */
+/****************************************************************************/
+static void rule_action(struct rule *ru) {
+
+   trace_gpio_rules_action(ru - rules, ru->r.action,
+                           ru->out ? ru->out->gpio : -1, ru->r.value);
+   switch (ru->r.action) {
+   case GPIO_RULE_ACT_SET:
+      gpio_set_value(ru->out->gpio, !!ru->r.value);
+      break;
+   case GPIO_RULE_ACT_TOGGLE:
+      gpio_set_value(ru->out->gpio, !gpio_get_value(ru->out->gpio));
+      break;
+   case GPIO_RULE_ACT_PULSE:
+      gpio_set_value(ru->out->gpio, 1);
+      hrtimer_start(&ru->pulse_timer, ns_to_ktime((u64)ru->r.value * 1000),
+                    HRTIMER_MODE_REL);
+      break;
+   case GPIO_RULE_ACT_PWM_DUTY:
+      // fails while the PWM is stopped, there is nothing to change then
+      ru->set_duty(0, ru->r.value);
+      break;
+   }
+}
+
+static enum hrtimer_restart pulse_timer_cb(struct hrtimer *t) {
+   struct rule *ru = container_of(t, struct rule, pulse_timer);
+
+   spin_lock(&rules_lock);
+   if (ru->used)
+      gpio_set_value(ru->out->gpio, 0);
+   spin_unlock(&rules_lock);
+   return HRTIMER_NORESTART;
+}
+
+static enum hrtimer_restart held_timer_cb(struct hrtimer *t) {
+   struct rule *ru = container_of(t, struct rule, held_timer);
+
+   spin_lock(&rules_lock);
+   if (ru->used && gpio_get_value(ru->in->gpio) == !!ru->r.level)
+      rule_action(ru);
+   spin_unlock(&rules_lock);
+   return HRTIMER_NORESTART;
+}
+
+
+/****************************************************************************/
+/* Events - an edge on a rule input, width is the time since the last edge  */
+/****************************************************************************/
+static void rule_event(struct rule *ru, int level, s64 width) {
+
+   switch (ru->r.event) {
+   case GPIO_RULE_EV_RISING:
+      if (level)
+         rule_action(ru);
+      break;
+   case GPIO_RULE_EV_FALLING:
+      if (!level)
+         rule_action(ru);
+      break;
+   case GPIO_RULE_EV_BOTH:
+      rule_action(ru);
+      break;
+   case GPIO_RULE_EV_HELD:
+      if (level == !!ru->r.level)
+         hrtimer_start(&ru->held_timer,
+                       ns_to_ktime((u64)ru->r.held_ms * NSEC_PER_MSEC),
+                       HRTIMER_MODE_REL);
+      else
+         hrtimer_try_to_cancel(&ru->held_timer);
+      break;
+   case GPIO_RULE_EV_PATTERN:
+      if (width < ru->r.pulse_min_us || width > ru->r.pulse_max_us) {
+         ru->pulses = 0;
+         break;
+      }
+      if (++ru->pulses >= ru->r.nb_pulses) {
+         ru->pulses = 0;
+         rule_action(ru);
+      }
+      break;
+   }
+}
+
+static void pin_edge(struct rule_pin *pin, int level, ktime_t now) {
+   s64 width = ktime_us_delta(now, pin->last_edge);
+   int i;
+
+   pin->last_edge = now;
+   pin->level = level;
+   trace_gpio_rules_edge(pin->gpio, level, width);
+
+   spin_lock(&rules_lock);
+   for (i = 0; i < MAX_RULES; i++)
+      if (rules[i].used && rules[i].in == pin)
+         rule_event(&rules[i], level, width);
+   spin_unlock(&rules_lock);
+}
+
+static enum hrtimer_restart db_timer_cb(struct hrtimer *t) {
+   struct rule_pin *pin = container_of(t, struct rule_pin, db_timer);
+   int level = gpio_get_value(pin->gpio);
+
+   pin->db_armed = 0;
+   // a bounce that came back to the settled level is no event
+   if (level != pin->level)
+      pin_edge(pin, level, ktime_get());
+   return HRTIMER_NORESTART;
+}
+
+static irqreturn_t rules_irq_handler(int irq, void *dev_id) {
+   struct rule_pin *pin = dev_id;
+   u32 debounce_us = READ_ONCE(pin->debounce_us);
+
+   trace_gpio_rules_irq_entry(pin->gpio, irq);
+   if (debounce_us) {
+      if (!pin->db_armed) {
+         pin->db_armed = 1;
+         hrtimer_start(&pin->db_timer, ns_to_ktime((u64)debounce_us * 1000),
+                       HRTIMER_MODE_REL);
+      }
+   } else
+      pin_edge(pin, gpio_get_value(pin->gpio), ktime_get());
+   trace_gpio_rules_irq_exit(pin->gpio, irq);
+   return IRQ_HANDLED;
+}
+
+
+/****************************************************************************/
+/* Lines shared by the rules - called with rules_mutex held                 */
+/****************************************************************************/
+static struct rule_pin *pin_get(int gpio, int is_input) {
+   struct rule_pin *free = NULL;
+   int i, ret;
+
+   for (i = 0; i < MAX_PINS; i++) {
+      if (pins[i].users && pins[i].gpio == gpio) {
+         if (pins[i].is_input != is_input)
+            return ERR_PTR(-EBUSY);
+         pins[i].users++;
+         return &pins[i];
+      }
+      if (!pins[i].users && !free)
+         free = &pins[i];
+   }
+   if (!free)
+      return ERR_PTR(-ENOSPC);
+
+   ret = gpio_request_one(gpio, is_input ? GPIOF_IN : GPIOF_OUT_INIT_LOW,
+                          RULES_DEV_NAME);
+   if (ret)
+      return ERR_PTR(ret);
+
+   free->gpio = gpio;
+   free->is_input = is_input;
+   free->irq = -1;
+   free->last_edge = ktime_get();
+   free->debounce_us = 0;
+   free->db_armed = 0;
+   if (is_input) {
+      free->level = gpio_get_value(gpio);
+      hrtimer_init(&free->db_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+      free->db_timer.function = db_timer_cb;
+      ret = gpio_to_irq(gpio);
+      if (ret >= 0) {
+         free->irq = ret;
+         ret = request_irq(free->irq, rules_irq_handler,
+                           IRQF_TRIGGER_RISING | IRQF_TRIGGER_FALLING,
+                           RULES_DEV_NAME, free);
+      }
+      if (ret) {
+         gpio_free(gpio);
+         return ERR_PTR(ret);
+      }
+   }
+   free->users = 1;
+   return free;
+}
+
+static void pin_put(struct rule_pin *pin) {
+
+   if (!pin || --pin->users)
+      return;
+   if (pin->is_input) {
+      free_irq(pin->irq, pin);
+      hrtimer_cancel(&pin->db_timer);
+   }
+   gpio_free(pin->gpio);
+}
+
+
+/****************************************************************************/
+/* Rule add / remove                                                        */
+/****************************************************************************/
+static int rule_check(const struct gpio_rule *r) {
+
+   if (r->event > GPIO_RULE_EV_PATTERN || r->action > GPIO_RULE_ACT_PWM_DUTY)
+      return -EINVAL;
+   if (r->event == GPIO_RULE_EV_HELD && !r->held_ms)
+      return -EINVAL;
+   if (r->event == GPIO_RULE_EV_PATTERN &&
+       (!r->nb_pulses || r->pulse_min_us > r->pulse_max_us))
+      return -EINVAL;
+   if (r->action == GPIO_RULE_ACT_PULSE && !r->value)
+      return -EINVAL;
+   if (r->action == GPIO_RULE_ACT_PWM_DUTY && (r->value < 1 || r->value > 99))
+      return -ERANGE;
+   return 0;
+}
+
+// the longest debounce of the rules still using the input
+static void pin_update_debounce(struct rule_pin *pin) {
+   u32 debounce_us = 0;
+   int i;
+
+   for (i = 0; i < MAX_RULES; i++)
+      if (rules[i].used && rules[i].in == pin)
+         debounce_us = max(debounce_us, rules[i].r.debounce_us);
+   WRITE_ONCE(pin->debounce_us, debounce_us);
+}
+
+static int rule_add(const struct gpio_rule *r) {
+   struct rule *ru = NULL;
+   struct rule_pin *in, *out = NULL;
+   unsigned long flags;
+   int i, ret;
+
+   ret = rule_check(r);
+   if (ret)
+      return ret;
+
+   for (i = 0; i < MAX_RULES; i++)
+      if (!rules[i].used) {
+         ru = &rules[i];
+         break;
+      }
+   if (!ru)
+      return -ENOSPC;
+
+   in = pin_get(r->in_gpio, 1);
+   if (IS_ERR(in))
+      return PTR_ERR(in);
+   ru->set_duty = NULL;
+   if (r->action == GPIO_RULE_ACT_PWM_DUTY) {
+      // the PWM driver can't be unloaded while a rule uses it
+      ru->set_duty = symbol_get(pwm_embedded_set_duty);
+      if (!ru->set_duty) {
+         pin_put(in);
+         return -ENODEV;
+      }
+   } else {
+      out = pin_get(r->out_gpio, 0);
+      if (IS_ERR(out)) {
+         pin_put(in);
+         return PTR_ERR(out);
+      }
+   }
+
+   hrtimer_init(&ru->held_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+   ru->held_timer.function = held_timer_cb;
+   hrtimer_init(&ru->pulse_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+   ru->pulse_timer.function = pulse_timer_cb;
+
+   spin_lock_irqsave(&rules_lock, flags);
+   ru->r = *r;
+   ru->in = in;
+   ru->out = out;
+   ru->pulses = 0;
+   ru->used = 1;
+   spin_unlock_irqrestore(&rules_lock, flags);
+   pin_update_debounce(in);
+
+   return ru - rules;
+}
+
+static int rule_del(unsigned long id) {
+   struct rule *ru;
+   unsigned long flags;
+
+   if (id >= MAX_RULES || !rules[id].used)
+      return -ENOENT;
+   ru = &rules[id];
+
+   spin_lock_irqsave(&rules_lock, flags);
+   ru->used = 0;
+   spin_unlock_irqrestore(&rules_lock, flags);
+
+   hrtimer_cancel(&ru->held_timer);
+   hrtimer_cancel(&ru->pulse_timer);
+   // a pulse cut short would leave the output high, and with used
+   // already 0 a pulse_timer_cb in flight did not drive it low either
+   if (ru->r.action == GPIO_RULE_ACT_PULSE)
+      gpio_set_value(ru->out->gpio, 0);
+   if (ru->set_duty) {
+      symbol_put(pwm_embedded_set_duty);
+      ru->set_duty = NULL;
+   }
+   pin_update_debounce(ru->in);
+   pin_put(ru->in);
+   pin_put(ru->out);
+   return 0;
+}
+
+
+/****************************************************************************/
+/* Character device                                                         */
+/****************************************************************************/
+static long rules_ioctl(struct file *file, unsigned int cmd, unsigned long arg) {
+   struct gpio_rule r;
+   long ret = 0;
+   int i;
+
+   mutex_lock(&rules_mutex);
+   switch (cmd) {
+   case GPIO_RULES_IOC_ADD:
+      if (copy_from_user(&r, (void __user *)arg, sizeof(r)))
+         ret = -EFAULT;
+      else
+         ret = rule_add(&r);
+      break;
+   case GPIO_RULES_IOC_DEL:
+      ret = rule_del(arg);
+      break;
+   case GPIO_RULES_IOC_CLEAR:
+      for (i = 0; i < MAX_RULES; i++)
+         if (rules[i].used)
+            rule_del(i);
+      break;
+   default:
+      ret = -ENOTTY;
+   }
+   mutex_unlock(&rules_mutex);
+   return ret;
+}
+
+static struct file_operations rules_fops = {
+   .owner          = THIS_MODULE,
+   .unlocked_ioctl = rules_ioctl,
+};
+
+static struct miscdevice rules_misc_device = {
+   .minor = MISC_DYNAMIC_MINOR,
+   .name  = RULES_DEV_NAME,
+   .fops  = &rules_fops,
+};
+
+
+/****************************************************************************/
+/* Module init / cleanup block.                                             */
+/****************************************************************************/
+int rules_init(void) {
+   int ret;
+
+   ret = misc_register(&rules_misc_device);
+   if (ret)
+      printk(KERN_ERR "Unable to register %s: %d\n", RULES_DEV_NAME, ret);
+   return ret;
+}
+
+void rules_cleanup(void) {
+   int i;
+
+   misc_deregister(&rules_misc_device);
+   mutex_lock(&rules_mutex);
+   for (i = 0; i < MAX_RULES; i++)
+      if (rules[i].used)
+         rule_del(i);
+   mutex_unlock(&rules_mutex);
+}
+
+
+module_init(rules_init);
+module_exit(rules_cleanup);
+
+
+/****************************************************************************/
+/* Module licensing/description block.                                      */
+/****************************************************************************/
+MODULE_LICENSE("GPL");
+MODULE_AUTHOR(DRIVER_AUTHOR);
+MODULE_DESCRIPTION(DRIVER_DESC);
@@ -0,0 +1,50 @@
+/****************************************************************************/
+/* User space interface of the GPIO rules engine (/dev/gpio-rules)          */
+/*                                                                          */
+/* A rule maps an input event to an output action. Rules run in the GPIO    */
+/* interrupt, so the action follows the event within microseconds.         */
+/* Shared by the kernel module and user space programs.                     */
+/****************************************************************************/
+#ifndef _GPIO_RULES_H
+#define _GPIO_RULES_H
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+/* Input events */
+#define GPIO_RULE_EV_RISING    0   // rising edge on in_gpio
+#define GPIO_RULE_EV_FALLING   1   // falling edge on in_gpio
+#define GPIO_RULE_EV_BOTH      2   // any edge
+#define GPIO_RULE_EV_HELD      3   // in_gpio kept at level for held_ms
+#define GPIO_RULE_EV_PATTERN   4   // nb_pulses pulses of pulse_min_us..pulse_max_us
+
+/* Actions */
+#define GPIO_RULE_ACT_SET      0   // out_gpio = value
+#define GPIO_RULE_ACT_TOGGLE   1   // out_gpio = !out_gpio
+#define GPIO_RULE_ACT_PULSE    2   // out_gpio high for value us
+#define GPIO_RULE_ACT_PWM_DUTY 3   // hardware PWM channel 1 duty = value %, 1 to 99,
+                                   // through the pwm_embedded driver (Ejemplo4)
+
+struct gpio_rule {
+   __u32 in_gpio;
+   __u32 debounce_us;    // settle time of in_gpio, the longest of its rules wins
+   __u32 event;          // GPIO_RULE_EV_xxx
+   __u32 level;          // EV_HELD: level to hold
+   __u32 held_ms;        // EV_HELD: time to hold it
+   __u32 nb_pulses;      // EV_PATTERN: pulses in the pattern
+   __u32 pulse_min_us;   // EV_PATTERN: accepted pulse widths
+   __u32 pulse_max_us;
+   __u32 action;         // GPIO_RULE_ACT_xxx
+   __u32 out_gpio;       // unused for ACT_PWM_DUTY
+   __u32 value;          // see the actions
+};
+
+#define GPIO_RULES_IOC_MAGIC   'g'
+/* add a rule, returns its id */
+#define GPIO_RULES_IOC_ADD     _IOW(GPIO_RULES_IOC_MAGIC, 1, struct gpio_rule)
+/* remove the rule whose id is passed by value */
+#define GPIO_RULES_IOC_DEL     _IO(GPIO_RULES_IOC_MAGIC, 2)
+/* remove every rule */
+#define GPIO_RULES_IOC_CLEAR   _IO(GPIO_RULES_IOC_MAGIC, 3)
+
+#endif /* _GPIO_RULES_H */
@@ -0,0 +1,83 @@
+/****************************************************************************/
+/* Tracepoints of the GPIO rules engine                                     */
+/*                                                                          */
+/* echo 1 > /sys/kernel/debug/tracing/events/gpio_rules/enable              */
+/****************************************************************************/
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM gpio_rules
+
+#if !defined(_GPIO_RULES_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _GPIO_RULES_TRACE_H
+
+#include <linux/tracepoint.h>
+
+DECLARE_EVENT_CLASS(gpio_rules_irq,
+   TP_PROTO(int gpio, int irq),
+   TP_ARGS(gpio, irq),
+   TP_STRUCT__entry(
+      __field(int, gpio)
+      __field(int, irq)
+   ),
+   TP_fast_assign(
+      __entry->gpio = gpio;
+      __entry->irq = irq;
+   ),
+   TP_printk("gpio=%d irq=%d", __entry->gpio, __entry->irq)
+);
+
+DEFINE_EVENT(gpio_rules_irq, gpio_rules_irq_entry,
+   TP_PROTO(int gpio, int irq),
+   TP_ARGS(gpio, irq)
+);
+
+DEFINE_EVENT(gpio_rules_irq, gpio_rules_irq_exit,
+   TP_PROTO(int gpio, int irq),
+   TP_ARGS(gpio, irq)
+);
+
+// an edge handed to the rules, after debouncing
+TRACE_EVENT(gpio_rules_edge,
+   TP_PROTO(int gpio, int level, s64 width),
+   TP_ARGS(gpio, level, width),
+   TP_STRUCT__entry(
+      __field(int, gpio)
+      __field(int, level)
+      __field(s64, width)
+   ),
+   TP_fast_assign(
+      __entry->gpio = gpio;
+      __entry->level = level;
+      __entry->width = width;
+   ),
+   TP_printk("gpio=%d level=%d width=%lld",
+             __entry->gpio, __entry->level, __entry->width)
+);
+
+// out_gpio is -1 for the PWM duty action
+TRACE_EVENT(gpio_rules_action,
+   TP_PROTO(int id, u32 action, int out_gpio, u32 value),
+   TP_ARGS(id, action, out_gpio, value),
+   TP_STRUCT__entry(
+      __field(int, id)
+      __field(u32, action)
+      __field(int, out_gpio)
+      __field(u32, value)
+   ),
+   TP_fast_assign(
+      __entry->id = id;
+      __entry->action = action;
+      __entry->out_gpio = out_gpio;
+      __entry->value = value;
+   ),
+   TP_printk("rule=%d action=%u out=%d value=%u",
+             __entry->id, __entry->action, __entry->out_gpio, __entry->value)
+);
+
+#endif /* _GPIO_RULES_TRACE_H */
+
+// found through CFLAGS_gpio_rules.o := -I$(src)
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE gpio_rules_trace
+#include <trace/define_trace.h>
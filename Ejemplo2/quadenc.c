@@ -0,0 +1,331 @@
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/init.h>
+
+#include <linux/interrupt.h>
+#include <linux/gpio.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
+#include <linux/spinlock.h>
+#include <linux/seqlock.h>
+#include <linux/miscdevice.h>
+#include <linux/fs.h>
+#include <linux/uaccess.h>
+#include <asm/io.h>
+
+#include "quadenc.h"
+
+
+#define DRIVER_AUTHOR "Igor <hardware.coder@gmail.com>"
+#define DRIVER_DESC   "Quadrature encoder decoder"
+
+// /dev/quadenc
+#define QUAD_DEV_NAME    "quadenc"
+
+#define MAX_ENCODERS     4
+
+// both channels are sampled with one read of the level register
+#define BCM2708_PERI_BASE 0x3F000000
+#define GPIO_BASE         (BCM2708_PERI_BASE + 0x200000)
+#define GPIO_LEV0         (gpio_reg+0x34)
+
+
+/****************************************************************************/
+/* Encoder variables block                                                  */
+/****************************************************************************/
+static int pins[2 * MAX_ENCODERS] = { 5, 6 };
+static int nb_pins = 2;
+module_param_array(pins, int, &nb_pins, 0444);
+MODULE_PARM_DESC(pins, "A,B gpio pairs, one per encoder (default 5,6)");
+
+static uint vel_ms = 100;
+module_param(vel_ms, uint, 0444);
+MODULE_PARM_DESC(vel_ms, "velocity window");
+
+struct encoder {
+   int gpio_a;
+   int gpio_b;
+   int irq_a;
+   int irq_b;
+   u32 ab;                        // last state, A in bit 1, B in bit 0
+   // written by the interrupts under lock, read under seq
+   raw_spinlock_t lock;
+   seqcount_t seq;
+   struct quadenc_state st;
+   s64 win_pos;                   // position at the start of the window
+};
+
+static struct encoder encs[MAX_ENCODERS];
+static int nb_encs;
+
+static struct hrtimer vel_timer;
+static void __iomem *gpio_reg;
+
+/*
+ * Count for (previous << 2 | current) state, 2 marks the illegal
+ * transitions where both inputs changed. A leading B counts up:
+ * 00 -> 10 -> 11 -> 01 -> 00
+ */
+#define QUAD_ERR 2
+static const s8 quad_table[16] = {
+    0, -1, +1, QUAD_ERR,
+   +1,  0, QUAD_ERR, -1,
+   -1, QUAD_ERR,  0, +1,
+   QUAD_ERR, +1, -1,  0,
+};
+
+
+/****************************************************************************/
+/* IRQ handler - both channels of an encoder                                */
+/****************************************************************************/
+static inline u32 enc_sample(struct encoder *e) {
+   u32 lev = __raw_readl(GPIO_LEV0);
+
+   return ((lev >> e->gpio_a) & 1) << 1 | ((lev >> e->gpio_b) & 1);
+}
+
+static irqreturn_t quad_irq_handler(int irq, void *dev_id) {
+   struct encoder *e = dev_id;
+   unsigned long flags;
+   u32 ab;
+   s8 step;
+
+   raw_spin_lock_irqsave(&e->lock, flags);
+   ab = enc_sample(e);
+   step = quad_table[e->ab << 2 | ab];
+   e->ab = ab;
+
+   write_seqcount_begin(&e->seq);
+   e->st.edges++;
+   if (step == QUAD_ERR)
+      e->st.errors++;
+   else if (step) {
+      e->st.position += step;
+      e->st.stamp_ns = ktime_get_ns();
+   }
+   write_seqcount_end(&e->seq);
+   raw_spin_unlock_irqrestore(&e->lock, flags);
+
+   return IRQ_HANDLED;
+}
+
+
+/****************************************************************************/
+/* Velocity - counts over the last window, also when the shaft stopped      */
+/****************************************************************************/
+static enum hrtimer_restart vel_timer_cb(struct hrtimer *t) {
+   unsigned long flags;
+   int i;
+
+   for (i = 0; i < nb_encs; i++) {
+      struct encoder *e = &encs[i];
+
+      raw_spin_lock_irqsave(&e->lock, flags);
+      write_seqcount_begin(&e->seq);
+      e->st.velocity = div_s64((e->st.position - e->win_pos) * 1000, vel_ms);
+      write_seqcount_end(&e->seq);
+      e->win_pos = e->st.position;
+      raw_spin_unlock_irqrestore(&e->lock, flags);
+   }
+   hrtimer_forward_now(t, ns_to_ktime((u64)vel_ms * NSEC_PER_MSEC));
+   return HRTIMER_RESTART;
+}
+
+
+/****************************************************************************/
+/* Lock free copy of the counters                                           */
+/****************************************************************************/
+static void enc_snapshot(struct encoder *e, struct quadenc_state *st) {
+   unsigned int seq;
+
+   do {
+      seq = read_seqcount_begin(&e->seq);
+      *st = e->st;
+   } while (read_seqcount_retry(&e->seq, seq));
+}
+
+static void enc_reset(struct encoder *e) {
+   unsigned long flags;
+
+   raw_spin_lock_irqsave(&e->lock, flags);
+   write_seqcount_begin(&e->seq);
+   e->st.position = 0;
+   e->st.errors = 0;
+   write_seqcount_end(&e->seq);
+   e->win_pos = 0;
+   raw_spin_unlock_irqrestore(&e->lock, flags);
+}
+
+
+/****************************************************************************/
+/* Character device                                                         */
+/****************************************************************************/
+static ssize_t quad_read(struct file *file, char __user *buf,
+                         size_t len, loff_t *pos) {
+   char tmp[MAX_ENCODERS * 80];
+   struct quadenc_state st;
+   int i, n = 0;
+
+   for (i = 0; i < nb_encs; i++) {
+      enc_snapshot(&encs[i], &st);
+      n += snprintf(tmp + n, sizeof(tmp) - n, "%d %lld %lld %llu\n",
+                    i, st.position, st.velocity, st.errors);
+   }
+   return simple_read_from_buffer(buf, len, pos, tmp, n);
+}
+
+static long quad_ioctl(struct file *file, unsigned int cmd, unsigned long arg) {
+   struct quadenc_get g;
+
+   switch (cmd) {
+   case QUADENC_IOC_GET:
+      if (copy_from_user(&g, (void __user *)arg, sizeof(g)))
+         return -EFAULT;
+      if (g.index >= nb_encs)
+         return -ENOENT;
+      enc_snapshot(&encs[g.index], &g.state);
+      if (copy_to_user((void __user *)arg, &g, sizeof(g)))
+         return -EFAULT;
+      return 0;
+   case QUADENC_IOC_RESET:
+      if (arg >= nb_encs)
+         return -ENOENT;
+      enc_reset(&encs[arg]);
+      return 0;
+   }
+   return -ENOTTY;
+}
+
+static struct file_operations quad_fops = {
+   .owner          = THIS_MODULE,
+   .read           = quad_read,
+   .unlocked_ioctl = quad_ioctl,
+};
+
+static struct miscdevice quad_misc_device = {
+   .minor = MISC_DYNAMIC_MINOR,
+   .name  = QUAD_DEV_NAME,
+   .fops  = &quad_fops,
+};
+
+
+/****************************************************************************/
+/* This function configures the interrupts of one encoder.                  */
+/****************************************************************************/
+static int enc_config(struct encoder *e, int gpio_a, int gpio_b) {
+   int ret;
+
+   // the level register only covers bank 0
+   if (gpio_a < 0 || gpio_a > 31 || gpio_b < 0 || gpio_b > 31)
+      return -EINVAL;
+   e->gpio_a = gpio_a;
+   e->gpio_b = gpio_b;
+   raw_spin_lock_init(&e->lock);
+   seqcount_init(&e->seq);
+
+   ret = gpio_request_one(gpio_a, GPIOF_IN, "Encoder A");
+   if (ret)
+      return ret;
+   ret = gpio_request_one(gpio_b, GPIOF_IN, "Encoder B");
+   if (ret)
+      goto fail1;
+
+   e->irq_a = gpio_to_irq(gpio_a);
+   e->irq_b = gpio_to_irq(gpio_b);
+   if (e->irq_a < 0 || e->irq_b < 0) {
+      ret = -ENXIO;
+      goto fail2;
+   }
+   e->ab = enc_sample(e);
+
+   ret = request_irq(e->irq_a, quad_irq_handler,
+                     IRQF_TRIGGER_RISING | IRQF_TRIGGER_FALLING,
+                     QUAD_DEV_NAME, e);
+   if (ret)
+      goto fail2;
+   ret = request_irq(e->irq_b, quad_irq_handler,
+                     IRQF_TRIGGER_RISING | IRQF_TRIGGER_FALLING,
+                     QUAD_DEV_NAME, e);
+   if (ret)
+      goto fail3;
+   return 0;
+
+fail3:
+   free_irq(e->irq_a, e);
+fail2:
+   gpio_free(gpio_b);
+fail1:
+   gpio_free(gpio_a);
+   return ret;
+}
+
+static void enc_release(struct encoder *e) {
+
+   free_irq(e->irq_b, e);
+   free_irq(e->irq_a, e);
+   gpio_free(e->gpio_b);
+   gpio_free(e->gpio_a);
+}
+
+
+/****************************************************************************/
+/* Module init / cleanup block.                                             */
+/****************************************************************************/
+int quad_init(void) {
+   int ret;
+
+   if (nb_pins < 2 || nb_pins % 2 || !vel_ms)
+      return -EINVAL;
+
+   gpio_reg = ioremap(GPIO_BASE, 1024);
+   if (!gpio_reg)
+      return -ENOMEM;
+
+   for (nb_encs = 0; nb_encs < nb_pins / 2; nb_encs++) {
+      ret = enc_config(&encs[nb_encs], pins[2 * nb_encs], pins[2 * nb_encs + 1]);
+      if (ret) {
+         printk(KERN_ERR "Unable to setup encoder %d: %d\n", nb_encs, ret);
+         goto fail;
+      }
+   }
+
+   hrtimer_init(&vel_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+   vel_timer.function = vel_timer_cb;
+   hrtimer_start(&vel_timer, ns_to_ktime((u64)vel_ms * NSEC_PER_MSEC), HRTIMER_MODE_REL);
+
+   ret = misc_register(&quad_misc_device);
+   if (ret) {
+      printk(KERN_ERR "Unable to register %s: %d\n", QUAD_DEV_NAME, ret);
+      hrtimer_cancel(&vel_timer);
+      goto fail;
+   }
+   return 0;
+
+fail:
+   while (nb_encs--)
+      enc_release(&encs[nb_encs]);
+   iounmap(gpio_reg);
+   return ret;
+}
+
+void quad_cleanup(void) {
+   int i;
+
+   misc_deregister(&quad_misc_device);
+   hrtimer_cancel(&vel_timer);
+   for (i = 0; i < nb_encs; i++)
+      enc_release(&encs[i]);
+   iounmap(gpio_reg);
+}
+
+
+module_init(quad_init);
+module_exit(quad_cleanup);
+
+
+/****************************************************************************/
+/* Module licensing/description block.                                      */
+/****************************************************************************/
+MODULE_LICENSE("GPL");
+MODULE_AUTHOR(DRIVER_AUTHOR);
+MODULE_DESCRIPTION(DRIVER_DESC);
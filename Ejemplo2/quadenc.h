@@ -0,0 +1,39 @@
+/****************************************************************************/
+/* User space interface of the quadrature encoder driver (/dev/quadenc)     */
+/*                                                                          */
+/* Every A/B edge is decoded in the interrupt (4 counts per encoder line).  */
+/* Readers get a consistent copy of the 64 bit counters without locking     */
+/* the interrupt out. Shared by the kernel module and user space programs.  */
+/****************************************************************************/
+#ifndef _QUADENC_H
+#define _QUADENC_H
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+struct quadenc_state {
+   __s64 position;       // counts, + when A leads B
+   __s64 velocity;       // counts per second over the last vel_ms
+   __u64 errors;         // illegal transitions, both inputs changed at once
+   __u64 edges;          // interrupts taken
+   __u64 stamp_ns;       // CLOCK_MONOTONIC time of the last count
+};
+
+struct quadenc_get {
+   __u32 index;          // encoder, in the order of the pins parameter
+   __u32 pad;
+   struct quadenc_state state;
+};
+
+#define QUADENC_IOC_MAGIC      'q'
+/* copy the state of encoder index */
+#define QUADENC_IOC_GET        _IOWR(QUADENC_IOC_MAGIC, 1, struct quadenc_get)
+/* zero position and errors of the encoder whose index is passed by value */
+#define QUADENC_IOC_RESET      _IO(QUADENC_IOC_MAGIC, 2)
+
+/*
+ * read() gives one text line per encoder:
+ * "index position velocity errors"
+ */
+
+#endif /* _QUADENC_H */
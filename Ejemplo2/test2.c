@@ -4,6 +4,17 @@
  
 #include <linux/interrupt.h>
 #include <linux/gpio.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
+#include <linux/kthread.h>
+#include <linux/proc_fs.h>
+#include <linux/seq_file.h>
+#include <linux/slab.h>
+
+#include "evlog.h"
+
+#define CREATE_TRACE_POINTS
+#include "test2_trace.h"
  
  
 #define DRIVER_AUTHOR "Igor <hardware.coder@gmail.com>"
@@ -38,15 +49,156 @@ static struct gpio leds[]={
 short int ret; 
 short int power=0;
 
+
+/****************************************************************************/
+/* Event log block                                                          */
+/*                                                                          */
+/* The handlers never printk, they append to a per-cpu ring instead, dumped */
+/* with: cat /sys/kernel/debug/test2/events                                 */
+/****************************************************************************/
+enum {
+   EV_IRQ,          // irq, power
+   EV_BOUNCE,       // irq, edges swallowed so far
+   EV_DEBOUNCED,    // power, edges swallowed so far
+};
+
+static const char * const ev_names[] = {
+   "irq",
+   "bounce",
+   "debounced",
+};
+
+static struct evlog ev;
+
+
+/****************************************************************************/
+/* Debounce block                                                           */
+/*                                                                          */
+/* The first falling edge arms db_timer, the edges of the same bounce       */
+/* burst are swallowed and the level is sampled when the timer fires: the   */
+/* LED toggles once per press. 0 disables it (always off while bench=1).    */
+/****************************************************************************/
+static uint debounce_us = 5000;
+module_param(debounce_us, uint, 0444);
+MODULE_PARM_DESC(debounce_us, "settle time of the button input, 0 disables");
+
+static struct hrtimer db_timer;
+static int db_armed = 0;
+static u32 db_swallowed = 0;
+
+
+/****************************************************************************/
+/* Latency benchmark block                                                  */
+/*                                                                          */
+/* With bench=1 an hrtimer drives bench_gpio, wired to GPIO_ANY_GPIO, low   */
+/* every bench_period_us. The time of the stimulus, of the handler entry    */
+/* and of the LED write are compared and kept in a histogram, read from     */
+/* /proc/test2_latency. bench_load busy threads add background load.        */
+/****************************************************************************/
+#define BENCH_BINS      1000     // 1 us per bin, last one is "1000 us or more"
+
+static int bench = 0;
+module_param(bench, int, 0444);
+MODULE_PARM_DESC(bench, "1 runs the IRQ to output latency benchmark");
+
+static int bench_gpio = 17;
+module_param(bench_gpio, int, 0444);
+MODULE_PARM_DESC(bench_gpio, "output wired to the input pin (default 17)");
+
+static uint bench_period_us = 1000;
+module_param(bench_period_us, uint, 0444);
+MODULE_PARM_DESC(bench_period_us, "time between two stimuli");
+
+static uint bench_load = 0;
+module_param(bench_load, uint, 0444);
+MODULE_PARM_DESC(bench_load, "busy threads spread over the cpus during the run");
+
+struct lat_hist {
+   u32 bins[BENCH_BINS];
+   u32 count;
+   u32 min;
+   u32 max;
+   u64 sum;
+};
+
+static struct hrtimer bench_timer;
+static ktime_t bench_stim;          // time of the last falling edge we drove
+static int bench_level = 1;
+static u32 bench_sent = 0;
+static struct lat_hist lat_entry;   // stimulus -> handler entry
+static struct lat_hist lat_output;  // stimulus -> LED written
+static struct task_struct **bench_threads;
+
+static void lat_add(struct lat_hist *h, ktime_t d) {
+   s64 us = ktime_to_us(d);
+
+   if (us < 0)
+      return;
+   h->bins[us < BENCH_BINS ? us : BENCH_BINS - 1]++;
+   if (!h->count || us < h->min)
+      h->min = us;
+   if (us > h->max)
+      h->max = us;
+   h->sum += us;
+   h->count++;
+}
+
+/****************************************************************************/
+/* The reaction: toggle the LED                                             */
+/****************************************************************************/
+static void r_led_toggle(void) {
+
+   trace_test2_led(leds[0].gpio, power);
+   if(power){
+   	gpio_set_value(leds[0].gpio, 1); 
+	power=0;
+   } else {
+   	gpio_set_value(leds[0].gpio, 0); 
+	power=1;
+   }
+}
+
+/****************************************************************************/
+/* Debounce timer - the input settled                                       */
+/****************************************************************************/
+static enum hrtimer_restart db_timer_cb(struct hrtimer *t) {
+
+   db_armed = 0;
+   // still pressed, this was a real falling edge
+   if (!gpio_get_value(GPIO_ANY_GPIO)) {
+      evlog_write(&ev, EV_DEBOUNCED, power, db_swallowed);
+      r_led_toggle();
+   }
+   return HRTIMER_NORESTART;
+}
+
 /****************************************************************************/
 /* IRQ handler - fired on interrupt                                         */
 /****************************************************************************/
 static irqreturn_t r_irq_handler(int irq, void *dev_id, struct pt_regs *regs) {
  
    unsigned long flags;
+   ktime_t entry = ktime_get();
    
+   trace_test2_irq_entry(irq, power);
+
    // disable hard interrupts (remember them in flag 'flags')
    local_irq_save(flags);
+
+   // only the first edge of a bounce burst arms the settle timer
+   if (debounce_us && !bench) {
+      if (!db_armed) {
+         db_armed = 1;
+         hrtimer_start(&db_timer, ns_to_ktime((u64)debounce_us * 1000),
+                       HRTIMER_MODE_REL);
+      } else {
+         db_swallowed++;
+         evlog_write(&ev, EV_BOUNCE, irq, db_swallowed);
+      }
+      local_irq_restore(flags);
+      trace_test2_irq_exit(irq, power);
+      return IRQ_HANDLED;
+   }
  
    // NOTE:
    // Anonymous Sep 17, 2013, 3:16:00 PM:
@@ -55,26 +207,129 @@ static irqreturn_t r_irq_handler(int irq, void *dev_id, struct pt_regs *regs) {
    // 
    // hardware.coder:
    // http://stackoverflow.com/questions/8738951/printk-inside-an-interrupt-handler-is-it-really-that-bad
-   
-   printk(KERN_NOTICE "Interrupt power (%d) [%d] for device %s was triggered !.\n",power,
-          irq, (char *) dev_id);
+   //
+   // The event goes to the per-cpu log, a few stores and no console.
+   evlog_write(&ev, EV_IRQ, irq, power);
  
    //GPIO
-   if(power){
-   	gpio_set_value(leds[0].gpio, 1); 
-	power=0;
-   } else {
-   	gpio_set_value(leds[0].gpio, 0); 
-	power=1;
+   r_led_toggle();
+
+   if (bench) {
+      ktime_t stim = bench_stim;
+      lat_add(&lat_entry, ktime_sub(entry, stim));
+      lat_add(&lat_output, ktime_sub(ktime_get(), stim));
    }
 	
    // restore hard interrupts
    local_irq_restore(flags);
  
+   trace_test2_irq_exit(irq, power);
    return IRQ_HANDLED;
 }
  
  
+/****************************************************************************/
+/* Benchmark stimulus, load and report                                      */
+/****************************************************************************/
+static enum hrtimer_restart bench_timer_cb(struct hrtimer *t) {
+
+   // half a period low (the falling edge is the stimulus), half high
+   bench_level = !bench_level;
+   if (!bench_level) {
+      bench_stim = ktime_get();
+      bench_sent++;
+   }
+   gpio_set_value(bench_gpio, bench_level);
+
+   hrtimer_forward_now(t, ns_to_ktime((u64)bench_period_us * 500));
+   return HRTIMER_RESTART;
+}
+
+static int bench_load_fn(void *data) {
+
+   while (!kthread_should_stop()) {
+      ktime_t until = ktime_add_us(ktime_get(), 1000);
+      while (ktime_before(ktime_get(), until))
+         cpu_relax();
+      cond_resched();
+   }
+   return 0;
+}
+
+static void lat_show(struct seq_file *m, const char *name, struct lat_hist *h) {
+   int i;
+
+   seq_printf(m, "%s: count %u min %u max %u avg %llu us\n", name, h->count,
+              h->min, h->max, h->count ? div_u64(h->sum, h->count) : 0);
+   for (i = 0; i < BENCH_BINS; i++)
+      if (h->bins[i])
+         seq_printf(m, "%s%4d %u\n", i == BENCH_BINS - 1 ? ">=" : "  ", i, h->bins[i]);
+}
+
+static int lat_proc_show(struct seq_file *m, void *v) {
+
+   seq_printf(m, "stimuli %u load %u period_us %u\n", bench_sent, bench_load,
+              bench_period_us);
+   lat_show(m, "entry", &lat_entry);
+   lat_show(m, "output", &lat_output);
+   return 0;
+}
+
+static int lat_proc_open(struct inode *inode, struct file *file) {
+   return single_open(file, lat_proc_show, NULL);
+}
+
+static const struct file_operations lat_proc_fops = {
+   .owner   = THIS_MODULE,
+   .open    = lat_proc_open,
+   .read    = seq_read,
+   .llseek  = seq_lseek,
+   .release = single_release,
+};
+
+void bench_start(void) {
+   int i;
+
+   if (gpio_request_one(bench_gpio, GPIOF_OUT_INIT_HIGH, "Latency stimulus")) {
+      printk(KERN_ERR "Unable request bench GPIO %d\n", bench_gpio);
+      bench = 0;
+      return;
+   }
+   proc_create("test2_latency", 0444, NULL, &lat_proc_fops);
+
+   if (bench_load) {
+      bench_threads = kcalloc(bench_load, sizeof(*bench_threads), GFP_KERNEL);
+      for (i = 0; bench_threads && i < bench_load; i++) {
+         bench_threads[i] = kthread_create(bench_load_fn, NULL, "test2_load/%d", i);
+         if (IS_ERR(bench_threads[i])) {
+            bench_threads[i] = NULL;
+            break;
+         }
+         kthread_bind(bench_threads[i], i % num_online_cpus());
+         wake_up_process(bench_threads[i]);
+      }
+   }
+
+   hrtimer_init(&bench_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+   bench_timer.function = bench_timer_cb;
+   hrtimer_start(&bench_timer, ns_to_ktime((u64)bench_period_us * 500),
+                 HRTIMER_MODE_REL);
+}
+
+void bench_stop(void) {
+   int i;
+
+   hrtimer_cancel(&bench_timer);
+   if (bench_threads) {
+      for (i = 0; i < bench_load && bench_threads[i]; i++)
+         kthread_stop(bench_threads[i]);
+      kfree(bench_threads);
+   }
+   remove_proc_entry("test2_latency", NULL);
+   gpio_free(bench_gpio);
+}
+
+
 /****************************************************************************/
 /* This function configures interrupts.                                     */
 /****************************************************************************/
@@ -91,6 +346,9 @@ void r_int_config(void) {
    }
  
    printk(KERN_NOTICE "Mapped int %d\n", irq_any_gpio);
+
+   hrtimer_init(&db_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+   db_timer.function = db_timer_cb;
  
    if (request_irq(irq_any_gpio,
                    (irq_handler_t ) r_irq_handler,
@@ -106,6 +364,9 @@ void r_int_config(void) {
    if(ret){
 	printk(KERN_ERR "Unable request GIPO %d\n",ret);
    }
+
+   if (bench)
+      bench_start();
    return;
 }
  
@@ -115,7 +376,12 @@ void r_int_config(void) {
 /****************************************************************************/
 void r_int_release(void) {
  
+   if (bench)
+      bench_stop();
    free_irq(irq_any_gpio, GPIO_ANY_GPIO_DEVICE_DESC);
+   hrtimer_cancel(&db_timer);
+   if (debounce_us)
+      printk(KERN_NOTICE "Debounce swallowed %u edges\n", db_swallowed);
    gpio_free(GPIO_ANY_GPIO);
  
    return;
@@ -128,6 +394,8 @@ void r_int_release(void) {
 int r_init(void) {
  
    printk(KERN_NOTICE "Hello !\n");
+   if (evlog_init(&ev, "test2", ev_names, ARRAY_SIZE(ev_names)))
+      printk(KERN_ERR "No memory for the event log\n");
    r_int_config();
  
    return 0;
@@ -136,6 +404,7 @@ int r_init(void) {
 void r_cleanup(void) {
    printk(KERN_NOTICE "Goodbye\n");
    r_int_release();
+   evlog_exit(&ev);
  
    return;
 }
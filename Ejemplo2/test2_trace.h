@@ -0,0 +1,61 @@
+/****************************************************************************/
+/* Tracepoints of test2                                                     */
+/*                                                                          */
+/* echo 1 > /sys/kernel/debug/tracing/events/test2/enable                   */
+/* Free while disabled, the arguments are only read when an event is on.    */
+/****************************************************************************/
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM test2
+
+#if !defined(_TEST2_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _TEST2_TRACE_H
+
+#include <linux/tracepoint.h>
+
+DECLARE_EVENT_CLASS(test2_irq,
+   TP_PROTO(int irq, int power),
+   TP_ARGS(irq, power),
+   TP_STRUCT__entry(
+      __field(int, irq)
+      __field(int, power)
+   ),
+   TP_fast_assign(
+      __entry->irq = irq;
+      __entry->power = power;
+   ),
+   TP_printk("irq=%d power=%d", __entry->irq, __entry->power)
+);
+
+DEFINE_EVENT(test2_irq, test2_irq_entry,
+   TP_PROTO(int irq, int power),
+   TP_ARGS(irq, power)
+);
+
+DEFINE_EVENT(test2_irq, test2_irq_exit,
+   TP_PROTO(int irq, int power),
+   TP_ARGS(irq, power)
+);
+
+// every write of the LED, from the handler or the debounce timer
+TRACE_EVENT(test2_led,
+   TP_PROTO(int gpio, int value),
+   TP_ARGS(gpio, value),
+   TP_STRUCT__entry(
+      __field(int, gpio)
+      __field(int, value)
+   ),
+   TP_fast_assign(
+      __entry->gpio = gpio;
+      __entry->value = value;
+   ),
+   TP_printk("gpio=%d value=%d", __entry->gpio, __entry->value)
+);
+
+#endif /* _TEST2_TRACE_H */
+
+// found through CFLAGS_test2.o := -I$(src)
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE test2_trace
+#include <trace/define_trace.h>
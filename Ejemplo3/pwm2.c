@@ -4,6 +4,15 @@
  * Raspberry Pi expansion header.  Allows for driving a servo, or variable
  * frequency waveforms.
  *
+ * Los dos canales del bloque PWM son independientes: pwm0 en GPIO12 y
+ * pwm1 en GPIO13 por defecto (parametro gpios), con el reloj PWM comun.
+ * /sys/class/rpi-pwm/sync arranca o actualiza los dos canales a la vez,
+ * en fase.
+ *
+ * Con un canal en marcha RNG/DAT no se escriben a mitad de periodo, se
+ * esperan al principio del siguiente (ver rpi_pwm_latch_window).
+ * /sys/class/rpi-pwm/pwmN/deferred cuenta las escrituras que esperaron.
+ *
  * It tends to have problems locking on to frequencies above 100 kHz, and
  * with indivisible duty cycles.
  *
@@ -14,6 +23,8 @@
 
 // Nombre con el que se encuentra en sysfs (/sys/class/rpi-pwm)
 #define PWM_CLASS_NAME "rpi-pwm"
+// Nodo de control binario (/dev/rpi-pwm)
+#define PWM_DEV_NAME "rpi-pwm"
 
 #include <linux/module.h>
 #include <linux/kernel.h>
@@ -29,28 +40,62 @@
 #include <linux/platform_device.h>
 #include <linux/init.h>
 #include <linux/mutex.h>
+#include <linux/spinlock.h>
+#include <linux/seqlock.h>
+#include <linux/miscdevice.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/mm.h>
 #include <asm/uaccess.h>
 #include <linux/sysfs.h>
 
+#include "rpi_pwm.h"
+
+#define CREATE_TRACE_POINTS
+#include "pwm2_trace.h"
+
 #define BCM2708_PERI_BASE	0x20000000
 #define GPIO_BASE		(BCM2708_PERI_BASE + 0x200000)
 #define PWM_BASE		(BCM2708_PERI_BASE + 0x20C000)
 #define CLOCK_BASE		(BCM2708_PERI_BASE + 0x101000)
 
 #define GPIO_REG(g) (gpio_reg+((g/10)*4))
-#define SET_GPIO_ALT(g,a) \
-	__raw_writel( 							\
-		(((a)<=3?(a)+4:(a)==4?3:2)<<(((g)%10)*3))		\
-		| (__raw_readl(GPIO_REG(g)) & (~(7<<(((g)%10)*3)))),	\
-		GPIO_REG(g))
+/* Sin acceso al registro si el pin ya tiene esa funcion (fsel_shadow) */
+#define SET_GPIO_ALT(g,a) do {						\
+	unsigned long __flags;						\
+	spin_lock_irqsave(&fsel_lock, __flags);				\
+	if (fsel_shadow[g] != (a)) {					\
+		u32 __fsel = (((a)<=3?(a)+4:(a)==4?3:2)<<(((g)%10)*3))	\
+			| (__raw_readl(GPIO_REG(g)) & (~(7<<(((g)%10)*3))));\
+		trace_rpi_pwm_gpio_alt(g, a, __fsel);			\
+		__raw_writel(__fsel, GPIO_REG(g));			\
+		fsel_shadow[g] = (a);					\
+	}								\
+	spin_unlock_irqrestore(&fsel_lock, __flags);			\
+} while (0)
 
 #define	PWM_CTL  (pwm_reg+(0*4))
 #define	PWM_RNG1 (pwm_reg+(4*4))
 #define	PWM_DAT1 (pwm_reg+(5*4))
+#define	PWM_RNG2 (pwm_reg+(8*4))
+#define	PWM_DAT2 (pwm_reg+(9*4))
+
+/* PWENx (bit 0 / 8) y MSENx (bit 7 / 15) del canal id en PWM_CTL */
+#define PWM_CTL_CHAN(id)	(0x81 << (8*(id)))
 
 #define	PWMCLK_CNTL (clk_reg+(40*4))
 #define	PWMCLK_DIV  (clk_reg+(41*4))
 
+/* Escritura de registro a traves de su copia shadow_<registro>: solo
+ * llega al bus (y al tracepoint rpi_pwm_reg_write) si el valor cambia.
+ * Devuelve 1 si se escribio */
+#define REG_WRITE(v,r) reg_commit(&shadow_##r, (v), r, #r)
+
+/* Registro del canal del dispositivo: CHAN_WRITE(dev, v, PWM_RNG) escribe
+ * PWM_RNG1 o PWM_RNG2 */
+#define CHAN_WRITE(d,v,r) ((d)->id ? REG_WRITE(v, r##2) : REG_WRITE(v, r##1))
+
 #define strict_strtol   kstrtol
 
 /***************************************************************************/
@@ -81,76 +126,138 @@ short int power=0;
 
 void rpi_pwm_cleanup(void);
 int rpi_pwm_init(void);
+static void rpi_pwm_gate(int on);
 
 
-/* Manejador de interrupcion / se lanza cuando ocurre la interrupcion */
+/* Manejador de interrupcion / se lanza cuando ocurre la interrupcion.
+ * El driver ya esta cargado: el boton solo abre o cierra la salida de
+ * los canales activos con una escritura de PWM_CTL */
 static irqreturn_t r_irq_handler(int irq, void *dev_id, struct pt_regs *regs){
 
-	unsigned long flags;
+	trace_rpi_pwm_irq_entry(irq, power);
 
-	//deshabilitamos las interrupciones
-	local_irq_save(flags);
-	
-	if(power){
-		gpio_set_value(leds[0].gpio,1);
-		rpi_pwm_cleanup();
-		power=0;
-	}else{
-		gpio_set_value(leds[0].gpio,0);
-		rpi_pwm_init();
-		power=1;
-	}
-	
-	//Restauramos las interrupciones
-	local_irq_restore(flags);
+	gpio_set_value(leds[0].gpio, power);
+	rpi_pwm_gate(!power);
 
+	trace_rpi_pwm_irq_exit(irq, power);
 	return IRQ_HANDLED;
 }
 
 //Funcion para configurar interrupciones
-void r_int_config(void){
-	if(gpio_request(GPIO_ANY_GPIO, GPIO_ANY_GPIO_DESC)){	
+int r_int_config(void){
+	int ret;
+
+	//El led lo usa el manejador, se pide antes que la interrupcion
+	reterror=gpio_request_array(leds,ARRAY_SIZE(leds));
+	if(reterror){
+		printk(KERN_ERR "Request GPIO ocupado%d\n",reterror);
+		return reterror;
+	}
+
+	ret=gpio_request(GPIO_ANY_GPIO, GPIO_ANY_GPIO_DESC);
+	if(ret){
 		printk("Error en request: %s\n",GPIO_ANY_GPIO_DESC);
-		return;
+		goto fail1;
 	}
 
 	if((irq_any_gpio=gpio_to_irq(GPIO_ANY_GPIO))<0){
 		printk("error al mapear la interrupcion %s\n",GPIO_ANY_GPIO_DESC);
-		return;
+		ret=irq_any_gpio;
+		goto fail2;
 	}
 
 	printk(KERN_NOTICE "Interrupcion mapeada en %d\n", irq_any_gpio);
 
-	if(request_irq(irq_any_gpio,(irq_handler_t)r_irq_handler,IRQF_TRIGGER_FALLING,GPIO_ANY_GPIO_DESC,GPIO_ANY_GPIO_DEVICE_DESC)){
+	ret=request_irq(irq_any_gpio,(irq_handler_t)r_irq_handler,IRQF_TRIGGER_FALLING,GPIO_ANY_GPIO_DESC,GPIO_ANY_GPIO_DEVICE_DESC);
+	if(ret){
 		printk("Error en el request irq\n");
-		return;
+		goto fail2;
 	}
+	return 0;
 
-	reterror=gpio_request_array(leds,ARRAY_SIZE(leds));
-
-	if(reterror){
-		printk(KERN_ERR "Request GPIO ocupado%d\n",reterror);
-	}
-	return;
+fail2:
+	gpio_free(GPIO_ANY_GPIO);
+fail1:
+	gpio_free_array(leds,ARRAY_SIZE(leds));
+	return ret;
 }
 
 //funcion que lanza las interrupciones
 void r_int_release(void){
 	free_irq(irq_any_gpio,GPIO_ANY_GPIO_DEVICE_DESC);
 	gpio_free(GPIO_ANY_GPIO);
+	gpio_free_array(leds,ARRAY_SIZE(leds));
 	return;
 }
 
+//Carga: el driver PWM una sola vez, luego el boton
+int r_init(void){
+	int ret;
+
+	ret=rpi_pwm_init();
+	if(ret)
+		return ret;
+
+	ret=r_int_config();
+	if(ret)
+		rpi_pwm_cleanup();
+	return ret;
+}
+
 void r_cleanup(void){
 	r_int_release();
+	rpi_pwm_cleanup();
 	return;
 }
 
-static DEFINE_MUTEX(sysfs_lock);
 static void __iomem *pwm_reg;
 static void __iomem *gpio_reg;
 static void __iomem *clk_reg;
 
+/* Cache de registros: ultimo valor escrito en cada registro PWM y de
+ * reloj. El driver se asume dueno de estos bloques, la cache se invalida
+ * al activar un PWM por si otro codigo los modifico mientras estaba
+ * apagado */
+struct reg_shadow {
+	u32 val;
+	int valid;
+};
+
+static struct reg_shadow shadow_PWM_CTL;
+static struct reg_shadow shadow_PWM_RNG1;
+static struct reg_shadow shadow_PWM_DAT1;
+static struct reg_shadow shadow_PWM_RNG2;
+static struct reg_shadow shadow_PWM_DAT2;
+static struct reg_shadow shadow_PWMCLK_CNTL;
+static struct reg_shadow shadow_PWMCLK_DIV;
+
+/* Funcion de cada GPIO segun la ultima seleccion, -1 si no se conoce.
+ * Solo se guarda la funcion del pin: los demas pines del mismo GPFSEL
+ * pueden ser de otros drivers, un cambio sigue leyendo el registro */
+static s8 fsel_shadow[54] = { [0 ... 53] = -1 };
+/* GPIO12 y 13 comparten GPFSEL1, los dos canales no pueden hacer la
+ * lectura-escritura a la vez */
+static DEFINE_SPINLOCK(fsel_lock);
+
+static int reg_commit(struct reg_shadow *sh, u32 val, void __iomem *reg,
+		const char *name) {
+	if (sh->valid && sh->val == val)
+		return 0;
+	trace_rpi_pwm_reg_write(name, val);
+	__raw_writel(val, reg);
+	sh->val = val;
+	sh->valid = 1;
+	return 1;
+}
+
+/* El reloj corre con el divisor dado (PWM_CTL conocido) */
+static int rpi_pwm_clock_running(u32 divisor) {
+	return shadow_PWM_CTL.valid &&
+		shadow_PWMCLK_CNTL.valid && shadow_PWMCLK_CNTL.val == 0x5A000011 &&
+		shadow_PWMCLK_DIV.valid &&
+		shadow_PWMCLK_DIV.val == (0x5A000000 | (divisor<<12));
+}
+
 enum device_mode {
 	MODE_PWM,
 	MODE_SERVO,
@@ -172,13 +279,38 @@ struct rpi_pwm {
 	int active:1;
 	int immediate:1;
 	int loaded:1;
-	int id;
+	int id;			/* canal: 0 = PWM0, 1 = PWM1 */
+	int gpio;		/* pin del canal y su funcion alternativa */
+	int alt;
 	enum device_mode mode;	/* Servo, PWM, or Audio */
 	struct device *dev;
 
 	u32 divisor;
 	u32 mcf; /* Maximum common frequency (desired) */
 	u32 real_mcf;
+
+	/* lock serializa a los escritores del canal, seq deja a los
+	 * lectores de sysfs copiar la configuracion sin bloquearse */
+	struct mutex lock;
+	seqcount_t seq;
+
+	/* Cambios de sysfs en modo delayed, pendientes de commit */
+	struct rpi_pwm_params staged;
+
+	/* RNG/DAT del canal, tambien desde el timer de la pagina de control */
+	spinlock_t reg_lock;
+	u32 shm_seq;		/* ultimo seq de la pagina aplicado */
+
+	/* Escritura en el limite del periodo, con reg_lock */
+	int running;		/* PWEN y MSEN del canal en PWM_CTL */
+	u64 epoch;		/* inicio de un periodo, en doceavos de ns */
+	struct hrtimer latch_timer;
+	int latch_pending;	/* latch_rng/dat esperan al timer */
+	int latch_tries;
+	u32 latch_rng;
+	u32 latch_dat;
+	u32 deferred;		/* escrituras que esperaron al limite */
+	u32 latch_missed;	/* ... que no lo alcanzaron y se escribieron igual */
 };
 
 
@@ -197,12 +329,167 @@ static struct rpi_pwm pwms[] = {
 	},
 };
 
+/* Reloj PWM comun a los dos canales: clk_lock lo protege y clk_users
+ * tiene un bit por canal que lo esta usando */
+static DEFINE_MUTEX(clk_lock);
+static unsigned long clk_users;
+
+/* Cambio de la configuracion visible para los lectores, con dev->lock */
+static inline void rpi_pwm_cfg_begin(struct rpi_pwm *dev) {
+	preempt_disable();
+	write_seqcount_begin(&dev->seq);
+}
+
+static inline void rpi_pwm_cfg_end(struct rpi_pwm *dev) {
+	write_seqcount_end(&dev->seq);
+	preempt_enable();
+}
+
+/* Lectura sin lock: stmt se repite si un escritor cambio el canal */
+#define PWM_READ(dev, stmt) do {					\
+	unsigned int __seq;						\
+	do {								\
+		__seq = read_seqcount_begin(&(dev)->seq);		\
+		stmt;							\
+	} while (read_seqcount_retry(&(dev)->seq, __seq));		\
+} while (0)
+
+static void rpi_pwm_set_active(struct rpi_pwm *dev, int on) {
+	rpi_pwm_cfg_begin(dev);
+	dev->active = on;
+	rpi_pwm_cfg_end(dev);
+}
+
+static void rpi_pwm_set_divisor(struct rpi_pwm *dev, u32 divisor) {
+	rpi_pwm_cfg_begin(dev);
+	dev->divisor = divisor;
+	dev->real_mcf = 19200000 / divisor;
+	rpi_pwm_cfg_end(dev);
+}
+
+/* Valores calculados para los registros de un canal */
+struct rpi_pwm_regs {
+	u32 mcf;
+	u32 rng;
+	u32 dat;
+};
+
+/* GPIO de cada canal. GPIO18 es el boton de la interrupcion, por eso
+ * por defecto se usan 12 y 13 */
+static int gpios[2] = { 12, 13 };
+static int nb_gpios = 2;
+module_param_array(gpios, int, &nb_gpios, 0444);
+MODULE_PARM_DESC(gpios, "GPIO de pwm0 (12, 18, 40) y pwm1 (13, 19, 41, 45)");
+
+/* Funcion alternativa que lleva el canal id al gpio, -1 si no puede */
+static int rpi_pwm_pin_alt(int id, int gpio) {
+	switch (gpio) {
+	case 12: case 40:
+		return id == 0 ? 0 : -1;
+	case 13: case 41: case 45:
+		return id == 1 ? 0 : -1;
+	case 18:
+		return id == 0 ? 5 : -1;
+	case 19:
+		return id == 1 ? 5 : -1;
+	}
+	return -1;
+}
+
+/* Puerta del boton: con power a 0 PWM_CTL queda a 0, ctl_want guarda lo
+ * que pide sysfs para abrirla. ctl_lock ordena las escrituras de PWM_CTL
+ * de sysfs y de la interrupcion */
+static DEFINE_SPINLOCK(ctl_lock);
+static u32 ctl_want;
+
+/* Escritura de PWM_CTL, con ctl_lock. Un canal que arranca empieza su
+ * periodo ahora: es la referencia de rpi_pwm_latch_window */
+static int rpi_pwm_ctl_commit(u32 ctl) {
+	u32 old = shadow_PWM_CTL.valid ? shadow_PWM_CTL.val : 0;
+	u64 now;
+	int pwm;
+
+	if (!REG_WRITE(ctl, PWM_CTL))
+		return 0;
+	now = ktime_to_ns(ktime_get()) * 12;
+	for (pwm=0; pwm<ARRAY_SIZE(pwms); pwm++) {
+		struct rpi_pwm *dev = &pwms[pwm];
+		u32 bits = PWM_CTL_CHAN(pwm);
+
+		spin_lock(&dev->reg_lock);
+		dev->running = (ctl & bits) == bits;
+		if (dev->running && (old & bits) != bits)
+			dev->epoch = now;
+		spin_unlock(&dev->reg_lock);
+	}
+	return 1;
+}
+
+/* Con clk_lock. PWM_CTL y RNGn/DATn tambien los escriben la interrupcion
+ * y los timers: ctl_lock y el reg_lock de cada canal */
+static void reg_shadow_invalidate(void) {
+	unsigned long flags;
+	int pwm;
+
+	spin_lock_irqsave(&ctl_lock, flags);
+	for (pwm=0; pwm<ARRAY_SIZE(pwms); pwm++)
+		spin_lock_nested(&pwms[pwm].reg_lock, pwm);
+	shadow_PWM_CTL.valid = 0;
+	shadow_PWM_RNG1.valid = 0;
+	shadow_PWM_DAT1.valid = 0;
+	shadow_PWM_RNG2.valid = 0;
+	shadow_PWM_DAT2.valid = 0;
+	shadow_PWMCLK_CNTL.valid = 0;
+	shadow_PWMCLK_DIV.valid = 0;
+	for (pwm=ARRAY_SIZE(pwms)-1; pwm>=0; pwm--)
+		spin_unlock(&pwms[pwm].reg_lock);
+	spin_unlock_irqrestore(&ctl_lock, flags);
+}
+
+/* Devuelve 1 si llego al registro */
+static int rpi_pwm_ctl_write(u32 ctl) {
+	unsigned long flags;
+	int ret;
+
+	spin_lock_irqsave(&ctl_lock, flags);
+	ctl_want = ctl;
+	ret = rpi_pwm_ctl_commit(power ? ctl : 0);
+	spin_unlock_irqrestore(&ctl_lock, flags);
+	return ret;
+}
+
+/* Solo los bits del canal id, los del otro canal no cambian */
+static int rpi_pwm_ctl_chan(int id, int on) {
+	unsigned long flags;
+	int ret;
+
+	spin_lock_irqsave(&ctl_lock, flags);
+	ctl_want &= ~PWM_CTL_CHAN(id);
+	if (on)
+		ctl_want |= PWM_CTL_CHAN(id);
+	ret = rpi_pwm_ctl_commit(power ? ctl_want : 0);
+	spin_unlock_irqrestore(&ctl_lock, flags);
+	return ret;
+}
+
+/* Desde la interrupcion */
+static void rpi_pwm_gate(int on) {
+	unsigned long flags;
+
+	spin_lock_irqsave(&ctl_lock, flags);
+	power = on;
+	rpi_pwm_ctl_commit(on ? ctl_want : 0);
+	spin_unlock_irqrestore(&ctl_lock, flags);
+}
+
 
 /* Sets the system timer to have the new divisor */
 static int rpi_pwm_set_clk(struct rpi_pwm *dev, u32 mcf) {
+	u32 divisor;
+
 	/* Stop clock and waiting for busy flag doesn't work, so kill clock */
-	__raw_writel(0x5A000000 | (1 << 5), PWMCLK_CNTL);
-	udelay(10);  
+	if (REG_WRITE(0x5A000000 | (1 << 5), PWMCLK_CNTL))
+		udelay(10);
 	if (!dev->mcf) {
 		dev_err(dev->dev, "no MCF specified\n");
 		return -EINVAL;
@@ -214,38 +501,188 @@ static int rpi_pwm_set_clk(struct rpi_pwm *dev, u32 mcf) {
 	 * output frequency, bad for servo motors
 	 * 320 bits for one cycle of 20 milliseconds = 62.5 us per bit = 16 kHz
 	 */
-	dev->divisor = 19200000 / mcf;
-	if (dev->divisor < 1 || dev->divisor > 0x1000) {
-		dev_err(dev->dev, "divisor out of range: %x\n", dev->divisor);
+	divisor = 19200000 / mcf;
+	if (divisor < 1 || divisor > 0x1000) {
+		dev_err(dev->dev, "divisor out of range: %x\n", divisor);
 		return -ERANGE;
 	}
-	__raw_writel(0x5A000000 | (dev->divisor<<12), PWMCLK_DIV);
+	REG_WRITE(0x5A000000 | (divisor<<12), PWMCLK_DIV);
 	
 	/* Enable the PWM clock */
-	__raw_writel(0x5A000011, PWMCLK_CNTL);
+	REG_WRITE(0x5A000011, PWMCLK_CNTL);
 
 	/* Calculate the real maximum common frequency */
-	dev->real_mcf = 19200000 / dev->divisor;
+	rpi_pwm_set_divisor(dev, divisor);
 
 	return 0;
 }
 
 
-static int rpi_pwm_set_servo(struct rpi_pwm *dev) {
-	unsigned long RNG, DAT;
-	unsigned long mcf = 16000, frequency=50;
-	int ret;
+/* Escritura de RNG/DAT en el limite del periodo.
+ *
+ * El bloque PWM no tiene interrupcion de fin de periodo y RNG/DAT cambian
+ * en cuanto se escriben: a mitad de periodo la salida da un pulso corto o
+ * uno estirado (el servo tiembla, el audio hace clic). Con el canal en
+ * marcha solo se escriben al principio de un periodo, antes de que el
+ * contador llegue al DAT viejo o al nuevo; fuera de esa ventana
+ * latch_timer los escribe en el siguiente periodo.
+ *
+ * El periodo se cuenta desde epoch, el arranque del canal en PWM_CTL,
+ * con el reloj del sistema, que sale del mismo cristal de 19.2 MHz. Un
+ * ciclo del reloj PWM (19.2 MHz / divisor) son 625 * divisor doceavos de
+ * ns, en esa unidad epoch avanza periodos enteros sin redondeo */
+static uint latch_guard_us = 4;
+module_param(latch_guard_us, uint, 0444);
+MODULE_PARM_DESC(latch_guard_us, "margen alrededor del limite del periodo (us)");
+
+/* Periodos que latch_timer espera a la ventana antes de escribir igual */
+#define LATCH_TRIES 8
+
+/* Con reg_lock. 1 si RNG/DAT se pueden escribir ya, si no *next es cuando
+ * empieza la siguiente ventana */
+static int rpi_pwm_latch_window(struct rpi_pwm *dev, u32 RNG, u32 DAT,
+		ktime_t *next) {
+	struct reg_shadow *rng = dev->id ? &shadow_PWM_RNG2 : &shadow_PWM_RNG1;
+	struct reg_shadow *dat = dev->id ? &shadow_PWM_DAT2 : &shadow_PWM_DAT1;
+	u64 cycle = 625 * (u64)dev->divisor;
+	u64 guard = (u64)latch_guard_us * NSEC_PER_USEC * 12;
+	u64 period, limit, now, elapsed, t;
+
+	if (!dev->running || !rng->valid || !dat->valid)
+		return 1;
+	if (rng->val == RNG && dat->val == DAT)
+		return 1;
+
+	period = rng->val * cycle;
+	limit = min(DAT, dat->val) * cycle;
+	/* Pulso demasiado corto para acertar la ventana, se escribe ya */
+	if (limit <= 2 * guard)
+		return 1;
+
+	now = ktime_to_ns(ktime_get()) * 12;
+	if (now > dev->epoch)
+		dev->epoch += div64_u64(now - dev->epoch, period) * period;
+	elapsed = now > dev->epoch ? now - dev->epoch : 0;
+	if (elapsed >= guard && elapsed + guard < limit)
+		return 1;
+
+	t = dev->epoch + guard;
+	if (elapsed >= guard)
+		t += period;
+	*next = ns_to_ktime(div_u64(t + 11, 12));
+	return 0;
+}
 
-	/* Disable PWM */
-	__raw_writel(0, PWM_CTL);
+/* Range and data of the channel, the data first when the range shrinks
+ * so DAT never exceeds RNG. Con reg_lock */
+static void rpi_pwm_write_regs(struct rpi_pwm *dev, u32 RNG, u32 DAT) {
+	struct reg_shadow *rng = dev->id ? &shadow_PWM_RNG2 : &shadow_PWM_RNG1;
+
+	if (rng->valid && RNG < rng->val) {
+		CHAN_WRITE(dev, DAT, PWM_DAT);
+		CHAN_WRITE(dev, RNG, PWM_RNG);
+	} else {
+		CHAN_WRITE(dev, RNG, PWM_RNG);
+		CHAN_WRITE(dev, DAT, PWM_DAT);
+	}
+}
 
-	/* Wait for the PWM to be disabled, otherwise PWM block hangs */
-	udelay(10);
+/* Escribe ya o deja los valores a latch_timer, los ultimos ganan */
+static void rpi_pwm_write_chan(struct rpi_pwm *dev, u32 RNG, u32 DAT) {
+	unsigned long flags;
+	ktime_t next;
+
+	spin_lock_irqsave(&dev->reg_lock, flags);
+	if (rpi_pwm_latch_window(dev, RNG, DAT, &next)) {
+		dev->latch_pending = 0;
+		rpi_pwm_write_regs(dev, RNG, DAT);
+	} else {
+		dev->latch_rng = RNG;
+		dev->latch_dat = DAT;
+		dev->deferred++;
+		if (!dev->latch_pending) {
+			dev->latch_pending = 1;
+			dev->latch_tries = 0;
+			hrtimer_start(&dev->latch_timer, next, HRTIMER_MODE_ABS);
+		}
+	}
+	spin_unlock_irqrestore(&dev->reg_lock, flags);
+}
+
+static enum hrtimer_restart rpi_pwm_latch_cb(struct hrtimer *t) {
+	struct rpi_pwm *dev = container_of(t, struct rpi_pwm, latch_timer);
+	enum hrtimer_restart ret = HRTIMER_NORESTART;
+	unsigned long flags;
+	ktime_t next;
+
+	spin_lock_irqsave(&dev->reg_lock, flags);
+	if (dev->latch_pending) {
+		if (rpi_pwm_latch_window(dev, dev->latch_rng, dev->latch_dat,
+					 &next))
+			ret = HRTIMER_NORESTART;
+		else if (++dev->latch_tries < LATCH_TRIES) {
+			/* El timer llego tarde a la ventana, otro periodo */
+			hrtimer_set_expires(t, next);
+			ret = HRTIMER_RESTART;
+		}
+		else
+			dev->latch_missed++;
+
+		if (ret == HRTIMER_NORESTART) {
+			dev->latch_pending = 0;
+			rpi_pwm_write_regs(dev, dev->latch_rng, dev->latch_dat);
+		}
+	}
+	spin_unlock_irqrestore(&dev->reg_lock, flags);
+	return ret;
+}
+
+
+/* Program clock, range and data. While the clock divisor stays the same
+ * the PWM keeps running and only the registers that changed are written.
+ * Both channels share the PWM clock, the divisor can't change under the
+ * other channel while it uses it. */
+static int rpi_pwm_program(struct rpi_pwm *dev, struct rpi_pwm_regs *r) {
+	u32 divisor = 19200000 / r->mcf;
+	int ret = 0;
+
+	mutex_lock(&clk_lock);
+	if (!clk_users)
+		reg_shadow_invalidate();
+
+	if (rpi_pwm_clock_running(divisor))
+		rpi_pwm_set_divisor(dev, divisor);
+	else if (clk_users & ~BIT(dev->id)) {
+		dev_err(dev->dev, "clock in use by the other channel\n");
+		ret = -EBUSY;
+	}
+	else {
+		/* Disable PWM, and wait for it to be disabled, otherwise PWM
+		 * block hangs */
+		if (rpi_pwm_ctl_write(0))
+			udelay(10);
 
-	ret = rpi_pwm_set_clk(dev, mcf);
+		ret = rpi_pwm_set_clk(dev, r->mcf);
+	}
+	if (!ret)
+		clk_users |= BIT(dev->id);
+	mutex_unlock(&clk_lock);
 	if (ret)
 		return ret;
 
+	rpi_pwm_write_chan(dev, r->rng, r->dat);
+
+	/* Enable MSEN mode, and start PWM */
+	rpi_pwm_ctl_chan(dev->id, 1);
+
+	return 0;
+}
+
+
+static int rpi_pwm_calc_servo(struct rpi_pwm *dev, struct rpi_pwm_regs *r) {
+	unsigned long RNG, DAT;
+	unsigned long mcf = 16000, frequency=50;
+
 	RNG = mcf/frequency;
 	DAT = (mcf*2*dev->servo_val/dev->servo_max/frequency/20)
 	    + (mcf/frequency/40);
@@ -260,28 +697,20 @@ static int rpi_pwm_set_servo(struct rpi_pwm *dev) {
 		return -ERANGE;
 	}
 
-	__raw_writel(RNG, PWM_RNG1);
-	__raw_writel(DAT, PWM_DAT1);
-
-	/* Enable MSEN mode, and start PWM */
-	__raw_writel(0x81, PWM_CTL);
-
+	r->mcf = mcf;
+	r->rng = RNG;
+	r->dat = DAT;
 	return 0;
 }
 
 
-static int rpi_pwm_set_frequency(struct rpi_pwm *dev) {
+static int rpi_pwm_calc_frequency(struct rpi_pwm *dev, struct rpi_pwm_regs *r) {
 	unsigned long RNG, DAT;
-	int ret;
-	/* Disable PWM */
-	__raw_writel(0, PWM_CTL);
-
-	/* Wait for the PWM to be disabled, otherwise PWM block hangs */
-	udelay(10);
 
-	ret = rpi_pwm_set_clk(dev, dev->mcf);
-	if (ret)
-		return ret;
+	if (!dev->mcf || !dev->frequency) {
+		dev_err(dev->dev, "no MCF or frequency specified\n");
+		return -EINVAL;
+	}
 
 	RNG = dev->mcf/dev->frequency;
 	DAT = RNG*dev->duty/100;
@@ -296,49 +725,301 @@ static int rpi_pwm_set_frequency(struct rpi_pwm *dev) {
 		return -ERANGE;
 	}
 
-	__raw_writel(RNG, PWM_RNG1);
-	__raw_writel(DAT, PWM_DAT1);
+	r->mcf = dev->mcf;
+	r->rng = RNG;
+	r->dat = DAT;
+	return 0;
+}
 
-	/* Enable MSEN mode, and start PWM */
-	__raw_writel(0x81, PWM_CTL);
 
-	return 0;
+/* Registros del canal segun su modo, en audio no hay nada que hacer */
+static int rpi_pwm_calc(struct rpi_pwm *dev, struct rpi_pwm_regs *r) {
+	if (dev->mode == MODE_SERVO)
+		return rpi_pwm_calc_servo(dev, r);
+	else if (dev->mode == MODE_PWM)
+		return rpi_pwm_calc_frequency(dev, r);
+	return -EINVAL;
 }
 
 
 static int rpi_pwm_activate(struct rpi_pwm *dev) {
+	struct rpi_pwm_regs r;
 	int ret = 0;
 
-	/* Set PWM alternate function for GPIO18 */
-	SET_GPIO_ALT(15, 5);
-
-	if (dev->mode == MODE_SERVO)
-		ret = rpi_pwm_set_servo(dev);
-
-	else if (dev->mode == MODE_PWM)
-		ret = rpi_pwm_set_frequency(dev);
+	/* Set PWM alternate function for the channel pin */
+	SET_GPIO_ALT(dev->gpio, dev->alt);
 
-	else if (dev->mode == MODE_AUDIO) {
+	if (dev->mode == MODE_AUDIO) {
 		/* Nothing to do */
 		;
 	}
+	else {
+		ret = rpi_pwm_calc(dev, &r);
+		if (!ret)
+			ret = rpi_pwm_program(dev, &r);
+	}
 
-	dev->active = 1;
+	rpi_pwm_set_active(dev, 1);
 	return ret;
 }
 
 
 static int rpi_pwm_deactivate(struct rpi_pwm *dev) {
+	rpi_pwm_set_active(dev, 0);
+	/* Solo se apaga este canal, el otro sigue */
 	if (dev->mode != MODE_AUDIO)
-		__raw_writel(0, PWM_CTL);
+		rpi_pwm_ctl_chan(dev->id, 0);
+
+	mutex_lock(&clk_lock);
+	clk_users &= ~BIT(dev->id);
+	mutex_unlock(&clk_lock);
 	udelay(10);
-	SET_GPIO_ALT(15, 0);
+	SET_GPIO_ALT(dev->gpio, 0);
 	udelay(10);
-	dev->active = 0;
 	return 0;
 }
 
 
+/* Arranca (on) o para los dos canales con una sola escritura de PWM_CTL,
+ * asi empiezan el periodo a la vez. Con on los registros de los dos se
+ * cargan antes con el PWM parado, tambien si ya corrian, para volver a
+ * ponerlos en fase. Se llama con el lock de los dos canales */
+static int rpi_pwm_sync(int on) {
+	struct rpi_pwm_regs r[ARRAY_SIZE(pwms)];
+	int pwm, ret;
+
+	if (!on) {
+		for (pwm=0; pwm<ARRAY_SIZE(pwms); pwm++)
+			if (pwms[pwm].mode == MODE_AUDIO)
+				return -EBUSY;
+		rpi_pwm_ctl_write(0);
+		udelay(10);
+		for (pwm=0; pwm<ARRAY_SIZE(pwms); pwm++) {
+			SET_GPIO_ALT(pwms[pwm].gpio, 0);
+			rpi_pwm_set_active(&pwms[pwm], 0);
+		}
+		mutex_lock(&clk_lock);
+		clk_users = 0;
+		mutex_unlock(&clk_lock);
+		return 0;
+	}
+
+	for (pwm=0; pwm<ARRAY_SIZE(pwms); pwm++) {
+		ret = rpi_pwm_calc(&pwms[pwm], &r[pwm]);
+		if (ret)
+			return ret;
+		/* El reloj es comun */
+		if (19200000 / r[pwm].mcf != 19200000 / r[0].mcf) {
+			dev_err(pwms[pwm].dev, "MCF differs from pwm0\n");
+			return -EINVAL;
+		}
+	}
+
+	mutex_lock(&clk_lock);
+	if (!clk_users)
+		reg_shadow_invalidate();
+
+	if (rpi_pwm_ctl_write(0))
+		udelay(10);
+
+	if (!rpi_pwm_clock_running(19200000 / r[0].mcf)) {
+		ret = rpi_pwm_set_clk(&pwms[0], r[0].mcf);
+		if (ret)
+			goto out;
+	}
+
+	for (pwm=0; pwm<ARRAY_SIZE(pwms); pwm++) {
+		rpi_pwm_set_divisor(&pwms[pwm], 19200000 / r[pwm].mcf);
+		SET_GPIO_ALT(pwms[pwm].gpio, pwms[pwm].alt);
+		rpi_pwm_write_chan(&pwms[pwm], r[pwm].rng, r[pwm].dat);
+		rpi_pwm_set_active(&pwms[pwm], 1);
+		clk_users |= BIT(pwm);
+	}
+
+	rpi_pwm_ctl_write(PWM_CTL_CHAN(0) | PWM_CTL_CHAN(1));
+out:
+	mutex_unlock(&clk_lock);
+	return ret;
+}
+
+
+/*********************************************************************************/
+/* Cambios de parametros, comunes a sysfs y /dev/rpi-pwm                         */
+/*********************************************************************************/
+static int rpi_pwm_check(struct rpi_pwm *dev, struct rpi_pwm_params *p) {
+	u32 servo_max;
+
+	if ((p->set & RPI_PWM_SET_MODE) &&
+	    p->mode != RPI_PWM_MODE_PWM && p->mode != RPI_PWM_MODE_SERVO)
+		return -EINVAL;
+	if ((p->set & RPI_PWM_SET_DUTY) && (p->duty < 1 || p->duty > 99))
+		return -ERANGE;
+	if ((p->set & RPI_PWM_SET_MCF) && (p->mcf < 2 || p->mcf >= 100000000))
+		return -ERANGE;
+	if ((p->set & RPI_PWM_SET_SERVO_MAX) && !p->servo_max)
+		return -ERANGE;
+
+	servo_max = (p->set & RPI_PWM_SET_SERVO_MAX) ? p->servo_max : dev->servo_max;
+	if ((p->set & RPI_PWM_SET_SERVO) && p->servo > servo_max)
+		return -ERANGE;
+	return 0;
+}
+
+/* Copia los parametros a la configuracion de dev, sin seq */
+static void rpi_pwm_merge(struct rpi_pwm *dev, struct rpi_pwm_params *p) {
+	if (p->set & RPI_PWM_SET_MODE)
+		dev->mode = p->mode;
+	if (p->set & RPI_PWM_SET_MCF)
+		dev->mcf = p->mcf;
+	if (p->set & RPI_PWM_SET_FREQUENCY)
+		dev->frequency = p->frequency;
+	if (p->set & RPI_PWM_SET_DUTY)
+		dev->duty = p->duty;
+	if (p->set & RPI_PWM_SET_SERVO_MAX) {
+		/* Scale the rotation to match new max, as servo_max_store */
+		if (!(p->set & RPI_PWM_SET_SERVO))
+			dev->servo_val = dev->servo_val
+				       *p->servo_max / dev->servo_max;
+		dev->servo_max = p->servo_max;
+	}
+	if (p->set & RPI_PWM_SET_SERVO)
+		dev->servo_val = p->servo;
+}
+
+/* Copia los parametros al canal, sin tocar el hardware */
+static void rpi_pwm_apply(struct rpi_pwm *dev, struct rpi_pwm_params *p) {
+	rpi_pwm_cfg_begin(dev);
+	rpi_pwm_merge(dev, p);
+	rpi_pwm_cfg_end(dev);
+}
+
+/* Prueba p sobre una copia de la configuracion del canal, sin tocar dev:
+ * los campos, y si el canal se va a programar (on) tambien RNG/DAT y el
+ * divisor que saldrian. *divisor es 0 si no se programa el reloj */
+static int rpi_pwm_validate(struct rpi_pwm *dev, struct rpi_pwm_params *p,
+		int on, u32 *divisor) {
+	struct rpi_pwm cand = {
+		.mode		= dev->mode,
+		.duty		= dev->duty,
+		.frequency	= dev->frequency,
+		.servo_val	= dev->servo_val,
+		.servo_max	= dev->servo_max,
+		.mcf		= dev->mcf,
+		.id		= dev->id,
+		.dev		= dev->dev,
+	};
+	struct rpi_pwm_regs r;
+	int ret;
+
+	*divisor = 0;
+	ret = rpi_pwm_check(dev, p);
+	if (ret || !on)
+		return ret;
+
+	rpi_pwm_merge(&cand, p);
+	if (cand.mode == MODE_AUDIO)
+		return 0;
+	ret = rpi_pwm_calc(&cand, &r);
+	if (ret)
+		return ret;
+	if (r.mcf > 19200000 || 19200000 / r.mcf > 0x1000) {
+		dev_err(dev->dev, "MCF out of range: %u\n", r.mcf);
+		return -ERANGE;
+	}
+	*divisor = 19200000 / r.mcf;
+	return 0;
+}
+
+/* El reloj es comun: los canales que se programan (divisor[N] != 0) piden
+ * el mismo divisor, y este no puede cambiar bajo un canal que lo sigue
+ * usando. off son los canales que se apagan antes de programar */
+static int rpi_pwm_check_clock(u32 *divisor, u32 off) {
+	u32 want = 0;
+	int pwm, ret = 0;
+
+	for (pwm=0; pwm<ARRAY_SIZE(pwms); pwm++) {
+		if (!divisor[pwm])
+			continue;
+		if (want && divisor[pwm] != want) {
+			dev_err(pwms[pwm].dev, "MCF differs from the other channel\n");
+			return -EINVAL;
+		}
+		want = divisor[pwm];
+	}
+	if (!want)
+		return 0;
+
+	mutex_lock(&clk_lock);
+	for (pwm=0; pwm<ARRAY_SIZE(pwms); pwm++)
+		if (!divisor[pwm] && !(off & BIT(pwm)) &&
+		    (clk_users & BIT(pwm)) && !rpi_pwm_clock_running(want)) {
+			dev_err(pwms[pwm].dev, "clock in use with another MCF\n");
+			ret = -EBUSY;
+		}
+	mutex_unlock(&clk_lock);
+	return ret;
+}
+
+//Lock de los canales de mask, siempre en el mismo orden: pwm0 y luego pwm1
+static void rpi_pwm_lock(u32 mask) {
+	int pwm;
+
+	for (pwm=0; pwm<ARRAY_SIZE(pwms); pwm++)
+		if (mask & BIT(pwm))
+			mutex_lock_nested(&pwms[pwm].lock, pwm);
+}
+
+static void rpi_pwm_unlock(u32 mask) {
+	int pwm;
+
+	for (pwm=ARRAY_SIZE(pwms)-1; pwm>=0; pwm--)
+		if (mask & BIT(pwm))
+			mutex_unlock(&pwms[pwm].lock);
+}
+
+
+/* Parametros de un store de sysfs: en modo immediate se aplican y se programa
+ * el canal, en delayed se acumulan en staged hasta que se escribe commit.
+ * El error llega al que escribe; en immediate se prueba antes de aplicar */
+static int rpi_pwm_store(struct rpi_pwm *dev, struct rpi_pwm_params *p) {
+	struct rpi_pwm_params *st = &dev->staged;
+	u32 divisor[ARRAY_SIZE(pwms)] = { 0 };
+	int ret;
+
+	if (dev->immediate) {
+		ret = rpi_pwm_validate(dev, p, 1, &divisor[dev->id]);
+		if (!ret)
+			ret = rpi_pwm_check_clock(divisor, 0);
+		if (ret)
+			return ret;
+		rpi_pwm_apply(dev, p);
+		return rpi_pwm_activate(dev);
+	}
+
+	st->set |= p->set;
+	if (p->set & RPI_PWM_SET_MODE)
+		st->mode = p->mode;
+	if (p->set & RPI_PWM_SET_MCF)
+		st->mcf = p->mcf;
+	if (p->set & RPI_PWM_SET_FREQUENCY)
+		st->frequency = p->frequency;
+	if (p->set & RPI_PWM_SET_DUTY)
+		st->duty = p->duty;
+	if (p->set & RPI_PWM_SET_SERVO)
+		st->servo = p->servo;
+	if (p->set & RPI_PWM_SET_SERVO_MAX)
+		st->servo_max = p->servo_max;
+	return 0;
+}
+
+/* servo_max que tendra el canal con lo que hay en staged */
+static u32 rpi_pwm_servo_max(struct rpi_pwm *dev) {
+	if (!dev->immediate && (dev->staged.set & RPI_PWM_SET_SERVO_MAX))
+		return dev->staged.servo_max;
+	return dev->servo_max;
+}
+
+
 /*********************************************************************************/
 /* https://www.kernel.org/doc/Documentation/filesystems/sysfs.txt                */
 /*********************************************************************************/
@@ -350,11 +1031,11 @@ static ssize_t active_show(struct device *d,
 		struct device_attribute *attr, char *buf)
 {
 	ssize_t ret;
+	int active;
 	//Obtenemos el valor que tiene en el archivo "active" de sysfs
 	struct rpi_pwm *dev = dev_get_drvdata(d);
-	mutex_lock(&sysfs_lock);
-		ret = sprintf(buf, "%d\n", !!dev->active);
-	mutex_unlock(&sysfs_lock);
+	PWM_READ(dev, active = dev->active);
+	ret = sprintf(buf, "%d\n", !!active);
 	return ret;
 }
 
@@ -368,7 +1049,7 @@ static ssize_t active_store(struct device *d,
 	long new_active;
 	struct rpi_pwm *dev = dev_get_drvdata(d);
 
-	mutex_lock(&sysfs_lock);
+	mutex_lock(&dev->lock);
 		ret = strict_strtol(buf, 0, &new_active);
 		if (ret == 0) {
 			if (new_active)
@@ -378,7 +1059,7 @@ static ssize_t active_store(struct device *d,
 		}
 		else
 			ret = -EINVAL;
-	mutex_unlock(&sysfs_lock);
+	mutex_unlock(&dev->lock);
 	return ret?ret:count;
 }
 //static DEVICE_ATTR(active, 0666, active_show, active_store);
@@ -393,20 +1074,20 @@ static ssize_t mode_show(struct device *d,
 	char tmp_bfr[512];
 	char *tmp_bfr_ptr = tmp_bfr;
 	int offset;
+	enum device_mode mode;
 	struct rpi_pwm *dev = dev_get_drvdata(d);
-	mutex_lock(&sysfs_lock);
+	PWM_READ(dev, mode = dev->mode);
 	for (offset=0; offset < ARRAY_SIZE(device_mode_str); offset++) {
-		if (dev->mode == offset)
+		if (mode == offset)
 			*tmp_bfr_ptr++ = '[';
 		strcpy(tmp_bfr_ptr, device_mode_str[offset]);
 		tmp_bfr_ptr += strlen(device_mode_str[offset]);
-		if (dev->mode == offset)
+		if (mode == offset)
 			*tmp_bfr_ptr++ = ']';
 		*tmp_bfr_ptr++ = ' ';
 	}
 	*tmp_bfr_ptr++ = 0;
 	ret = sprintf(buf, "%s\n", tmp_bfr);
-	mutex_unlock(&sysfs_lock);
 	return ret;
 }
 
@@ -418,30 +1099,42 @@ static ssize_t mode_store(struct device *d,
 	int offset;
 	struct rpi_pwm *dev = dev_get_drvdata(d);
 
-	mutex_lock(&sysfs_lock);
+	mutex_lock(&dev->lock);
 	ret = -ENOENT;
 	for (offset=0; offset < ARRAY_SIZE(device_mode_str); offset++) {
 		if (!strncmp(buf,
 				 device_mode_str[offset],
 				 strlen(device_mode_str[offset]))) {
-			dev->mode = offset;
+			struct rpi_pwm_params p = {
+				.set	= RPI_PWM_SET_MODE,
+				.mode	= offset,
+			};
 
-			if (dev->immediate)
-				rpi_pwm_activate(dev);
+			/* audio is never staged, it leaves delayed mode
+			 * below anyway */
+			ret = 0;
+			if (offset == MODE_AUDIO) {
+				rpi_pwm_apply(dev, &p);
+				if (dev->immediate)
+					ret = rpi_pwm_activate(dev);
+			}
+			else
+				ret = rpi_pwm_store(dev, &p);
 
 			/* If switching to audio mode, switch out of
 			 * immediate mode.  This protects us from locking
 			 * up the audio system by altering PWM values while
 			 * audio playback is occurring.
 			 */
-			if (offset == MODE_AUDIO)
+			if (offset == MODE_AUDIO) {
+				rpi_pwm_cfg_begin(dev);
 				dev->immediate = 0;
-
-			ret = 0;
+				rpi_pwm_cfg_end(dev);
+			}
 			break;
 		}
 	}
-	mutex_unlock(&sysfs_lock);
+	mutex_unlock(&dev->lock);
 	return ret?ret:count;
 }
 //static DEVICE_ATTR(mode, 0666, mode_show, mode_store);
@@ -452,10 +1145,10 @@ static ssize_t duty_show(struct device *d,
 		struct device_attribute *attr, char *buf)
 {
 	ssize_t ret;
+	u32 duty;
 	struct rpi_pwm *dev = dev_get_drvdata(d);
-	mutex_lock(&sysfs_lock);
-	ret = sprintf(buf, "%d%%\n", dev->duty);
-	mutex_unlock(&sysfs_lock);
+	PWM_READ(dev, duty = dev->duty);
+	ret = sprintf(buf, "%d%%\n", duty);
 	return ret;
 }
 
@@ -466,19 +1159,21 @@ static ssize_t duty_store(struct device *d,
 	long new_duty;
 	struct rpi_pwm *dev = dev_get_drvdata(d);
 
-	mutex_lock(&sysfs_lock);
+	mutex_lock(&dev->lock);
 	ret = strict_strtol(buf, 0, &new_duty);
 	if (ret == 0) {
 		if (new_duty > 0 && new_duty < 100) {
-			dev->duty = new_duty;
-			dev->mode = MODE_PWM;
-			if (dev->immediate)
-				rpi_pwm_activate(dev);
+			struct rpi_pwm_params p = {
+				.set	= RPI_PWM_SET_DUTY | RPI_PWM_SET_MODE,
+				.duty	= new_duty,
+				.mode	= MODE_PWM,
+			};
+			ret = rpi_pwm_store(dev, &p);
 		}
 		else
 			ret = -ERANGE;
 	}
-	mutex_unlock(&sysfs_lock);
+	mutex_unlock(&dev->lock);
 	return ret?ret:count;
 }
 //static DEVICE_ATTR(duty, 0666, duty_show, duty_store);
@@ -490,10 +1185,10 @@ static ssize_t mcf_show(struct device *d,
 		struct device_attribute *attr, char *buf)
 {
 	ssize_t ret;
+	u32 mcf;
 	struct rpi_pwm *dev = dev_get_drvdata(d);
-	mutex_lock(&sysfs_lock);
-	ret = sprintf(buf, "%d\n", dev->mcf);
-	mutex_unlock(&sysfs_lock);
+	PWM_READ(dev, mcf = dev->mcf);
+	ret = sprintf(buf, "%d\n", mcf);
 	return ret;
 }
 
@@ -504,19 +1199,21 @@ static ssize_t mcf_store(struct device *d,
 	long new_mcf;
 	struct rpi_pwm *dev = dev_get_drvdata(d);
 
-	mutex_lock(&sysfs_lock);
+	mutex_lock(&dev->lock);
 	ret = strict_strtol(buf, 0, &new_mcf);
 	if (ret == 0) {
 		if (new_mcf > 1 && new_mcf < 100000000) {
-			dev->mcf = new_mcf;
-			dev->mode = MODE_PWM;
-			if (dev->immediate)
-				rpi_pwm_activate(dev);
+			struct rpi_pwm_params p = {
+				.set	= RPI_PWM_SET_MCF | RPI_PWM_SET_MODE,
+				.mcf	= new_mcf,
+				.mode	= MODE_PWM,
+			};
+			ret = rpi_pwm_store(dev, &p);
 		}
 		else
 			ret = -ERANGE;
 	}
-	mutex_unlock(&sysfs_lock);
+	mutex_unlock(&dev->lock);
 	return ret?ret:count;
 }
 static DEVICE_ATTR(mcf, 0664, mcf_show, mcf_store);
@@ -530,17 +1227,21 @@ static ssize_t real_freq_show(struct device *d,
 	ssize_t ret;
 	struct rpi_pwm *dev = dev_get_drvdata(d);
 	unsigned long RNG;
-	mutex_lock(&sysfs_lock);
-	if (dev->frequency) {
-		RNG = dev->mcf/dev->frequency;
+	u32 mcf, frequency, real_mcf;
+	PWM_READ(dev, {
+		mcf = dev->mcf;
+		frequency = dev->frequency;
+		real_mcf = dev->real_mcf;
+	});
+	if (frequency) {
+		RNG = mcf/frequency;
 		if (RNG < 1)
 			ret = -EINVAL;
 		else
-			ret = sprintf(buf, "%ld\n", dev->real_mcf/RNG);
+			ret = sprintf(buf, "%ld\n", real_mcf/RNG);
 	}
 	else
 		ret = -EINVAL;
-	mutex_unlock(&sysfs_lock);
 	return ret;
 }
 //static DEVICE_ATTR(real_frequency, 0666, real_freq_show, NULL);
@@ -551,10 +1252,10 @@ static ssize_t servo_val_show(struct device *d,
 		struct device_attribute *attr, char *buf)
 {
 	ssize_t ret;
+	u32 servo_val;
 	struct rpi_pwm *dev = dev_get_drvdata(d);
-	mutex_lock(&sysfs_lock);
-	ret = sprintf(buf, "%d\n", dev->servo_val);
-	mutex_unlock(&sysfs_lock);
+	PWM_READ(dev, servo_val = dev->servo_val);
+	ret = sprintf(buf, "%d\n", servo_val);
 	return ret;
 }
 
@@ -565,19 +1266,22 @@ static ssize_t servo_val_store(struct device *d,
 	long new_servo_val;
 	struct rpi_pwm *dev = dev_get_drvdata(d);
 
-	mutex_lock(&sysfs_lock);
+	mutex_lock(&dev->lock);
 	ret = strict_strtol(buf, 0, &new_servo_val);
 	if (ret == 0) {
-		if (new_servo_val >= 0 && new_servo_val <= dev->servo_max) {
-			dev->servo_val = new_servo_val;
-			dev->mode = MODE_SERVO;
-			if (dev->immediate)
-				rpi_pwm_activate(dev);
+		if (new_servo_val >= 0 &&
+		    new_servo_val <= rpi_pwm_servo_max(dev)) {
+			struct rpi_pwm_params p = {
+				.set	= RPI_PWM_SET_SERVO | RPI_PWM_SET_MODE,
+				.servo	= new_servo_val,
+				.mode	= MODE_SERVO,
+			};
+			ret = rpi_pwm_store(dev, &p);
 		}
 		else
 			ret = -ERANGE;
 	}
-	mutex_unlock(&sysfs_lock);
+	mutex_unlock(&dev->lock);
 	return ret?ret:count;
 }
 //static DEVICE_ATTR(servo, 0666, servo_val_show, servo_val_store);
@@ -588,10 +1292,10 @@ static ssize_t servo_max_show(struct device *d,
 		struct device_attribute *attr, char *buf)
 {
 	ssize_t ret;
+	u32 servo_max;
 	struct rpi_pwm *dev = dev_get_drvdata(d);
-	mutex_lock(&sysfs_lock);
-	ret = sprintf(buf, "%d\n", dev->servo_max);
-	mutex_unlock(&sysfs_lock);
+	PWM_READ(dev, servo_max = dev->servo_max);
+	ret = sprintf(buf, "%d\n", servo_max);
 	return ret;
 }
 
@@ -602,23 +1306,22 @@ static ssize_t servo_max_store(struct device *d,
 	long new_servo_max;
 	struct rpi_pwm *dev = dev_get_drvdata(d);
 
-	mutex_lock(&sysfs_lock);
+	mutex_lock(&dev->lock);
 	ret = strict_strtol(buf, 0, &new_servo_max);
 	if (ret == 0) {
 		if (new_servo_max > 0) {
-			/* Scale the rotation to match new max */
-			dev->servo_val = dev->servo_val
-				       *new_servo_max / dev->servo_max;
-
-			dev->servo_max = new_servo_max;
-			dev->mode = MODE_SERVO;
-			if (dev->immediate)
-				rpi_pwm_activate(dev);
+			/* The rotation is scaled to the new max when applied */
+			struct rpi_pwm_params p = {
+				.set		= RPI_PWM_SET_SERVO_MAX | RPI_PWM_SET_MODE,
+				.servo_max	= new_servo_max,
+				.mode		= MODE_SERVO,
+			};
+			ret = rpi_pwm_store(dev, &p);
 		}
 		else
 			ret = -ERANGE;
 	}
-	mutex_unlock(&sysfs_lock);
+	mutex_unlock(&dev->lock);
 	return ret?ret:count;
 }
 //static DEVICE_ATTR(servo_max, 0666, servo_max_show, servo_max_store);
@@ -629,10 +1332,10 @@ static ssize_t freq_show(struct device *d,
 		struct device_attribute *attr, char *buf)
 {
 	ssize_t ret;
+	u32 frequency;
 	struct rpi_pwm *dev = dev_get_drvdata(d);
-	mutex_lock(&sysfs_lock);
-	ret = sprintf(buf, "%d\n", dev->frequency);
-	mutex_unlock(&sysfs_lock);
+	PWM_READ(dev, frequency = dev->frequency);
+	ret = sprintf(buf, "%d\n", frequency);
 	return ret;
 }
 
@@ -643,15 +1346,21 @@ static ssize_t freq_store(struct device *d,
 	long new_freq;
 	struct rpi_pwm *dev = dev_get_drvdata(d);
 
-	mutex_lock(&sysfs_lock);
+	mutex_lock(&dev->lock);
 	ret = strict_strtol(buf, 0, &new_freq);
 	if (ret == 0) {
-		dev->frequency = new_freq;
-		dev->mode = MODE_PWM;
-		if (dev->immediate)
-			rpi_pwm_activate(dev);
+		if (new_freq > 0 && new_freq < 100000000) {
+			struct rpi_pwm_params p = {
+				.set		= RPI_PWM_SET_FREQUENCY | RPI_PWM_SET_MODE,
+				.frequency	= new_freq,
+				.mode		= MODE_PWM,
+			};
+			ret = rpi_pwm_store(dev, &p);
+		}
+		else
+			ret = -ERANGE;
 	}
-	mutex_unlock(&sysfs_lock);
+	mutex_unlock(&dev->lock);
 	return ret?ret:count;
 }
 //static DEVICE_ATTR(frequency, 0666, freq_show, freq_store);
@@ -663,10 +1372,10 @@ static ssize_t delayed_show(struct device *d,
 		struct device_attribute *attr, char *buf)
 {
 	ssize_t ret;
+	int immediate;
 	struct rpi_pwm *dev = dev_get_drvdata(d);
-	mutex_lock(&sysfs_lock);
-	ret = sprintf(buf, dev->immediate?"immediate\n":"delayed\n");
-	mutex_unlock(&sysfs_lock);
+	PWM_READ(dev, immediate = dev->immediate);
+	ret = sprintf(buf, immediate?"immediate\n":"delayed\n");
 	return ret;
 }
 
@@ -676,24 +1385,111 @@ static ssize_t delayed_store(struct device *d,
 	ssize_t ret = 0;
 	struct rpi_pwm *dev = dev_get_drvdata(d);
 
-	mutex_lock(&sysfs_lock);
-	if (!strcasecmp(buf, "immediate") || buf[0] == '0')
+	mutex_lock(&dev->lock);
+	rpi_pwm_cfg_begin(dev);
+	if (sysfs_streq(buf, "immediate") || buf[0] == '0') {
 		dev->immediate = 1;
-	else if (!strcasecmp(buf, "delayed") || buf[0] == '1')
+		/* Lo pendiente no se aplica mas tarde por sorpresa */
+		memset(&dev->staged, 0, sizeof(dev->staged));
+	}
+	else if (sysfs_streq(buf, "delayed") || buf[0] == '1')
 		dev->immediate = 0;
 	else
 		ret = -EINVAL;
-	mutex_unlock(&sysfs_lock);
+	rpi_pwm_cfg_end(dev);
+	mutex_unlock(&dev->lock);
 	return ret?ret:count;
 }
 //static DEVICE_ATTR(delayed, 0666, delayed_show, delayed_store);
 static DEVICE_ATTR(delayed, 0664, delayed_show, delayed_store);
 
 
+/* Escrituras de RNG/DAT que esperaron al limite del periodo, y las que no
+ * lo alcanzaron en LATCH_TRIES periodos */
+static ssize_t deferred_show(struct device *d,
+		struct device_attribute *attr, char *buf)
+{
+	struct rpi_pwm *dev = dev_get_drvdata(d);
+	return sprintf(buf, "%u\n", READ_ONCE(dev->deferred));
+}
+static DEVICE_ATTR(deferred, 0444, deferred_show, NULL);
+
+static ssize_t latch_missed_show(struct device *d,
+		struct device_attribute *attr, char *buf)
+{
+	struct rpi_pwm *dev = dev_get_drvdata(d);
+	return sprintf(buf, "%u\n", READ_ONCE(dev->latch_missed));
+}
+static DEVICE_ATTR(latch_missed, 0444, latch_missed_show, NULL);
+
+
+/*********************************************************************************/
+/* commit: en modo delayed aplica de una vez los cambios acumulados (1) o los    */
+/* descarta (0). La lectura muestra los parametros pendientes                    */
+/*********************************************************************************/
+static ssize_t commit_show(struct device *d,
+		struct device_attribute *attr, char *buf)
+{
+	/* active no se acumula, active_store actua en el momento */
+	static const char *names[] = {
+		"mode", NULL, "mcf", "frequency", "duty", "servo", "servo_max",
+	};
+	struct rpi_pwm *dev = dev_get_drvdata(d);
+	ssize_t ret = 0;
+	u32 set;
+	int i;
+
+	set = READ_ONCE(dev->staged.set);
+
+	for (i=0; i < ARRAY_SIZE(names); i++)
+		if ((set & BIT(i)) && names[i])
+			ret += sprintf(buf + ret, "%s ", names[i]);
+	if (!ret)
+		ret = sprintf(buf, "none ");
+	buf[ret-1] = '\n';
+	return ret;
+}
+
+static ssize_t commit_store(struct device *d,
+		struct device_attribute *attr, const char *buf, size_t count)
+{
+	ssize_t ret = 0;
+	long commit;
+	struct rpi_pwm *dev = dev_get_drvdata(d);
+	u32 divisor[ARRAY_SIZE(pwms)] = { 0 };
+	u32 all = BIT(ARRAY_SIZE(pwms)) - 1;
+
+	/* Los dos canales: el otro no toma el reloj entre la prueba y la
+	 * programacion */
+	rpi_pwm_lock(all);
+	ret = strict_strtol(buf, 0, &commit);
+	if (ret == 0) {
+		/* Todo se valida junto, tambien RNG/DAT y el divisor que
+		 * saldrian: un error deja el canal y staged como estaban */
+		if (commit && dev->staged.set) {
+			ret = rpi_pwm_validate(dev, &dev->staged, 1,
+					       &divisor[dev->id]);
+			if (ret == 0)
+				ret = rpi_pwm_check_clock(divisor, 0);
+			if (ret == 0) {
+				rpi_pwm_apply(dev, &dev->staged);
+				ret = rpi_pwm_activate(dev);
+			}
+		}
+		if (ret == 0)
+			memset(&dev->staged, 0, sizeof(dev->staged));
+	}
+	rpi_pwm_unlock(all);
+	return ret?ret:count;
+}
+static DEVICE_ATTR(commit, 0664, commit_show, commit_store);
+
+
 
 static struct attribute *rpi_pwm_sysfs_entries[] = {
 	&dev_attr_active.attr,
 	&dev_attr_delayed.attr,
+	&dev_attr_commit.attr,
 	&dev_attr_servo.attr,
 	&dev_attr_servo_max.attr,
 	&dev_attr_duty.attr,
@@ -701,6 +1497,8 @@ static struct attribute *rpi_pwm_sysfs_entries[] = {
 	&dev_attr_mcf.attr,
 	&dev_attr_real_frequency.attr,
 	&dev_attr_frequency.attr,
+	&dev_attr_deferred.attr,
+	&dev_attr_latch_missed.attr,
 	NULL
 };
 
@@ -709,9 +1507,295 @@ static struct attribute_group rpi_pwm_attribute_group = {
 	.attrs = rpi_pwm_sysfs_entries,
 };
 
+
+/*********************************************************************************/
+/* /sys/class/rpi-pwm/sync: 1 arranca o actualiza los dos canales en fase con su */
+/* configuracion actual, 0 los para a la vez                                     */
+/*********************************************************************************/
+static ssize_t sync_store(struct class *c,
+		struct class_attribute *attr, const char *buf, size_t count)
+{
+	ssize_t ret = 0;
+	long on;
+
+	rpi_pwm_lock(BIT(ARRAY_SIZE(pwms)) - 1);
+	ret = strict_strtol(buf, 0, &on);
+	if (ret == 0)
+		ret = rpi_pwm_sync(on);
+	rpi_pwm_unlock(BIT(ARRAY_SIZE(pwms)) - 1);
+	return ret?ret:count;
+}
+
+static struct class_attribute rpi_pwm_class_attrs[] = {
+	__ATTR(sync, 0220, NULL, sync_store),
+	__ATTR_NULL,
+};
+
 static struct class pwm_class = {
 	.name =		PWM_CLASS_NAME,
 	.owner =	THIS_MODULE,
+	.class_attrs =	rpi_pwm_class_attrs,
+};
+
+
+/*********************************************************************************/
+/* /dev/rpi-pwm: todos los parametros de uno o dos canales en una sola llamada   */
+/* y una sola programacion del PWM por canal (rpi_pwm.h)                         */
+/*********************************************************************************/
+/* Una programacion del canal con todo lo aplicado. Un canal parado al que
+ * no se le pide active solo guarda los parametros */
+static int rpi_pwm_commit(struct rpi_pwm *dev, struct rpi_pwm_params *p) {
+	int on = (p->set & RPI_PWM_SET_ACTIVE) ? p->active : dev->active;
+
+	if (on)
+		return rpi_pwm_activate(dev);
+	if (dev->active)
+		return rpi_pwm_deactivate(dev);
+	return 0;
+}
+
+static int rpi_pwm_set_config(struct rpi_pwm_config *cfg) {
+	u32 all = BIT(ARRAY_SIZE(pwms)) - 1;
+	u32 mask = cfg->channels;
+	u32 divisor[ARRAY_SIZE(pwms)];
+	u32 off = 0;
+	int on[ARRAY_SIZE(pwms)];
+	int pwm, ret = 0;
+
+	if (!mask || (mask & ~all) || (cfg->flags & ~RPI_PWM_F_SYNC))
+		return -EINVAL;
+
+	/* Los dos canales aunque solo se cambie uno: el reloj es comun y el
+	 * otro no lo puede tomar entre la prueba y la programacion */
+	rpi_pwm_lock(all);
+
+	/* Todo se prueba antes de tocar nada, con RNG/DAT y el divisor que
+	 * saldrian de cada canal que se programa. sync arranca los dos */
+	for (pwm=0; pwm<ARRAY_SIZE(pwms); pwm++) {
+		struct rpi_pwm_params *p = &cfg->ch[pwm];
+		struct rpi_pwm_params none = { .set = 0 };
+
+		if (!(mask & BIT(pwm)))
+			p = &none;
+		if (cfg->flags & RPI_PWM_F_SYNC)
+			on[pwm] = 1;
+		else if (!(mask & BIT(pwm)))
+			on[pwm] = 0;
+		else
+			on[pwm] = (p->set & RPI_PWM_SET_ACTIVE) ? p->active
+					: pwms[pwm].active;
+		if ((mask & BIT(pwm)) && !on[pwm])
+			off |= BIT(pwm);
+		ret = rpi_pwm_validate(&pwms[pwm], p, on[pwm], &divisor[pwm]);
+		/* sin divisor es audio, que sync no arranca */
+		if (!ret && (cfg->flags & RPI_PWM_F_SYNC) && !divisor[pwm])
+			ret = -EINVAL;
+		if (ret)
+			goto out;
+	}
+	ret = rpi_pwm_check_clock(divisor, off);
+	if (ret)
+		goto out;
+
+	for (pwm=0; pwm<ARRAY_SIZE(pwms); pwm++)
+		if (mask & BIT(pwm))
+			rpi_pwm_apply(&pwms[pwm], &cfg->ch[pwm]);
+
+	if (cfg->flags & RPI_PWM_F_SYNC)
+		ret = rpi_pwm_sync(1);
+	else {
+		/* Primero los que se apagan, dejan el reloj libre */
+		for (pwm=0; pwm<ARRAY_SIZE(pwms) && !ret; pwm++)
+			if (off & BIT(pwm))
+				ret = rpi_pwm_commit(&pwms[pwm], &cfg->ch[pwm]);
+		for (pwm=0; pwm<ARRAY_SIZE(pwms) && !ret; pwm++)
+			if ((mask & ~off) & BIT(pwm))
+				ret = rpi_pwm_commit(&pwms[pwm], &cfg->ch[pwm]);
+	}
+out:
+	rpi_pwm_unlock(all);
+	return ret;
+}
+
+/* Estado de los dos canales, sin lock como los show de sysfs */
+static void rpi_pwm_get_config(struct rpi_pwm_config *cfg) {
+	int pwm;
+
+	memset(cfg, 0, sizeof(*cfg));
+	cfg->channels = BIT(ARRAY_SIZE(pwms)) - 1;
+	for (pwm=0; pwm<ARRAY_SIZE(pwms); pwm++) {
+		struct rpi_pwm *dev = &pwms[pwm];
+		struct rpi_pwm_params *p = &cfg->ch[pwm];
+
+		PWM_READ(dev, {
+			p->mode = dev->mode;
+			p->active = !!dev->active;
+			p->mcf = dev->mcf;
+			p->frequency = dev->frequency;
+			p->duty = dev->duty;
+			p->servo = dev->servo_val;
+			p->servo_max = dev->servo_max;
+			p->real_mcf = dev->real_mcf;
+		});
+	}
+}
+
+static ssize_t rpi_pwm_read(struct file *file, char __user *buf,
+		size_t len, loff_t *pos) {
+	struct rpi_pwm_config cfg;
+
+	/* Una struct por apertura y despues fin de fichero, asi cat termina */
+	if (*pos >= sizeof(cfg))
+		return 0;
+	if (*pos || len < sizeof(cfg))
+		return -EINVAL;
+	rpi_pwm_get_config(&cfg);
+	if (copy_to_user(buf, &cfg, sizeof(cfg)))
+		return -EFAULT;
+	*pos += sizeof(cfg);
+	return sizeof(cfg);
+}
+
+static ssize_t rpi_pwm_write(struct file *file, const char __user *buf,
+		size_t len, loff_t *pos) {
+	struct rpi_pwm_config cfg;
+	int ret;
+
+	if (len != sizeof(cfg))
+		return -EINVAL;
+	if (copy_from_user(&cfg, buf, sizeof(cfg)))
+		return -EFAULT;
+	ret = rpi_pwm_set_config(&cfg);
+	return ret ? ret : len;
+}
+
+static long rpi_pwm_ioctl(struct file *file, unsigned int cmd,
+		unsigned long arg) {
+	struct rpi_pwm_config cfg;
+
+	switch (cmd) {
+	case RPI_PWM_IOC_GET:
+		rpi_pwm_get_config(&cfg);
+		if (copy_to_user((void __user *)arg, &cfg, sizeof(cfg)))
+			return -EFAULT;
+		return 0;
+	case RPI_PWM_IOC_SET:
+		if (copy_from_user(&cfg, (void __user *)arg, sizeof(cfg)))
+			return -EFAULT;
+		return rpi_pwm_set_config(&cfg);
+	}
+	return -ENOTTY;
+}
+
+/*********************************************************************************/
+/* Pagina de control (mmap): el programa escribe rng/dat con un seq y un hrtimer */
+/* los lleva a los registros, sin llamadas al sistema por cambio (rpi_pwm.h)     */
+/*********************************************************************************/
+static uint shm_period_us = 200;
+module_param(shm_period_us, uint, 0444);
+MODULE_PARM_DESC(shm_period_us, "periodo de lectura de la pagina de control (us)");
+
+static struct rpi_pwm_shm *shm;
+static struct hrtimer shm_timer;
+static DEFINE_MUTEX(shm_lock);
+static int shm_maps;
+
+/* Un canal: valores nuevos y completos del programa van a RNG/DAT si el
+ * canal esta encendido, si no se quedan para cuando lo este */
+static void rpi_pwm_shm_poll(struct rpi_pwm *dev, struct rpi_pwm_shm_chan *c) {
+	u32 seq, rng, dat;
+
+	seq = READ_ONCE(c->seq);
+	if ((seq & 1) || seq == dev->shm_seq)
+		return;
+	if (!(READ_ONCE(ctl_want) & PWM_CTL_CHAN(dev->id)))
+		return;
+	smp_rmb();
+	rng = READ_ONCE(c->rng);
+	dat = READ_ONCE(c->dat);
+	smp_rmb();
+	/* el programa esta escribiendo, el siguiente periodo */
+	if (READ_ONCE(c->seq) != seq)
+		return;
+
+	dev->shm_seq = seq;
+	if (!rng || dat > rng)
+		c->errors++;
+	else
+		rpi_pwm_write_chan(dev, rng, dat);
+	WRITE_ONCE(c->clock_hz, dev->real_mcf);
+	smp_wmb();
+	WRITE_ONCE(c->ack, seq);
+}
+
+static enum hrtimer_restart shm_timer_cb(struct hrtimer *t) {
+	int pwm;
+
+	for (pwm=0; pwm<ARRAY_SIZE(pwms); pwm++) {
+		rpi_pwm_shm_poll(&pwms[pwm], &shm->ch[pwm]);
+		WRITE_ONCE(shm->ch[pwm].deferred, READ_ONCE(pwms[pwm].deferred));
+	}
+	hrtimer_forward_now(t, ns_to_ktime((u64)shm_period_us * NSEC_PER_USEC));
+	return HRTIMER_RESTART;
+}
+
+/* El timer solo corre mientras hay algun mapeo de la pagina */
+static void rpi_pwm_vm_open(struct vm_area_struct *vma) {
+	mutex_lock(&shm_lock);
+	if (!shm_maps++)
+		hrtimer_start(&shm_timer,
+			ns_to_ktime((u64)shm_period_us * NSEC_PER_USEC),
+			HRTIMER_MODE_REL);
+	mutex_unlock(&shm_lock);
+}
+
+static void rpi_pwm_vm_close(struct vm_area_struct *vma) {
+	mutex_lock(&shm_lock);
+	if (!--shm_maps)
+		hrtimer_cancel(&shm_timer);
+	mutex_unlock(&shm_lock);
+}
+
+static const struct vm_operations_struct rpi_pwm_vm_ops = {
+	.open	= rpi_pwm_vm_open,
+	.close	= rpi_pwm_vm_close,
+};
+
+static int rpi_pwm_mmap(struct file *file, struct vm_area_struct *vma) {
+	int ret;
+
+	if (vma->vm_pgoff || vma->vm_end - vma->vm_start != PAGE_SIZE)
+		return -EINVAL;
+	/* MAP_PRIVATE copiaria la pagina en la primera escritura */
+	if (!(vma->vm_flags & VM_SHARED))
+		return -EINVAL;
+
+	vma->vm_flags |= VM_DONTEXPAND | VM_DONTDUMP;
+	ret = remap_pfn_range(vma, vma->vm_start,
+			virt_to_phys(shm) >> PAGE_SHIFT, PAGE_SIZE,
+			vma->vm_page_prot);
+	if (ret)
+		return ret;
+
+	vma->vm_ops = &rpi_pwm_vm_ops;
+	rpi_pwm_vm_open(vma);
+	return 0;
+}
+
+static const struct file_operations rpi_pwm_fops = {
+	.owner		= THIS_MODULE,
+	.open		= nonseekable_open,
+	.read		= rpi_pwm_read,
+	.write		= rpi_pwm_write,
+	.unlocked_ioctl	= rpi_pwm_ioctl,
+	.mmap		= rpi_pwm_mmap,
+	.llseek		= no_llseek,
+};
+
+static struct miscdevice rpi_pwm_misc = {
+	.minor	= MISC_DYNAMIC_MINOR,
+	.name	= PWM_DEV_NAME,
+	.fops	= &rpi_pwm_fops,
 };
 
 
@@ -722,6 +1806,25 @@ int rpi_pwm_init(void)
 
 //	pr_info("Adafruit Industries' Raspberry Pi PWM driver v%s\n", RPI_PWM_VERSION);
 
+	for (pwm=0; pwm<ARRAY_SIZE(pwms); pwm++) {
+		pwms[pwm].gpio = gpios[pwm];
+		pwms[pwm].alt = rpi_pwm_pin_alt(pwm, gpios[pwm]);
+		if (pwms[pwm].alt < 0) {
+			pr_err("%s: GPIO%d has no PWM%d function\n",
+				PWM_CLASS_NAME, gpios[pwm], pwm);
+			return -EINVAL;
+		}
+	}
+
+	//Registros mapeados antes de que sysfs pueda usarlos
+	clk_reg = ioremap(CLOCK_BASE, 1024);
+	pwm_reg = ioremap(PWM_BASE, 1024);
+	gpio_reg = ioremap(GPIO_BASE, 1024);
+	if (!clk_reg || !pwm_reg || !gpio_reg) {
+		ret = -ENOMEM;
+		goto out0;
+	}
+
 	//Registramos el dispositivo en sysfs
 	ret = class_register(&pwm_class);
 	if (ret < 0) {
@@ -734,6 +1837,12 @@ int rpi_pwm_init(void)
 	for (pwm=0; pwm<ARRAY_SIZE(pwms); pwm++) {
 		//identificador del pwm
 		pwms[pwm].id = pwm;
+		mutex_init(&pwms[pwm].lock);
+		seqcount_init(&pwms[pwm].seq);
+		spin_lock_init(&pwms[pwm].reg_lock);
+		hrtimer_init(&pwms[pwm].latch_timer, CLOCK_MONOTONIC,
+				HRTIMER_MODE_ABS);
+		pwms[pwm].latch_timer.function = rpi_pwm_latch_cb;
 
 		/**********************************************************************/
 		/* struct device * device_create(apuntador de la estructura clase que */
@@ -747,6 +1856,7 @@ int rpi_pwm_init(void)
 		if (IS_ERR(pwms[pwm].dev)) {
 			pr_err("%s: device_create failed\n", pwm_class.name);
 			ret = PTR_ERR(pwms[pwm].dev);
+			pwms[pwm].dev = NULL;
 			goto out1;
 		}
 	}
@@ -764,10 +1874,29 @@ int rpi_pwm_init(void)
 		pwms[pwm].loaded = 1;
 	}
 
+	//Pagina de control, antes de que /dev/rpi-pwm se pueda mapear
+	if (!shm_period_us) {
+		ret = -EINVAL;
+		goto out2;
+	}
+	shm = (struct rpi_pwm_shm *)get_zeroed_page(GFP_KERNEL);
+	if (!shm) {
+		ret = -ENOMEM;
+		goto out2;
+	}
+	shm->version = RPI_PWM_SHM_VERSION;
+	shm->period_ns = shm_period_us * NSEC_PER_USEC;
+	hrtimer_init(&shm_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	shm_timer.function = shm_timer_cb;
+
+	ret = misc_register(&rpi_pwm_misc);
+	if (ret < 0) {
+		pr_err("%s: Unable to register /dev/%s\n", pwm_class.name,
+			PWM_DEV_NAME);
+		free_page((unsigned long)shm);
+		goto out2;
+	}
 
-	clk_reg = ioremap(CLOCK_BASE, 1024);
-	pwm_reg = ioremap(PWM_BASE, 1024);
-	gpio_reg = ioremap(GPIO_BASE, 1024);
 	return 0;
 
 out2:
@@ -782,18 +1911,31 @@ out1:
 			device_unregister(pwms[pwm].dev);
 	class_unregister(&pwm_class);
 out0:
+	if (gpio_reg)
+		iounmap(gpio_reg);
+	if (pwm_reg)
+		iounmap(pwm_reg);
+	if (clk_reg)
+		iounmap(clk_reg);
 	return ret;
 }
 
 void rpi_pwm_cleanup(void)
 {
 	int pwm;
+
+	//Sin mapeos (cada uno tiene abierto el archivo), el timer esta parado
+	misc_deregister(&rpi_pwm_misc);
+	free_page((unsigned long)shm);
 	for (pwm=0; pwm<ARRAY_SIZE(pwms); pwm++) {
 		if (pwms[pwm].loaded) {
+			mutex_lock(&pwms[pwm].lock);
 			rpi_pwm_deactivate(&pwms[pwm]);
+			mutex_unlock(&pwms[pwm].lock);
 			sysfs_remove_group(&pwms[pwm].dev->kobj,
 						 &rpi_pwm_attribute_group);
 		}
+		hrtimer_cancel(&pwms[pwm].latch_timer);
 		if (pwms[pwm].dev)
 			device_unregister(pwms[pwm].dev);
 	}
@@ -805,7 +1947,7 @@ void rpi_pwm_cleanup(void)
 	class_unregister(&pwm_class);
 }
 
-module_init(r_int_config);
+module_init(r_init);
 module_exit(r_cleanup);
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("Sean Cross <xobs@xoblo.gs> for Adafruit Industries <www.adafruit.com>");
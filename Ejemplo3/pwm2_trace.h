@@ -0,0 +1,80 @@
+/* Tracepoints del driver rpi-pwm
+ *
+ * echo 1 > /sys/kernel/debug/tracing/events/rpi_pwm/enable
+ *
+ * Deshabilitados no cuestan nada, los argumentos solo se evaluan
+ * cuando el evento esta activo.
+ */
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM rpi_pwm
+
+#if !defined(_PWM2_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _PWM2_TRACE_H
+
+#include <linux/tracepoint.h>
+
+DECLARE_EVENT_CLASS(rpi_pwm_irq,
+	TP_PROTO(int irq, int power),
+	TP_ARGS(irq, power),
+	TP_STRUCT__entry(
+		__field(int, irq)
+		__field(int, power)
+	),
+	TP_fast_assign(
+		__entry->irq = irq;
+		__entry->power = power;
+	),
+	TP_printk("irq=%d power=%d", __entry->irq, __entry->power)
+);
+
+DEFINE_EVENT(rpi_pwm_irq, rpi_pwm_irq_entry,
+	TP_PROTO(int irq, int power),
+	TP_ARGS(irq, power)
+);
+
+DEFINE_EVENT(rpi_pwm_irq, rpi_pwm_irq_exit,
+	TP_PROTO(int irq, int power),
+	TP_ARGS(irq, power)
+);
+
+/* Escritura de un registro PWM o de reloj, reg es el nombre de la macro */
+TRACE_EVENT(rpi_pwm_reg_write,
+	TP_PROTO(const char *reg, u32 value),
+	TP_ARGS(reg, value),
+	TP_STRUCT__entry(
+		__string(reg, reg)
+		__field(u32, value)
+	),
+	TP_fast_assign(
+		__assign_str(reg, reg);
+		__entry->value = value;
+	),
+	TP_printk("%s=0x%08x", __get_str(reg), __entry->value)
+);
+
+/* SET_GPIO_ALT, fsel es el valor escrito en el registro GPFSELn */
+TRACE_EVENT(rpi_pwm_gpio_alt,
+	TP_PROTO(int gpio, int alt, u32 fsel),
+	TP_ARGS(gpio, alt, fsel),
+	TP_STRUCT__entry(
+		__field(int, gpio)
+		__field(int, alt)
+		__field(u32, fsel)
+	),
+	TP_fast_assign(
+		__entry->gpio = gpio;
+		__entry->alt = alt;
+		__entry->fsel = fsel;
+	),
+	TP_printk("gpio=%d alt=%d GPFSEL%d=0x%08x",
+		__entry->gpio, __entry->alt, __entry->gpio / 10, __entry->fsel)
+);
+
+#endif /* _PWM2_TRACE_H */
+
+/* se encuentra con CFLAGS_pwm2.o := -I$(src) */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE pwm2_trace
+#include <trace/define_trace.h>
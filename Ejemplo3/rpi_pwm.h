@@ -0,0 +1,104 @@
+/* Interfaz binaria de /dev/rpi-pwm
+ *
+ * Un solo ioctl (o write) aplica un juego completo de parametros a uno o
+ * a los dos canales y los programa una vez, sin pasar por un archivo de
+ * sysfs por parametro. RPI_PWM_IOC_GET (o read) devuelve el estado de los
+ * dos canales en la misma estructura. Comun al modulo y a los programas
+ * de usuario.
+ */
+#ifndef _RPI_PWM_H
+#define _RPI_PWM_H
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+#define RPI_PWM_CHANNELS	2
+
+/* Modos, los mismos de /sys/class/rpi-pwm/pwmN/mode */
+#define RPI_PWM_MODE_PWM	0
+#define RPI_PWM_MODE_SERVO	1
+#define RPI_PWM_MODE_AUDIO	2	/* solo lectura */
+
+/* Campos de rpi_pwm_params que se cambian (set) */
+#define RPI_PWM_SET_MODE	(1 << 0)
+#define RPI_PWM_SET_ACTIVE	(1 << 1)
+#define RPI_PWM_SET_MCF		(1 << 2)
+#define RPI_PWM_SET_FREQUENCY	(1 << 3)
+#define RPI_PWM_SET_DUTY	(1 << 4)
+#define RPI_PWM_SET_SERVO	(1 << 5)
+#define RPI_PWM_SET_SERVO_MAX	(1 << 6)
+
+struct rpi_pwm_params {
+	__u32 set;		/* RPI_PWM_SET_*, no se usa en GET */
+	__u32 mode;		/* RPI_PWM_MODE_* */
+	__u32 active;		/* 0 o 1 */
+	__u32 mcf;		/* frecuencia comun pedida, Hz */
+	__u32 frequency;	/* Hz */
+	__u32 duty;		/* %, 1 a 99 */
+	__u32 servo;		/* 0 a servo_max */
+	__u32 servo_max;
+	__u32 real_mcf;		/* solo lectura: 19.2 MHz / divisor */
+	__u32 pad;
+};
+
+/* Con sync los dos canales arrancan en fase tras aplicar los parametros,
+ * como /sys/class/rpi-pwm/sync, y el campo active no se usa */
+#define RPI_PWM_F_SYNC		(1 << 0)
+
+struct rpi_pwm_config {
+	__u32 channels;		/* bit N: ch[N] se aplica (en GET, los validos) */
+	__u32 flags;		/* RPI_PWM_F_* */
+	struct rpi_pwm_params ch[RPI_PWM_CHANNELS];
+};
+
+#define RPI_PWM_IOC_MAGIC	'p'
+/* estado de los dos canales */
+#define RPI_PWM_IOC_GET		_IOR(RPI_PWM_IOC_MAGIC, 1, struct rpi_pwm_config)
+/* aplica los canales de channels: todo se valida antes de tocar nada */
+#define RPI_PWM_IOC_SET		_IOW(RPI_PWM_IOC_MAGIC, 2, struct rpi_pwm_config)
+
+/* Pagina de control: mmap de /dev/rpi-pwm con MAP_SHARED, una pagina con
+ * offset 0.
+ * El programa escribe rng y dat de un canal sin llamadas al sistema y el
+ * modulo los lleva a PWM_RNGn/PWM_DATn cada period_ns, solo si el canal
+ * esta encendido. seq funciona como un seqlock:
+ *
+ *	c->seq++;		impar: escribiendo
+ *	__sync_synchronize();
+ *	c->rng = rng;
+ *	c->dat = dat;
+ *	__sync_synchronize();
+ *	c->seq++;		par: listo
+ *
+ * Cuando ack == seq el valor ya esta en los registros, o a mitad de
+ * periodo espera al siguiente (deferred cuenta esas esperas). Los valores
+ * de la pagina no cambian duty ni frequency de sysfs */
+#define RPI_PWM_SHM_VERSION	1
+
+struct rpi_pwm_shm_chan {
+	__u32 seq;		/* programa */
+	__u32 rng;		/* programa: periodo en ciclos de clock_hz */
+	__u32 dat;		/* programa: ciclos en alto, <= rng */
+	__u32 ack;		/* modulo: ultimo seq aplicado */
+	__u32 clock_hz;		/* modulo: 19.2 MHz / divisor del canal */
+	__u32 errors;		/* modulo: valores rechazados, rng 0 o dat > rng */
+	__u32 deferred;		/* modulo: escrituras que esperaron al limite
+				 * del periodo, tambien las de sysfs */
+	__u32 pad;
+};
+
+struct rpi_pwm_shm {
+	__u32 version;		/* RPI_PWM_SHM_VERSION */
+	__u32 period_ns;	/* cada cuanto lee el modulo la pagina */
+	__u32 pad[2];
+	struct rpi_pwm_shm_chan ch[RPI_PWM_CHANNELS];
+};
+
+/*
+ * read() devuelve una struct rpi_pwm_config como GET y write() acepta una
+ * como SET, el tamano debe ser exactamente sizeof(struct rpi_pwm_config).
+ * read() da la struct una vez por apertura y despues fin de fichero: para
+ * leer el estado otra vez, RPI_PWM_IOC_GET o abrir de nuevo.
+ */
+
+#endif /* _RPI_PWM_H */
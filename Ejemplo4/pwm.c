@@ -3,6 +3,7 @@ Constantes que definen el dispositivo
 */
 #define pwm_embedded_VERSION "0.1"
 #define PWM_CLASS_NAME "pwm-embedded"
+#define PWM_DEV_NAME "pwm-embedded"
 
 /*
 Bibliotecas necesarias para el desarrollo
@@ -17,9 +18,21 @@ Bibliotecas necesarias para el desarrollo
 #include <linux/platform_device.h>
 #include <linux/init.h>
 #include <linux/mutex.h>
+#include <linux/seqlock.h>
+#include <linux/miscdevice.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/mm.h>
+#include <linux/workqueue.h>
 #include <asm/uaccess.h>
 #include <linux/sysfs.h>
 
+#include "pwm_embedded.h"
+
+#define CREATE_TRACE_POINTS
+#include "pwm_trace.h"
+
 /*
 Definiciones para el manejo de las direcciones GPIO del chip BCM2708:
 BCM2708_PERI_BASE: Direccion inicial para el manejo de GPIO
@@ -38,13 +51,18 @@ https://cdn-shop.adafruit.com/product-files/2885/BCM2835Datasheet.pdf
 Definiciones para el manejo  del GPIO
 GPIO_REG: Selecciona el GPIO a usar en este caso sera 18
 SET_GPIO_ALT: Seleccion de las funciones alternas asignadas al GPIO en este caso sera la funcion 5 que habilita el PWM
+Si el pin ya tiene esa funcion (ver fsel_shadow) no se accede al registro
 */
 #define GPIO_REG(g) (gpio_reg+((g/10)*4))
-#define SET_GPIO_ALT(g,a) \
-	__raw_writel( 							\
-		(((a)<=3?(a)+4:(a)==4?3:2)<<(((g)%10)*3))		\
-		| (__raw_readl(GPIO_REG(g)) & (~(7<<(((g)%10)*3)))),	\
-		GPIO_REG(g))
+#define SET_GPIO_ALT(g,a) do {						\
+	if (fsel_shadow[g] != (a)) {					\
+		u32 __fsel = (((a)<=3?(a)+4:(a)==4?3:2)<<(((g)%10)*3))	\
+			| (__raw_readl(GPIO_REG(g)) & (~(7<<(((g)%10)*3))));\
+		trace_pwm_embedded_gpio_alt(g, a, __fsel);		\
+		__raw_writel(__fsel, GPIO_REG(g));			\
+		fsel_shadow[g] = (a);					\
+	}								\
+} while (0)
 /*
 Definicion de los registros para el manejo del PWM, para mas informacion consultar el datasheet BCM2835 FAMILY BCM2708
 PWM_CTL: Direccion para el control del pwm
@@ -63,13 +81,15 @@ PWM_DAT1: Direccion del manejo de datos para el canal 1
 #define	PWMCLK_CNTL (clk_reg+(40*4))
 #define	PWMCLK_DIV  (clk_reg+(41*4))
 /*
-Definicion para convertir string a long
+Escritura de registro a traves de su copia shadow_<registro>: solo llega
+al bus (y al tracepoint pwm_embedded_reg_write) si el valor cambia.
+Devuelve 1 si se escribio
 */
-#define strict_strtol   kstrtol
+#define REG_WRITE(v,r) reg_commit(&shadow_##r, (v), r, #r)
 /*
-Definicion de bloqueo
+Definicion para convertir string a long
 */
-static DEFINE_MUTEX(sysfs_lock);
+#define strict_strtol   kstrtol
 /*
 Apuntadores de memoria a los registros
 pwm_reg
@@ -80,6 +100,68 @@ static void __iomem *pwm_reg;
 static void __iomem *gpio_reg;
 static void __iomem *clk_reg;
 
+/*
+Cache de registros: ultimo valor escrito en cada registro PWM y de reloj.
+El driver se asume dueno de estos bloques, la cache se invalida al activar
+el PWM por si otro codigo los modifico mientras estaba apagado
+*/
+struct reg_shadow {
+	u32 val;
+	int valid;
+};
+
+static struct reg_shadow shadow_PWM_CTL;
+static struct reg_shadow shadow_PWM_RNG1;
+static struct reg_shadow shadow_PWM_DAT1;
+static struct reg_shadow shadow_PWMCLK_CNTL;
+static struct reg_shadow shadow_PWMCLK_DIV;
+
+/*
+Funcion de cada GPIO segun la ultima seleccion, -1 si no se conoce.
+Solo se guarda la funcion del pin y no el registro GPFSEL completo: los
+demas pines del registro pueden pertenecer a otros drivers, por eso un
+cambio de funcion sigue leyendo el registro antes de escribirlo
+*/
+static s8 fsel_shadow[54] = { [0 ... 53] = -1 };
+
+static int reg_commit(struct reg_shadow *sh, u32 val, void __iomem *reg,
+		const char *name) {
+	if (sh->valid && sh->val == val)
+		return 0;
+	trace_pwm_embedded_reg_write(name, val);
+	__raw_writel(val, reg);
+	sh->val = val;
+	sh->valid = 1;
+	return 1;
+}
+
+static DEFINE_SPINLOCK(dat_lock);
+
+/*
+Con dat_lock, los timers leen y escriben la misma cache
+*/
+static void reg_shadow_invalidate(void) {
+	unsigned long flags;
+
+	spin_lock_irqsave(&dat_lock, flags);
+	shadow_PWM_CTL.valid = 0;
+	shadow_PWM_RNG1.valid = 0;
+	shadow_PWM_DAT1.valid = 0;
+	shadow_PWMCLK_CNTL.valid = 0;
+	shadow_PWMCLK_DIV.valid = 0;
+	spin_unlock_irqrestore(&dat_lock, flags);
+}
+
+/*
+El reloj corre con el divisor dado y el PWM esta habilitado
+*/
+static int pwm_clock_running(u32 divisor) {
+	return shadow_PWM_CTL.valid && shadow_PWM_CTL.val == 0x81 &&
+		shadow_PWMCLK_CNTL.valid && shadow_PWMCLK_CNTL.val == 0x5A000011 &&
+		shadow_PWMCLK_DIV.valid &&
+		shadow_PWMCLK_DIV.val == (0x5A000000 | (divisor<<12));
+}
+
 /*
 atributos del pwm
 duty: el ciclo de trabajo 0 a 50%
@@ -101,8 +183,46 @@ struct pwm_embedded {
 
 	u32 divisor;
 	u32 mcf;
+
+	struct mutex lock;
+	seqcount_t seq;
+
+	u32 shm_seq;
 };
 
+/*
+Bloqueo por dispositivo: lock serializa a los escritores (stores de sysfs)
+y seq permite a los lectores (shows) copiar la configuracion sin tomar el
+mutex, un lector que sondea no retrasa al que controla el PWM.
+Los cambios de campos van entre pwm_embedded_cfg_begin y _end
+*/
+static inline void pwm_embedded_cfg_begin(struct pwm_embedded *dev) {
+	preempt_disable();
+	write_seqcount_begin(&dev->seq);
+}
+
+static inline void pwm_embedded_cfg_end(struct pwm_embedded *dev) {
+	write_seqcount_end(&dev->seq);
+	preempt_enable();
+}
+
+/*
+Lectura sin bloqueo: stmt se repite si un escritor cambio el dispositivo
+*/
+#define PWM_READ(dev, stmt) do {					\
+	unsigned int __seq;						\
+	do {								\
+		__seq = read_seqcount_begin(&(dev)->seq);		\
+		stmt;							\
+	} while (read_seqcount_retry(&(dev)->seq, __seq));		\
+} while (0)
+
+static void pwm_embedded_set_active(struct pwm_embedded *dev, int on) {
+	pwm_embedded_cfg_begin(dev);
+	dev->active = on;
+	pwm_embedded_cfg_end(dev);
+}
+
 /*
 Arreglo para definir mas de un pwm, en este caso solo se manejara GPIO18
 */
@@ -117,11 +237,13 @@ static struct pwm_embedded pwms[] = {
 Funcion para definir el timer para obtener el nuevo divisor de frecuencia
 */
 static int pwm_embedded_set_clk(struct pwm_embedded *dev, u32 mcf) {
+	u32 divisor;
+
 	/* 
 	Se detiene el reloj y esperamos un tiempo ante de detener el reloj
 	*/
-	__raw_writel(0x5A000000 | (1 << 5), PWMCLK_CNTL);
-	udelay(10);  
+	if (REG_WRITE(0x5A000000 | (1 << 5), PWMCLK_CNTL))
+		udelay(10);
 
 	if (!dev->mcf) {
 		dev_err(dev->dev, "MCF no definido\n");
@@ -131,59 +253,305 @@ static int pwm_embedded_set_clk(struct pwm_embedded *dev, u32 mcf) {
 	/* 
 		Se fija la frecuencia
 	*/
-	dev->divisor = 19200000 / mcf;
-	if (dev->divisor < 1 || dev->divisor > 0x1000) {
-		dev_err(dev->dev, "divisor fuera de rango: %x\n", dev->divisor);
+	divisor = 19200000 / mcf;
+	if (divisor < 1 || divisor > 0x1000) {
+		dev_err(dev->dev, "divisor fuera de rango: %x\n", divisor);
 		return -ERANGE;
 	}
-	__raw_writel(0x5A000000 | (dev->divisor<<12), PWMCLK_DIV);
+	REG_WRITE(0x5A000000 | (divisor<<12), PWMCLK_DIV);
 	
 	/* 
 		Habilitamos el reloj del PWM
 	*/
-	__raw_writel(0x5A000011, PWMCLK_CNTL);
+	REG_WRITE(0x5A000011, PWMCLK_CNTL);
+
+	pwm_embedded_cfg_begin(dev);
+	dev->divisor = divisor;
+	pwm_embedded_cfg_end(dev);
 
 	return 0;
 }
 
 /*
-Funcion para definir la frecuencia de salida del PWM
+RNG1 y DAT1, tambien desde el timer de la pagina de control, con dat_lock.
+Si el rango baja se escribe primero DAT para no pasar por DAT > RNG
 */
-static int pwm_embedded_set_frequency(struct pwm_embedded *dev) {
-	unsigned long RNG, DAT;
-	int ret;
+
+/*
+Escritura en el limite del periodo: el bloque PWM no avisa del fin de
+periodo y RNG1/DAT1 cambian en cuanto se escriben, a mitad de periodo la
+salida da un pulso corto o uno estirado. Con el PWM en marcha solo se
+escriben al principio de un periodo, antes de que el contador llegue al
+DAT viejo o al nuevo; fuera de esa ventana latch_timer los escribe en el
+siguiente periodo.
+El periodo se cuenta desde latch_epoch, el arranque en PWM_CTL, con el
+reloj del sistema (mismo cristal de 19.2 MHz). Los tiempos van en
+doceavos de ns: un ciclo del reloj PWM son 625 * divisor, sin redondeo.
+Todo con dat_lock
+*/
+static uint latch_guard_us = 4;
+module_param(latch_guard_us, uint, 0444);
+MODULE_PARM_DESC(latch_guard_us, "margen alrededor del limite del periodo (us)");
+
+/*
+Periodos que latch_timer espera a la ventana antes de escribir igual
+*/
+#define LATCH_TRIES 8
+
+static int pwm_running;
+static u64 latch_epoch;
+static struct hrtimer latch_timer;
+static int latch_pending;
+static int latch_tries;
+static u32 latch_rng;
+static u32 latch_dat;
+static u32 latch_deferred;
+static u32 latch_missed;
+
+/*
+Escritura de PWM_CTL, con el lock del dispositivo y dat_lock para la
+cache. Al arrancar el PWM empieza un periodo
+*/
+static int pwm_embedded_ctl_commit(u32 ctl) {
+	unsigned long flags;
+	int start, ret;
+
+	spin_lock_irqsave(&dat_lock, flags);
+	start = !shadow_PWM_CTL.valid || shadow_PWM_CTL.val != 0x81;
+	ret = REG_WRITE(ctl, PWM_CTL);
+	if (ret) {
+		pwm_running = ctl == 0x81;
+		if (pwm_running && start)
+			latch_epoch = ktime_to_ns(ktime_get()) * 12;
+	}
+	spin_unlock_irqrestore(&dat_lock, flags);
+	return ret;
+}
+
+/*
+1 si RNG1/DAT1 se pueden escribir ya, si no *next es cuando empieza la
+siguiente ventana
+*/
+static int pwm_embedded_latch_window(u32 RNG, u32 DAT, ktime_t *next) {
+	u64 cycle = 625 * (u64)pwms[0].divisor;
+	u64 guard = (u64)latch_guard_us * NSEC_PER_USEC * 12;
+	u64 period, limit, now, elapsed, t;
+
+	if (!pwm_running || !shadow_PWM_RNG1.valid || !shadow_PWM_DAT1.valid)
+		return 1;
+	if (shadow_PWM_RNG1.val == RNG && shadow_PWM_DAT1.val == DAT)
+		return 1;
+
+	period = shadow_PWM_RNG1.val * cycle;
+	limit = min(DAT, shadow_PWM_DAT1.val) * cycle;
 	/*
-		Deshabilitamos el PWM
+	Pulso demasiado corto para acertar la ventana, se escribe ya
 	*/
-	__raw_writel(0, PWM_CTL);
+	if (limit <= 2 * guard)
+		return 1;
+
+	now = ktime_to_ns(ktime_get()) * 12;
+	if (now > latch_epoch)
+		latch_epoch += div64_u64(now - latch_epoch, period) * period;
+	elapsed = now > latch_epoch ? now - latch_epoch : 0;
+	if (elapsed >= guard && elapsed + guard < limit)
+		return 1;
+
+	t = latch_epoch + guard;
+	if (elapsed >= guard)
+		t += period;
+	*next = ns_to_ktime(div_u64(t + 11, 12));
+	return 0;
+}
 
-	/* 
-		Dejamos un tiempo para que se deshabilite de forma correcta
-	*/
-	udelay(10);
+static void pwm_embedded_write_regs(u32 RNG, u32 DAT) {
+	if (shadow_PWM_RNG1.valid && RNG < shadow_PWM_RNG1.val) {
+		REG_WRITE(DAT, PWM_DAT1);
+		REG_WRITE(RNG, PWM_RNG1);
+	} else {
+		REG_WRITE(RNG, PWM_RNG1);
+		REG_WRITE(DAT, PWM_DAT1);
+	}
+}
+
+/*
+Escribe ya o deja los valores a latch_timer, los ultimos ganan. Con
+dat_lock
+*/
+static void pwm_embedded_latch_chan(u32 RNG, u32 DAT) {
+	ktime_t next;
+
+	if (pwm_embedded_latch_window(RNG, DAT, &next)) {
+		latch_pending = 0;
+		pwm_embedded_write_regs(RNG, DAT);
+	} else {
+		latch_rng = RNG;
+		latch_dat = DAT;
+		latch_deferred++;
+		if (!latch_pending) {
+			latch_pending = 1;
+			latch_tries = 0;
+			hrtimer_start(&latch_timer, next, HRTIMER_MODE_ABS);
+		}
+	}
+}
+
+static void pwm_embedded_write_chan(u32 RNG, u32 DAT) {
+	unsigned long flags;
+
+	spin_lock_irqsave(&dat_lock, flags);
+	pwm_embedded_latch_chan(RNG, DAT);
+	spin_unlock_irqrestore(&dat_lock, flags);
+}
+
+static enum hrtimer_restart latch_timer_cb(struct hrtimer *t) {
+	enum hrtimer_restart ret = HRTIMER_NORESTART;
+	unsigned long flags;
+	ktime_t next;
+
+	spin_lock_irqsave(&dat_lock, flags);
+	if (latch_pending) {
+		if (pwm_embedded_latch_window(latch_rng, latch_dat, &next))
+			ret = HRTIMER_NORESTART;
+		else if (++latch_tries < LATCH_TRIES) {
+			/*
+			El timer llego tarde a la ventana, otro periodo
+			*/
+			hrtimer_set_expires(t, next);
+			ret = HRTIMER_RESTART;
+		}
+		else
+			latch_missed++;
+
+		if (ret == HRTIMER_NORESTART) {
+			latch_pending = 0;
+			pwm_embedded_write_regs(latch_rng, latch_dat);
+		}
+	}
+	spin_unlock_irqrestore(&dat_lock, flags);
+	return ret;
+}
+
+/*
+Duty desde otro modulo (gpio_rules), tambien desde una interrupcion. Con
+el PWM en marcha DAT1 cambia ya, por el mismo camino que sysfs (cache,
+dat_lock y limite del periodo); el campo duty, que pide el mutex del
+dispositivo, se actualiza despues desde duty_work
+*/
+static struct work_struct duty_work;
+static u32 duty_pending;
+
+static void pwm_embedded_duty_work(struct work_struct *work) {
+	struct pwm_embedded *dev = &pwms[0];
+
+	mutex_lock(&dev->lock);
+	pwm_embedded_cfg_begin(dev);
+	dev->duty = READ_ONCE(duty_pending);
+	pwm_embedded_cfg_end(dev);
+	mutex_unlock(&dev->lock);
+}
+
+int pwm_embedded_set_duty(unsigned int channel, u32 duty) {
+	unsigned long flags;
+	u32 RNG, DAT;
+	int ret = 0;
+
+	if (channel >= ARRAY_SIZE(pwms) || duty < 1 || duty > 99)
+		return -EINVAL;
 
-	ret = pwm_embedded_set_clk(dev, dev->mcf);
+	spin_lock_irqsave(&dat_lock, flags);
+	if (!pwm_running || !shadow_PWM_RNG1.valid)
+		ret = -ENODEV;
+	else {
+		/*
+		Un cambio de frecuencia pendiente en latch_timer manda: el duty
+		no toca el rango
+		*/
+		RNG = latch_pending ? latch_rng : shadow_PWM_RNG1.val;
+		DAT = div_u64((u64)RNG * duty, 100);
+		if (DAT < 1)
+			ret = -ERANGE;
+		else
+			pwm_embedded_latch_chan(RNG, DAT);
+	}
+	spin_unlock_irqrestore(&dat_lock, flags);
 	if (ret)
 		return ret;
 
-	RNG = dev->mcf/dev->frequency;
-	DAT = RNG*dev->duty/100;
+	WRITE_ONCE(duty_pending, duty);
+	schedule_work(&duty_work);
+	return 0;
+}
+EXPORT_SYMBOL_GPL(pwm_embedded_set_duty);
+
+/*
+Funcion para definir la frecuencia de salida del PWM
+Si el PWM ya esta corriendo y el divisor no cambia solo se escriben
+RNG1 y/o DAT1, en el limite del periodo: el reloj no se detiene y la
+salida no tiene glitch.
+El reloj solo se reprograma cuando cambia el divisor.
+*/
+static int pwm_embedded_calc(struct pwm_embedded *dev, u32 *divisor,
+		unsigned long *RNG, unsigned long *DAT) {
+
+	if (!dev->mcf || !dev->frequency) {
+		dev_err(dev->dev, "MCF o frecuencia no definidos\n");
+		return -EINVAL;
+	}
 
-	if (RNG < 1) {
-		dev_err(dev->dev, "RNG fuera de rango: %ld<1\n", RNG);
+	*divisor = 19200000 / dev->mcf;
+	if (*divisor < 1 || *divisor > 0x1000) {
+		dev_err(dev->dev, "divisor fuera de rango: %x\n", *divisor);
 		return -ERANGE;
 	}
 
-	if (DAT < 1) {
-		dev_err(dev->dev, "DAT fuera de rango: %ld<1\n", DAT);
+	*RNG = dev->mcf/dev->frequency;
+	*DAT = *RNG*dev->duty/100;
+
+	if (*RNG < 1) {
+		dev_err(dev->dev, "RNG fuera de rango: %ld<1\n", *RNG);
 		return -ERANGE;
 	}
 
-	__raw_writel(RNG, PWM_RNG1);
-	__raw_writel(DAT, PWM_DAT1);
+	if (*DAT < 1) {
+		dev_err(dev->dev, "DAT fuera de rango: %ld<1\n", *DAT);
+		return -ERANGE;
+	}
+	return 0;
+}
 
-	/* Se inicia PWM */
-	__raw_writel(0x81, PWM_CTL);
+static int pwm_embedded_set_frequency(struct pwm_embedded *dev) {
+	unsigned long RNG, DAT;
+	u32 divisor;
+	int ret;
+
+	ret = pwm_embedded_calc(dev, &divisor, &RNG, &DAT);
+	if (ret)
+		return ret;
+
+	if (pwm_clock_running(divisor)) {
+		/*
+			Camino rapido: el reloj sigue corriendo, la cache omite
+			los registros sin cambio
+		*/
+		pwm_embedded_write_chan(RNG, DAT);
+	} else {
+		/*
+			Deshabilitamos el PWM y dejamos un tiempo para que se
+			deshabilite de forma correcta
+		*/
+		if (pwm_embedded_ctl_commit(0))
+			udelay(10);
+
+		ret = pwm_embedded_set_clk(dev, dev->mcf);
+		if (ret)
+			return ret;
+
+		pwm_embedded_write_chan(RNG, DAT);
+
+		/* Se inicia PWM */
+		pwm_embedded_ctl_commit(0x81);
+	}
 
 	return 0;
 }
@@ -198,11 +566,13 @@ static int pwm_embedded_activate(struct pwm_embedded *dev) {
 	/* 
 		seleccionamos la funcion alternativa del GPIO18 PWM
 	*/
+	if (!dev->active)
+		reg_shadow_invalidate();
 	SET_GPIO_ALT(18, 5);
 
 	ret = pwm_embedded_set_frequency(dev);
 
-	dev->active = 1;
+	pwm_embedded_set_active(dev, 1);
 	return ret;
 }
 
@@ -210,13 +580,35 @@ static int pwm_embedded_activate(struct pwm_embedded *dev) {
 Funcion para desactivar PWM
 */
 static int pwm_embedded_deactivate(struct pwm_embedded *dev) {
+	unsigned long flags;
+
+	/*
+	Se para el bloque: pwm_running vuelve a 0, set_duty da -ENODEV y
+	lo que esperaba a latch_timer ya no se escribe
+	*/
+	pwm_embedded_ctl_commit(0);
+	hrtimer_cancel(&latch_timer);
+	spin_lock_irqsave(&dat_lock, flags);
+	latch_pending = 0;
+	spin_unlock_irqrestore(&dat_lock, flags);
+
 	udelay(10);
 	SET_GPIO_ALT(18, 0);
 	udelay(10);
-	dev->active = 1;
+	pwm_embedded_set_active(dev, 0);
 	return 0;
 }
 
+/*
+Funcion para aplicar un cambio de duty, frecuencia o mcf: con el PWM
+activo no se vuelve a seleccionar la funcion del pin
+*/
+static int pwm_embedded_update(struct pwm_embedded *dev) {
+	if (!dev->active)
+		return pwm_embedded_activate(dev);
+	return pwm_embedded_set_frequency(dev);
+}
+
 /*
 	Atributo active
 */
@@ -225,11 +617,10 @@ static ssize_t active_show(struct device *d,
 		struct device_attribute *attr, char *buf)
 {
 	ssize_t ret;
+	int active;
 	struct pwm_embedded *dev = dev_get_drvdata(d);
-	mutex_lock(&sysfs_lock);
-	//ret = sprintf(buf, "%d\n", !!dev->active);
-	ret = sprintf(buf, "%d\n", 1);
-	mutex_unlock(&sysfs_lock);
+	PWM_READ(dev, active = dev->active);
+	ret = sprintf(buf, "%d\n", !!active);
 	return ret;
 }
 
@@ -240,7 +631,7 @@ static ssize_t active_store(struct device *d,
 	long new_active;
 	struct pwm_embedded *dev = dev_get_drvdata(d);
 
-	mutex_lock(&sysfs_lock);
+	mutex_lock(&dev->lock);
 	ret = strict_strtol(buf, 0, &new_active);
 	if (ret == 0) {
 		if (new_active)
@@ -250,7 +641,7 @@ static ssize_t active_store(struct device *d,
 	}
 	else
 		ret = -EINVAL;
-	mutex_unlock(&sysfs_lock);
+	mutex_unlock(&dev->lock);
 	return ret?ret:count;
 }
 
@@ -263,10 +654,10 @@ static ssize_t duty_show(struct device *d,
 		struct device_attribute *attr, char *buf)
 {
 	ssize_t ret;
+	u32 duty;
 	struct pwm_embedded *dev = dev_get_drvdata(d);
-	mutex_lock(&sysfs_lock);
-	ret = sprintf(buf, "%d%%\n", dev->duty);
-	mutex_unlock(&sysfs_lock);
+	PWM_READ(dev, duty = dev->duty);
+	ret = sprintf(buf, "%d%%\n", duty);
 	return ret;
 }
 
@@ -277,18 +668,20 @@ static ssize_t duty_store(struct device *d,
 	long new_duty;
 	struct pwm_embedded *dev = dev_get_drvdata(d);
 
-	mutex_lock(&sysfs_lock);
+	mutex_lock(&dev->lock);
 	ret = strict_strtol(buf, 0, &new_duty);
 	if (ret == 0) {
 		if (new_duty > 0 && new_duty < 100) {
+			pwm_embedded_cfg_begin(dev);
 			dev->duty = new_duty;
+			pwm_embedded_cfg_end(dev);
 
-			pwm_embedded_activate(dev);
+			pwm_embedded_update(dev);
 		}
 		else
 			ret = -ERANGE;
 	}
-	mutex_unlock(&sysfs_lock);
+	mutex_unlock(&dev->lock);
 	return ret?ret:count;
 }
 
@@ -301,10 +694,10 @@ static ssize_t mcf_show(struct device *d,
 		struct device_attribute *attr, char *buf)
 {
 	ssize_t ret;
+	u32 mcf;
 	struct pwm_embedded *dev = dev_get_drvdata(d);
-	mutex_lock(&sysfs_lock);
-	ret = sprintf(buf, "%d\n", dev->mcf);
-	mutex_unlock(&sysfs_lock);
+	PWM_READ(dev, mcf = dev->mcf);
+	ret = sprintf(buf, "%d\n", mcf);
 	return ret;
 }
 
@@ -315,18 +708,20 @@ static ssize_t mcf_store(struct device *d,
 	long new_mcf;
 	struct pwm_embedded *dev = dev_get_drvdata(d);
 
-	mutex_lock(&sysfs_lock);
+	mutex_lock(&dev->lock);
 	ret = strict_strtol(buf, 0, &new_mcf);
 	if (ret == 0) {
 		if (new_mcf > 1 && new_mcf < 100000000) {
+			pwm_embedded_cfg_begin(dev);
 			dev->mcf = new_mcf;
+			pwm_embedded_cfg_end(dev);
 
-			pwm_embedded_activate(dev);
+			pwm_embedded_update(dev);
 		}
 		else
 			ret = -ERANGE;
 	}
-	mutex_unlock(&sysfs_lock);
+	mutex_unlock(&dev->lock);
 	return ret?ret:count;
 }
 
@@ -340,10 +735,8 @@ static ssize_t freq_show(struct device *d,
 {
 	ssize_t ret;
 	struct pwm_embedded *dev = dev_get_drvdata(d);
-	mutex_lock(&sysfs_lock);
 //	ret = sprintf(buf, "%d\n", dev->frequency);
 	ret = sprintf(buf, "%d\n", (int)10);
-	mutex_unlock(&sysfs_lock);
 	return ret;
 }
 
@@ -354,19 +747,41 @@ static ssize_t freq_store(struct device *d,
 	long new_freq;
 	struct pwm_embedded *dev = dev_get_drvdata(d);
 
-	mutex_lock(&sysfs_lock);
+	mutex_lock(&dev->lock);
 	ret = strict_strtol(buf, 0, &new_freq);
 	if (ret == 0) {
+		pwm_embedded_cfg_begin(dev);
 		dev->frequency = new_freq;
+		pwm_embedded_cfg_end(dev);
 
-		pwm_embedded_activate(dev);
+		pwm_embedded_update(dev);
 	}
-	mutex_unlock(&sysfs_lock);
+	mutex_unlock(&dev->lock);
 	return ret?ret:count;
 }
 
 static DEVICE_ATTR(frequency, 0664, freq_show, freq_store);
 
+/*
+Atributos deferred y latch_missed: escrituras de RNG1/DAT1 que esperaron
+al limite del periodo, y las que no lo alcanzaron en LATCH_TRIES periodos
+*/
+static ssize_t deferred_show(struct device *d,
+		struct device_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%u\n", READ_ONCE(latch_deferred));
+}
+
+static DEVICE_ATTR(deferred, 0444, deferred_show, NULL);
+
+static ssize_t latch_missed_show(struct device *d,
+		struct device_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%u\n", READ_ONCE(latch_missed));
+}
+
+static DEVICE_ATTR(latch_missed, 0444, latch_missed_show, NULL);
+
 /*
 Estructura que contiene los atributos de sysfs
 */
@@ -375,6 +790,8 @@ static struct attribute *pwm_embedded_sysfs_entries[] = {
 	&dev_attr_duty.attr,
 	&dev_attr_mcf.attr,
 	&dev_attr_frequency.attr,
+	&dev_attr_deferred.attr,
+	&dev_attr_latch_missed.attr,
 	NULL
 };
 
@@ -394,6 +811,292 @@ static struct class pwm_class = {
 	.owner =	THIS_MODULE,
 };
 
+/*
+Nodo /dev/pwm-embedded: todos los parametros en una sola llamada y una
+sola programacion del PWM (ver pwm_embedded.h)
+*/
+static int pwm_embedded_check(struct pwm_embedded_params *p) {
+	if ((p->set & PWM_EMBEDDED_SET_DUTY) && (p->duty < 1 || p->duty > 99))
+		return -ERANGE;
+	if ((p->set & PWM_EMBEDDED_SET_MCF) &&
+	    (p->mcf < 2 || p->mcf >= 100000000))
+		return -ERANGE;
+	if ((p->set & PWM_EMBEDDED_SET_FREQUENCY) && !p->frequency)
+		return -EINVAL;
+	return 0;
+}
+
+/*
+Prueba p sobre una copia de la configuracion, sin tocar dev: los campos y,
+si el PWM va a quedar encendido, el divisor, RNG1 y DAT1 que saldrian
+*/
+static int pwm_embedded_validate(struct pwm_embedded *dev,
+		struct pwm_embedded_params *p) {
+	struct pwm_embedded cand = {
+		.mcf		= dev->mcf,
+		.frequency	= dev->frequency,
+		.duty		= dev->duty,
+		.dev		= dev->dev,
+	};
+	unsigned long RNG, DAT;
+	u32 divisor;
+	int ret;
+
+	ret = pwm_embedded_check(p);
+	if (ret)
+		return ret;
+	if (!((p->set & PWM_EMBEDDED_SET_ACTIVE) ? p->active : dev->active))
+		return 0;
+
+	if (p->set & PWM_EMBEDDED_SET_MCF)
+		cand.mcf = p->mcf;
+	if (p->set & PWM_EMBEDDED_SET_FREQUENCY)
+		cand.frequency = p->frequency;
+	if (p->set & PWM_EMBEDDED_SET_DUTY)
+		cand.duty = p->duty;
+	return pwm_embedded_calc(&cand, &divisor, &RNG, &DAT);
+}
+
+/*
+Copia los parametros y programa el PWM una vez. Parado y sin pedir active
+solo se guardan los parametros
+*/
+static int pwm_embedded_commit(struct pwm_embedded *dev,
+		struct pwm_embedded_params *p) {
+	int on;
+
+	pwm_embedded_cfg_begin(dev);
+	if (p->set & PWM_EMBEDDED_SET_MCF)
+		dev->mcf = p->mcf;
+	if (p->set & PWM_EMBEDDED_SET_FREQUENCY)
+		dev->frequency = p->frequency;
+	if (p->set & PWM_EMBEDDED_SET_DUTY)
+		dev->duty = p->duty;
+	pwm_embedded_cfg_end(dev);
+
+	on = (p->set & PWM_EMBEDDED_SET_ACTIVE) ? p->active : dev->active;
+	if (on)
+		return pwm_embedded_update(dev);
+	if (dev->active)
+		return pwm_embedded_deactivate(dev);
+	return 0;
+}
+
+static int pwm_embedded_set_config(struct pwm_embedded_config *cfg) {
+	u32 all = BIT(ARRAY_SIZE(pwms)) - 1;
+	int pwm, ret;
+
+	if (!cfg->channels || (cfg->channels & ~all) || cfg->flags)
+		return -EINVAL;
+	/*
+	Todo se prueba, con los registros que saldrian, antes de tocar nada
+	*/
+	for (pwm=0; pwm<ARRAY_SIZE(pwms); pwm++)
+		if (cfg->channels & BIT(pwm))
+			mutex_lock_nested(&pwms[pwm].lock, pwm);
+
+	ret = 0;
+	for (pwm=0; pwm<ARRAY_SIZE(pwms) && !ret; pwm++)
+		if (cfg->channels & BIT(pwm))
+			ret = pwm_embedded_validate(&pwms[pwm], &cfg->ch[pwm]);
+
+	for (pwm=0; pwm<ARRAY_SIZE(pwms) && !ret; pwm++)
+		if (cfg->channels & BIT(pwm))
+			ret = pwm_embedded_commit(&pwms[pwm], &cfg->ch[pwm]);
+
+	for (pwm=ARRAY_SIZE(pwms)-1; pwm>=0; pwm--)
+		if (cfg->channels & BIT(pwm))
+			mutex_unlock(&pwms[pwm].lock);
+	return ret;
+}
+
+/*
+Estado sin bloqueo, igual que los show de sysfs
+*/
+static void pwm_embedded_get_config(struct pwm_embedded_config *cfg) {
+	int pwm;
+
+	memset(cfg, 0, sizeof(*cfg));
+	cfg->channels = BIT(ARRAY_SIZE(pwms)) - 1;
+	for (pwm=0; pwm<ARRAY_SIZE(pwms); pwm++) {
+		struct pwm_embedded *dev = &pwms[pwm];
+		struct pwm_embedded_params *p = &cfg->ch[pwm];
+
+		PWM_READ(dev, {
+			p->active = !!dev->active;
+			p->mcf = dev->mcf;
+			p->frequency = dev->frequency;
+			p->duty = dev->duty;
+			p->divisor = dev->divisor;
+		});
+	}
+}
+
+static ssize_t pwm_embedded_read(struct file *file, char __user *buf,
+		size_t len, loff_t *pos) {
+	struct pwm_embedded_config cfg;
+
+	/*
+	Una struct por apertura y despues fin de fichero, asi cat termina
+	*/
+	if (*pos >= sizeof(cfg))
+		return 0;
+	if (*pos || len < sizeof(cfg))
+		return -EINVAL;
+	pwm_embedded_get_config(&cfg);
+	if (copy_to_user(buf, &cfg, sizeof(cfg)))
+		return -EFAULT;
+	*pos += sizeof(cfg);
+	return sizeof(cfg);
+}
+
+static ssize_t pwm_embedded_write(struct file *file, const char __user *buf,
+		size_t len, loff_t *pos) {
+	struct pwm_embedded_config cfg;
+	int ret;
+
+	if (len != sizeof(cfg))
+		return -EINVAL;
+	if (copy_from_user(&cfg, buf, sizeof(cfg)))
+		return -EFAULT;
+	ret = pwm_embedded_set_config(&cfg);
+	return ret ? ret : len;
+}
+
+static long pwm_embedded_ioctl(struct file *file, unsigned int cmd,
+		unsigned long arg) {
+	struct pwm_embedded_config cfg;
+
+	switch (cmd) {
+	case PWM_EMBEDDED_IOC_GET:
+		pwm_embedded_get_config(&cfg);
+		if (copy_to_user((void __user *)arg, &cfg, sizeof(cfg)))
+			return -EFAULT;
+		return 0;
+	case PWM_EMBEDDED_IOC_SET:
+		if (copy_from_user(&cfg, (void __user *)arg, sizeof(cfg)))
+			return -EFAULT;
+		return pwm_embedded_set_config(&cfg);
+	}
+	return -ENOTTY;
+}
+
+/*
+Pagina de control (mmap): el programa escribe rng/dat con un seq y un
+hrtimer los lleva a los registros, sin una llamada al sistema por cambio
+*/
+static uint shm_period_us = 200;
+module_param(shm_period_us, uint, 0444);
+MODULE_PARM_DESC(shm_period_us, "periodo de lectura de la pagina de control (us)");
+
+static struct pwm_embedded_shm *shm;
+static struct hrtimer shm_timer;
+static DEFINE_MUTEX(shm_lock);
+static int shm_maps;
+
+/*
+Valores nuevos y completos del programa van a RNG1/DAT1 con el PWM
+encendido, si no se quedan para cuando lo este
+*/
+static void pwm_embedded_shm_poll(struct pwm_embedded *dev,
+		struct pwm_embedded_shm_chan *c) {
+	u32 seq, rng, dat;
+
+	seq = READ_ONCE(c->seq);
+	if ((seq & 1) || seq == dev->shm_seq)
+		return;
+	if (!dev->active || !READ_ONCE(pwm_running))
+		return;
+	smp_rmb();
+	rng = READ_ONCE(c->rng);
+	dat = READ_ONCE(c->dat);
+	smp_rmb();
+	if (READ_ONCE(c->seq) != seq)
+		return;
+
+	dev->shm_seq = seq;
+	if (!rng || dat > rng)
+		c->errors++;
+	else
+		pwm_embedded_write_chan(rng, dat);
+	if (dev->divisor)
+		WRITE_ONCE(c->clock_hz, 19200000 / dev->divisor);
+	smp_wmb();
+	WRITE_ONCE(c->ack, seq);
+}
+
+static enum hrtimer_restart shm_timer_cb(struct hrtimer *t) {
+	int pwm;
+
+	for (pwm=0; pwm<ARRAY_SIZE(pwms); pwm++) {
+		pwm_embedded_shm_poll(&pwms[pwm], &shm->ch[pwm]);
+		WRITE_ONCE(shm->ch[pwm].deferred, READ_ONCE(latch_deferred));
+	}
+	hrtimer_forward_now(t, ns_to_ktime((u64)shm_period_us * NSEC_PER_USEC));
+	return HRTIMER_RESTART;
+}
+
+/*
+El timer solo corre mientras la pagina esta mapeada
+*/
+static void pwm_embedded_vm_open(struct vm_area_struct *vma) {
+	mutex_lock(&shm_lock);
+	if (!shm_maps++)
+		hrtimer_start(&shm_timer,
+			ns_to_ktime((u64)shm_period_us * NSEC_PER_USEC),
+			HRTIMER_MODE_REL);
+	mutex_unlock(&shm_lock);
+}
+
+static void pwm_embedded_vm_close(struct vm_area_struct *vma) {
+	mutex_lock(&shm_lock);
+	if (!--shm_maps)
+		hrtimer_cancel(&shm_timer);
+	mutex_unlock(&shm_lock);
+}
+
+static const struct vm_operations_struct pwm_embedded_vm_ops = {
+	.open	= pwm_embedded_vm_open,
+	.close	= pwm_embedded_vm_close,
+};
+
+static int pwm_embedded_mmap(struct file *file, struct vm_area_struct *vma) {
+	int ret;
+
+	if (vma->vm_pgoff || vma->vm_end - vma->vm_start != PAGE_SIZE)
+		return -EINVAL;
+	/* MAP_PRIVATE copiaria la pagina en la primera escritura */
+	if (!(vma->vm_flags & VM_SHARED))
+		return -EINVAL;
+
+	vma->vm_flags |= VM_DONTEXPAND | VM_DONTDUMP;
+	ret = remap_pfn_range(vma, vma->vm_start,
+			virt_to_phys(shm) >> PAGE_SHIFT, PAGE_SIZE,
+			vma->vm_page_prot);
+	if (ret)
+		return ret;
+
+	vma->vm_ops = &pwm_embedded_vm_ops;
+	pwm_embedded_vm_open(vma);
+	return 0;
+}
+
+static const struct file_operations pwm_embedded_fops = {
+	.owner		= THIS_MODULE,
+	.open		= nonseekable_open,
+	.read		= pwm_embedded_read,
+	.write		= pwm_embedded_write,
+	.unlocked_ioctl	= pwm_embedded_ioctl,
+	.mmap		= pwm_embedded_mmap,
+	.llseek		= no_llseek,
+};
+
+static struct miscdevice pwm_embedded_misc = {
+	.minor	= MISC_DYNAMIC_MINOR,
+	.name	= PWM_DEV_NAME,
+	.fops	= &pwm_embedded_fops,
+};
+
 /*
 Funcion para poder llamar el script de usuario
 */
@@ -418,6 +1121,13 @@ int __init pwm_embedded_init(void)
 
 	pr_info("Driver PWM v%s\n", pwm_embedded_VERSION);
 
+	/*
+	 Antes de sysfs, cualquier store puede dejar una escritura al timer
+	*/
+	hrtimer_init(&latch_timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+	latch_timer.function = latch_timer_cb;
+	INIT_WORK(&duty_work, pwm_embedded_duty_work);
+
 	ret = class_register(&pwm_class);
 	if (ret < 0) {
 		pr_err("%s: No se pudo registrar la clase\n", pwm_class.name);
@@ -430,6 +1140,8 @@ int __init pwm_embedded_init(void)
 	*/
 	for (pwm=0; pwm<ARRAY_SIZE(pwms); pwm++) {
 		pwms[pwm].id = pwm;
+		mutex_init(&pwms[pwm].lock);
+		seqcount_init(&pwms[pwm].seq);
 		pwms[pwm].dev = device_create(&pwm_class, &platform_bus,
 				MKDEV(0, 0), &pwms[pwm], "pwm%u", pwm);
 		if (IS_ERR(pwms[pwm].dev)) {
@@ -463,6 +1175,27 @@ int __init pwm_embedded_init(void)
 	pwm_reg = ioremap(PWM_BASE, 1024);
 	gpio_reg = ioremap(GPIO_BASE, 1024);
 
+	/*
+	 El nodo de control se registra con los registros ya mapeados y la
+	 pagina de control lista
+	*/
+	shm = (struct pwm_embedded_shm *)get_zeroed_page(GFP_KERNEL);
+	if (!shm_period_us || !shm) {
+		ret = shm ? -EINVAL : -ENOMEM;
+		goto out3;
+	}
+	shm->version = PWM_EMBEDDED_SHM_VERSION;
+	shm->period_ns = shm_period_us * NSEC_PER_USEC;
+	hrtimer_init(&shm_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	shm_timer.function = shm_timer_cb;
+
+	ret = misc_register(&pwm_embedded_misc);
+	if (ret < 0) {
+		pr_err("%s: No se pudo registrar /dev/%s\n", pwm_class.name,
+			PWM_DEV_NAME);
+		goto out3;
+	}
+
 	udelay(1);  
 	iniciarPWM();
 	return 0;
@@ -470,6 +1203,12 @@ int __init pwm_embedded_init(void)
 /*
 En caso de obtener un error en el flujo de la creacion del pwm se dara roll back segun sea el caso
 */	
+out3:
+	if (shm)
+		free_page((unsigned long)shm);
+	iounmap(gpio_reg);
+	iounmap(pwm_reg);
+	iounmap(clk_reg);
 out2:
 	for (pwm=0; pwm<ARRAY_SIZE(pwms); pwm++)
 		if (pwms[pwm].loaded)
@@ -492,15 +1231,29 @@ Se descarga los direccionamientos de memoria y el sysfs creado
 void __exit pwm_embedded_cleanup(void)
 {
 	int pwm;
+
+	/*
+	 Cada mapeo tiene abierto el archivo: aqui no queda ninguno y el
+	 timer esta parado
+	*/
+	misc_deregister(&pwm_embedded_misc);
+	free_page((unsigned long)shm);
+	/*
+	 gpio_rules tiene una referencia mientras tiene reglas de PWM
+	*/
+	cancel_work_sync(&duty_work);
 	for (pwm=0; pwm<ARRAY_SIZE(pwms); pwm++) {
 		if (pwms[pwm].loaded) {
+			mutex_lock(&pwms[pwm].lock);
 			pwm_embedded_deactivate(&pwms[pwm]);
+			mutex_unlock(&pwms[pwm].lock);
 			sysfs_remove_group(&pwms[pwm].dev->kobj,
 						 &pwm_embedded_attribute_group);
 		}
 		if (pwms[pwm].dev)
 			device_unregister(pwms[pwm].dev);
 	}
+	hrtimer_cancel(&latch_timer);
 
 	iounmap(gpio_reg);
 	iounmap(pwm_reg);
@@ -0,0 +1,121 @@
+/*
+Interfaz binaria de /dev/pwm-embedded
+Un solo ioctl (o write) aplica duty, frecuencia, mcf y active y programa el
+PWM una vez, en lugar de un archivo de sysfs y una programacion por cada
+parametro. PWM_EMBEDDED_IOC_GET (o read) devuelve el estado en la misma
+estructura. Comun al modulo y a los programas de usuario
+*/
+#ifndef _PWM_EMBEDDED_H
+#define _PWM_EMBEDDED_H
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+#define PWM_EMBEDDED_CHANNELS	1
+
+/*
+Campos de pwm_embedded_params que se cambian (set)
+*/
+#define PWM_EMBEDDED_SET_ACTIVE		(1 << 0)
+#define PWM_EMBEDDED_SET_MCF		(1 << 1)
+#define PWM_EMBEDDED_SET_FREQUENCY	(1 << 2)
+#define PWM_EMBEDDED_SET_DUTY		(1 << 3)
+
+/*
+set: PWM_EMBEDDED_SET_*, no se usa en GET
+active: 0 apagado, 1 encendido
+mcf: frecuencia maxima comun, Hz
+frequency: Hz
+duty: ciclo de trabajo en %, 1 a 99
+divisor: solo lectura, divisor del reloj de 19.2 MHz
+*/
+struct pwm_embedded_params {
+	__u32 set;
+	__u32 active;
+	__u32 mcf;
+	__u32 frequency;
+	__u32 duty;
+	__u32 divisor;
+};
+
+/*
+channels: bit N, ch[N] se aplica (en GET, los validos)
+flags: reservado, 0
+*/
+struct pwm_embedded_config {
+	__u32 channels;
+	__u32 flags;
+	struct pwm_embedded_params ch[PWM_EMBEDDED_CHANNELS];
+};
+
+#define PWM_EMBEDDED_IOC_MAGIC	'e'
+/*
+Estado de los canales
+*/
+#define PWM_EMBEDDED_IOC_GET	_IOR(PWM_EMBEDDED_IOC_MAGIC, 1, struct pwm_embedded_config)
+/*
+Aplica los canales de channels, todo se valida antes de tocar el PWM
+*/
+#define PWM_EMBEDDED_IOC_SET	_IOW(PWM_EMBEDDED_IOC_MAGIC, 2, struct pwm_embedded_config)
+
+/*
+Pagina de control: mmap de /dev/pwm-embedded con MAP_SHARED, una pagina con
+offset 0.
+El programa escribe rng y dat sin llamadas al sistema y el modulo los
+lleva a PWM_RNG1/PWM_DAT1 cada period_ns, solo con el PWM encendido.
+seq funciona como un seqlock, impar mientras el programa escribe:
+
+	c->seq++;
+	__sync_synchronize();
+	c->rng = rng;
+	c->dat = dat;
+	__sync_synchronize();
+	c->seq++;
+
+Cuando ack == seq el valor ya esta en los registros, o a mitad de periodo
+espera al siguiente (deferred cuenta esas esperas). Los valores de la
+pagina no cambian duty ni frequency de sysfs
+*/
+#define PWM_EMBEDDED_SHM_VERSION	1
+
+/*
+seq, rng, dat: los escribe el programa; rng es el periodo en ciclos de
+clock_hz y dat los ciclos en alto, dat <= rng
+ack, clock_hz, errors, deferred: los escribe el modulo; errors cuenta los
+valores rechazados (rng 0 o dat > rng) y deferred las escrituras que
+esperaron al limite del periodo, tambien las de sysfs
+*/
+struct pwm_embedded_shm_chan {
+	__u32 seq;
+	__u32 rng;
+	__u32 dat;
+	__u32 ack;
+	__u32 clock_hz;
+	__u32 errors;
+	__u32 deferred;
+	__u32 pad;
+};
+
+struct pwm_embedded_shm {
+	__u32 version;
+	__u32 period_ns;
+	__u32 pad[2];
+	struct pwm_embedded_shm_chan ch[PWM_EMBEDDED_CHANNELS];
+};
+
+/*
+read() devuelve una struct pwm_embedded_config como GET y write() acepta
+una como SET, el tamano debe ser exactamente sizeof(struct pwm_embedded_config).
+read() da la struct una vez por apertura y despues fin de fichero: para
+leer el estado otra vez, PWM_EMBEDDED_IOC_GET o abrir de nuevo
+*/
+
+#ifdef __KERNEL__
+/*
+Exportado para otros modulos (gpio_rules): duty de 1 a 99 % del PWM en
+marcha, se puede llamar desde una interrupcion. -ENODEV si esta parado
+*/
+int pwm_embedded_set_duty(unsigned int channel, u32 duty);
+#endif
+
+#endif /* _PWM_EMBEDDED_H */
@@ -0,0 +1,165 @@
+/*
+ * Lightweight binary event log for interrupt handlers.
+ *
+ * Each module owns a struct evlog: one ring of EVLOG_SZ records per CPU,
+ * written with interrupts off on the local CPU only, so evlog_write()
+ * never spins, allocates or touches the console. The history is dumped
+ * as text from /sys/kernel/debug/<name>/events, the oldest records
+ * being overwritten when a ring wraps.
+ *
+ *	enum { EV_IRQ, EV_TIMER };
+ *	static const char * const ev_names[] = { "irq", "timer" };
+ *	static struct evlog ev;
+ *
+ *	evlog_init(&ev, "mymod", ev_names, ARRAY_SIZE(ev_names));
+ *	evlog_write(&ev, EV_IRQ, irq, level);	// any context
+ *	evlog_exit(&ev);
+ *
+ * Header only, include it from the module that owns the log. Modules
+ * find it with  ccflags-y += -I$(src)/../include  in their Makefile.
+ *
+ * This software is licensed under the terms of the GNU General Public
+ * License version 2, as published by the Free Software Foundation, and
+ * may be copied, distributed, and modified under those terms.
+ */
+#ifndef _EVLOG_H
+#define _EVLOG_H
+
+#include <linux/types.h>
+#include <linux/module.h>
+#include <linux/percpu.h>
+#include <linux/irqflags.h>
+#include <linux/ktime.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/err.h>
+
+#ifndef EVLOG_SZ
+#define EVLOG_SZ	512	/* records per CPU, power of 2 */
+#endif
+
+struct evlog_rec {
+	u64 ts;			/* ktime_get_ns() */
+	u32 seq;		/* record number + 1, 0 while being written */
+	u32 id;			/* event id, index in the names table */
+	u32 arg[2];
+};
+
+struct evlog_cpu {
+	u32 head;		/* records ever written on this CPU */
+	struct evlog_rec rec[EVLOG_SZ];
+};
+
+struct evlog {
+	struct evlog_cpu __percpu *cpu;
+	const char * const *names;
+	unsigned int nb_names;
+	struct dentry *dir;
+};
+
+/*
+ * Append an event to the ring of the current CPU, callable from any
+ * context including hard interrupts. A reader on another CPU sees the
+ * record once seq is set, torn copies are detected and skipped.
+ */
+static inline void evlog_write(struct evlog *log, u32 id, u32 a0, u32 a1)
+{
+	struct evlog_cpu *c;
+	struct evlog_rec *r;
+	unsigned long flags;
+	u32 n;
+
+	if (unlikely(!log->cpu))
+		return;
+	local_irq_save(flags);
+	c = this_cpu_ptr(log->cpu);
+	n = c->head++;
+	r = &c->rec[n & (EVLOG_SZ - 1)];
+	WRITE_ONCE(r->seq, 0);
+	smp_wmb();
+	r->ts = ktime_get_ns();
+	r->id = id;
+	r->arg[0] = a0;
+	r->arg[1] = a1;
+	smp_wmb();
+	WRITE_ONCE(r->seq, n + 1);
+	local_irq_restore(flags);
+}
+
+/* One line per record: cpu, time in ns, event name and arguments */
+static inline int evlog_show(struct seq_file *m, void *v)
+{
+	struct evlog *log = m->private;
+	struct evlog_cpu *c;
+	struct evlog_rec r;
+	u32 head, n, seq;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		c = per_cpu_ptr(log->cpu, cpu);
+		head = READ_ONCE(c->head);
+		n = head > EVLOG_SZ ? head - EVLOG_SZ : 0;
+		for (; n != head; n++) {
+			const struct evlog_rec *s = &c->rec[n & (EVLOG_SZ - 1)];
+
+			seq = READ_ONCE(s->seq);
+			smp_rmb();
+			r = *s;
+			smp_rmb();
+			// being rewritten, or already overwritten by a newer one
+			if (seq != n + 1 || READ_ONCE(s->seq) != seq)
+				continue;
+			if (r.id < log->nb_names)
+				seq_printf(m, "%d %llu %s %u %u\n", cpu, r.ts,
+					log->names[r.id], r.arg[0], r.arg[1]);
+			else
+				seq_printf(m, "%d %llu %u %u %u\n", cpu, r.ts,
+					r.id, r.arg[0], r.arg[1]);
+		}
+	}
+	return 0;
+}
+
+static inline int evlog_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, evlog_show, inode->i_private);
+}
+
+static const struct file_operations evlog_fops = {
+	.owner = THIS_MODULE,
+	.open = evlog_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+/*
+ * Allocate the rings and create /sys/kernel/debug/<name>/events.
+ * A kernel without debugfs still records, the history is only lost.
+ */
+static inline int evlog_init(struct evlog *log, const char *name,
+		const char * const *names, unsigned int nb_names)
+{
+	log->names = names;
+	log->nb_names = nb_names;
+	log->cpu = alloc_percpu(struct evlog_cpu);
+	if (!log->cpu)
+		return -ENOMEM;
+	log->dir = debugfs_create_dir(name, NULL);
+	if (IS_ERR_OR_NULL(log->dir)) {
+		log->dir = NULL;
+		return 0;
+	}
+	debugfs_create_file("events", 0400, log->dir, log, &evlog_fops);
+	return 0;
+}
+
+static inline void evlog_exit(struct evlog *log)
+{
+	debugfs_remove_recursive(log->dir);
+	log->dir = NULL;
+	free_percpu(log->cpu);
+	log->cpu = NULL;
+}
+
+#endif /* _EVLOG_H */